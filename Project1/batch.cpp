@@ -0,0 +1,290 @@
+#include "batch.h"
+#include "bufferpool.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <dirent.h>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+#include <thread>
+
+const size_t QUEUE_DEPTH = 4;			// Decoded images waiting between two stages
+
+using Clock = chrono::steady_clock;
+
+// One file moving through the batch
+struct BatchItem
+{
+	string input;				// Input path
+	string output;				// Output path
+	Bitmap image;				// Decoded image, moved from stage to stage
+	string error;				// Why the file failed, empty while it has not
+	size_t bytes;				// Pixel bytes read
+	double readSeconds;
+	double computeSeconds;
+	double writeSeconds;
+};
+
+// Seconds elapsed since a time point
+// INPUT: Takes the start time
+// OUTPUT: Returns a double
+static double seconds_since(Clock::time_point start)
+{
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Returns true if a name ends with .bmp in any case
+// INPUT: Takes a file name
+// OUTPUT: Returns a boolean
+static bool is_bitmap_name(const string & name)
+{
+	if (name.size() < 4)
+	{
+		return false;
+	}
+
+	string extension = name.substr(name.size() - 4);
+
+	for (char & c : extension)
+	{
+		c = tolower(c);
+	}
+
+	return extension == ".bmp";
+}
+
+// List the input files of a batch
+// INPUT: Takes a directory or manifest path and the list to fill
+// OUTPUT: Returns false if the source could not be read
+static bool list_inputs(const string & source, vector<string> & inputs)
+{
+	struct stat info;
+
+	if (stat(source.c_str(), &info) != 0)
+	{
+		return false;
+	}
+
+	if (S_ISDIR(info.st_mode))
+	{
+		DIR * directory = opendir(source.c_str());
+
+		if (directory == nullptr)
+		{
+			return false;
+		}
+
+		while (dirent * entry = readdir(directory))
+		{
+			if (is_bitmap_name(entry->d_name))
+			{
+				inputs.push_back(source + "/" + entry->d_name);
+			}
+		}
+
+		closedir(directory);
+		sort(inputs.begin(), inputs.end());
+		return true;
+	}
+
+	ifstream manifest(source);
+	string line;
+
+	while (getline(manifest, line))							// One path per line
+	{
+		if (!line.empty() && line[0] != '#')
+		{
+			inputs.push_back(line);
+		}
+	}
+
+	return true;
+}
+
+// Describe an exception caught by a batch stage
+// INPUT: Takes the exception
+// OUTPUT: Returns a string
+static string describe(exception_ptr error)
+{
+	try
+	{
+		rethrow_exception(error);
+	}
+	catch (const exception & e)
+	{
+		return e.what();
+	}
+	catch (...)
+	{
+		return "unknown exception";
+	}
+}
+
+// Output path for an input file
+// INPUT: Takes the input path and the output directory
+// OUTPUT: Returns a string
+static string output_path(const string & input, const string & outputDirectory)
+{
+	size_t slash = input.find_last_of('/');
+
+	return outputDirectory + "/" + (slash == string::npos ? input : input.substr(slash + 1));
+}
+
+// Run a pipeline over many bitmaps with overlapped reading, filtering
+// and writing
+// INPUT: Takes the directory or manifest, the output directory and the
+// pipeline
+// OUTPUT: Returns false if the source could not be listed
+bool run_batch(const string & source, const string & outputDirectory, const Pipeline & pipeline)
+{
+	vector<string> inputs;
+
+	if (!list_inputs(source, inputs))
+	{
+		cout << "Error: could not list " << source << endl;
+		return false;
+	}
+
+	map<string, string> writers;							// Output path and the first input writing it
+	vector<string> clashes(inputs.size());
+
+	for (size_t i = 0; i < inputs.size(); i++)					// Later inputs may not overwrite earlier outputs
+	{
+		auto claim = writers.emplace(output_path(inputs[i], outputDirectory), inputs[i]);
+
+		if (!claim.second)
+		{
+			clashes[i] = "output " + claim.first->first + " is already written for " + claim.first->second;
+		}
+	}
+
+	mkdir(outputDirectory.c_str(), 0755);
+
+	BoundedQueue<BatchItem> decoded(QUEUE_DEPTH);
+	BoundedQueue<BatchItem> filtered(QUEUE_DEPTH);
+	Clock::time_point start = Clock::now();
+
+	thread reader([&]								// Read stage
+	{
+		for (size_t i = 0; i < inputs.size(); i++)
+		{
+			const string & input = inputs[i];
+			BatchItem item = {input, output_path(input, outputDirectory), Bitmap(), clashes[i], 0, 0.0, 0.0, 0.0};
+
+			if (!item.error.empty())
+			{
+				decoded.push(std::move(item));
+				continue;
+			}
+
+			Clock::time_point begin = Clock::now();
+
+			try
+			{
+				ifstream in(input, ios::binary);
+
+				if (in >> item.image)					// Bulk read so the disk work happens here
+				{
+					item.bytes = (size_t) item.image.get_stride() * abs(item.image.get_height());
+				}
+				else
+				{
+					item.error = "could not read";
+				}
+			}
+			catch (...)							// Only this file fails
+			{
+				item.error = "could not read, " + describe(current_exception());
+			}
+
+			item.readSeconds = seconds_since(begin);
+			decoded.push(std::move(item));
+		}
+
+		decoded.close();
+	});
+
+	int images = 0;
+	size_t totalBytes = 0;
+
+	thread writer([&]								// Write stage
+	{
+		BatchItem item;
+
+		while (filtered.pop(item))
+		{
+			if (!item.error.empty())
+			{
+				cout << item.input << ": error, " << item.error << endl;
+				continue;
+			}
+
+			Clock::time_point begin = Clock::now();
+			bool written = false;
+
+			try
+			{
+				written = item.image.write_file(item.output);
+			}
+			catch (...)
+			{
+				item.error = describe(current_exception());
+			}
+
+			item.writeSeconds = seconds_since(begin);
+
+			if (!written)
+			{
+				cout << item.output << ": error, could not write" << (item.error.empty() ? "" : ", " + item.error) << endl;
+				continue;
+			}
+
+			double busy = item.readSeconds + item.computeSeconds + item.writeSeconds;
+
+			cout << item.input << ": " << item.bytes / 1e6 << " MB, read " << item.readSeconds * 1e3
+			     << " ms, filter " << item.computeSeconds * 1e3 << " ms, write " << item.writeSeconds * 1e3
+			     << " ms, " << item.bytes / 1e6 / busy << " MB/s" << endl;
+
+			images++;
+			totalBytes += item.bytes;
+		}
+	});
+
+	BatchItem item;
+
+	while (decoded.pop(item))							// Filter stage, on the thread pool
+	{
+		if (item.error.empty())
+		{
+			Clock::time_point begin = Clock::now();
+
+			try
+			{
+				pipeline.run(item.image);
+			}
+			catch (...)
+			{
+				item.error = "could not filter, " + describe(current_exception());
+			}
+
+			item.computeSeconds = seconds_since(begin);
+		}
+
+		filtered.push(std::move(item));
+	}
+
+	filtered.close();
+	reader.join();
+	writer.join();
+
+	double elapsed = seconds_since(start);
+
+	cout << images << " of " << inputs.size() << " images in " << elapsed << " s: " << images / elapsed
+	     << " images/s, " << totalBytes / 1e6 / elapsed << " MB/s, " << buffer_pool().mapped()
+	     << " pixel buffers allocated, " << buffer_pool().reused() << " reused" << endl;
+
+	return true;
+}
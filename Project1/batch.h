@@ -0,0 +1,71 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include "pipeline.h"
+
+// Fixed capacity queue connecting two pipeline stages
+// push() blocks while the queue is full and pop() while it is empty, so
+// a fast stage cannot run ahead of a slow one by more than the capacity
+template <class T>
+class BoundedQueue
+{
+	private:
+
+		deque<T> _items;
+		size_t _capacity;
+		bool _closed;				// No more items will be pushed
+		mutex _lock;
+		condition_variable _notFull;
+		condition_variable _notEmpty;
+
+	public:
+
+		BoundedQueue(size_t capacity) : _capacity(capacity), _closed(false) {}
+
+		void push(T item)				// Wait for room, then add an item
+		{
+			unique_lock<mutex> lock(_lock);
+			_notFull.wait(lock, [&] { return _items.size() < _capacity; });
+			_items.push_back(std::move(item));
+			_notEmpty.notify_one();
+		}
+
+		bool pop(T & item)				// Wait for an item, false once closed and drained
+		{
+			unique_lock<mutex> lock(_lock);
+			_notEmpty.wait(lock, [&] { return !_items.empty() || _closed; });
+
+			if (_items.empty())
+			{
+				return false;
+			}
+
+			item = std::move(_items.front());
+			_items.pop_front();
+			_notFull.notify_one();
+			return true;
+		}
+
+		void close()					// Wake consumers once the queue drains
+		{
+			lock_guard<mutex> lock(_lock);
+			_closed = true;
+			_notEmpty.notify_all();
+		}
+};
+
+// Run a pipeline over many bitmaps
+// The source is a directory (every .bmp in it) or a manifest listing one
+// input file per line; outputs go to the output directory under the input
+// file names, and an input whose name another input already uses fails
+// instead of overwriting its output. A reader thread, the filters and a writer thread run at
+// the same time, connected by bounded queues, and per file and total
+// throughput is printed as files finish
+// Returns false if the source could not be listed
+bool run_batch(const string & source, const string & outputDirectory, const Pipeline & pipeline);
+
+#endif
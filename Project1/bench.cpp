@@ -0,0 +1,400 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bitmap.h"
+#include "convolve.h"
+#include "dither.h"
+#include "histogram.h"
+#include "integral.h"
+#include "rank.h"
+#include "resample.h"
+#include "threadpool.h"
+
+using Clock = chrono::steady_clock;
+
+// Timing summary of one benchmark case
+struct Timing
+{
+	double mean;				// Seconds per run
+	double deviation;			// Standard deviation of the runs in seconds
+	double best;				// Fastest run in seconds
+};
+
+// Append a little endian value to a byte string
+// INPUT: Takes the string, the value and its size in bytes
+// OUTPUT: Does not return
+static void put(string & bytes, uint32_t value, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		bytes.push_back((char) (value >> (8 * i)));
+	}
+}
+
+// Build a BMP file in memory
+// Pixels are a gradient with pseudo random noise, so table lookups and
+// branches see realistic data rather than a constant
+// INPUT: Takes the width, height and color depth (24 or 32)
+// OUTPUT: Returns the file bytes
+static string synthesize(int width, int height, int depth)
+{
+	int step = depth / 8;
+	int stride = ((width * depth + 31) / 32) * 4;
+	uint32_t pixels = (uint32_t) stride * height;
+	string bytes;
+
+	bytes += "BM";									// Header one
+	put(bytes, 14 + 40 + pixels, 4);
+	put(bytes, 0, 4);
+	put(bytes, 14 + 40, 4);
+
+	put(bytes, 40, 4);								// Header two
+	put(bytes, width, 4);
+	put(bytes, height, 4);
+	put(bytes, 1, 2);
+	put(bytes, depth, 2);
+	put(bytes, 0, 4);
+	put(bytes, pixels, 4);
+	put(bytes, 2835, 4);
+	put(bytes, 2835, 4);
+	put(bytes, 0, 4);
+	put(bytes, 0, 4);
+
+	uint32_t seed = 2463534242u;
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			seed ^= seed << 13;						// xorshift32
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+
+			bytes.push_back((char) (x * 255 / width + (seed & 31)));	// Blue
+			bytes.push_back((char) (y * 255 / height + (seed >> 8 & 31)));	// Green
+			bytes.push_back((char) ((x + y) * 127 / (width + height) + (seed >> 16 & 63)));	// Red
+
+			if (step == 4)
+			{
+				bytes.push_back((char) 255);				// Alpha
+			}
+		}
+
+		bytes.append(stride - width * step, '\0');				// Row padding
+	}
+
+	return bytes;
+}
+
+// Decode a BMP held in memory
+// INPUT: Takes the file bytes
+// OUTPUT: Returns a Bitmap
+static Bitmap decode(const string & bytes)
+{
+	istringstream in(bytes);
+	Bitmap b;
+	in >> b;
+
+	return b;
+}
+
+// Cell shading as originally written, one get and set per component
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+static void reference_cell_shade(Bitmap & b)
+{
+	int height = b.get_height();
+	int width = b.get_width();
+
+	for (int i = 0; i < height; i++)
+	{
+		for (int j = 0; j < width; j++)
+		{
+			int red = b.get_red(j, i);
+			b.set_red(j, i, red <= 64 ? 0 : red <= 192 ? 128 : 255);
+
+			int green = b.get_green(j, i);
+			b.set_green(j, i, green <= 64 ? 0 : green <= 192 ? 128 : 255);
+
+			int blue = b.get_blue(j, i);
+			b.set_blue(j, i, blue <= 64 ? 0 : blue <= 192 ? 128 : 255);
+		}
+	}
+}
+
+// Gray scale as originally written
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+static void reference_grayscale(Bitmap & b)
+{
+	int height = b.get_height();
+	int width = b.get_width();
+
+	for (int i = 0; i < height; i++)
+	{
+		for (int j = 0; j < width; j++)
+		{
+			int value = (b.get_red(j, i) + b.get_green(j, i) + b.get_blue(j, i)) / 3;
+
+			b.set_red(j, i, value);
+			b.set_green(j, i, value);
+			b.set_blue(j, i, value);
+		}
+	}
+}
+
+// 16x16 pixelate as originally written, summing every block pixel
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+static void reference_pixelate(Bitmap & b)
+{
+	int height = b.get_height();
+	int width = b.get_width();
+
+	for (int y = 0; y <= height - 16; y += 16)
+	{
+		for (int x = 0; x <= width - 16; x += 16)
+		{
+			int red = 0;
+			int green = 0;
+			int blue = 0;
+
+			for (int i = 0; i < 16; i++)
+			{
+				for (int j = 0; j < 16; j++)
+				{
+					red += b.get_red(x + j, y + i);
+					green += b.get_green(x + j, y + i);
+					blue += b.get_blue(x + j, y + i);
+				}
+			}
+
+			for (int i = 0; i < 16; i++)
+			{
+				for (int j = 0; j < 16; j++)
+				{
+					b.set_red(x + j, y + i, red / 256);
+					b.set_green(x + j, y + i, green / 256);
+					b.set_blue(x + j, y + i, blue / 256);
+				}
+			}
+		}
+	}
+}
+
+// 5x5 Gaussian as a direct two dimensional sum at every pixel with get
+// and set, the cost the separable blur replaced
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+static void reference_blur(Bitmap & b)
+{
+	const int weights[5] = {1, 4, 6, 4, 1};
+	Bitmap source(b);
+	int height = b.get_height();
+	int width = b.get_width();
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			int red = 128;
+			int green = 128;
+			int blue = 128;
+
+			for (int i = -2; i <= 2; i++)
+			{
+				int sy = y + i < 0 ? 0 : y + i >= height ? height - 1 : y + i;
+
+				for (int j = -2; j <= 2; j++)
+				{
+					int sx = x + j < 0 ? 0 : x + j >= width ? width - 1 : x + j;
+					int w = weights[i + 2] * weights[j + 2];
+
+					red += w * source.get_red(sx, sy);
+					green += w * source.get_green(sx, sy);
+					blue += w * source.get_blue(sx, sy);
+				}
+			}
+
+			b.set_red(x, y, red / 256);
+			b.set_green(x, y, green / 256);
+			b.set_blue(x, y, blue / 256);
+		}
+	}
+}
+
+// Time a case over a number of runs
+// Setup (such as restoring the input image) runs before each timed run
+// and is not counted
+// INPUT: Takes the run count, the setup and the timed body
+// OUTPUT: Returns a Timing
+static Timing measure(int runs, const function<void()> & setup, const function<void()> & body)
+{
+	vector<double> seconds;
+
+	setup();									// Warm up caches and the pool
+	body();
+
+	for (int r = 0; r < runs; r++)
+	{
+		setup();
+
+		Clock::time_point start = Clock::now();
+		body();
+		seconds.push_back(chrono::duration<double>(Clock::now() - start).count());
+	}
+
+	Timing t = {0.0, 0.0, seconds[0]};
+
+	for (double s : seconds)
+	{
+		t.mean += s / runs;
+		t.best = s < t.best ? s : t.best;
+	}
+
+	for (double s : seconds)
+	{
+		t.deviation += (s - t.mean) * (s - t.mean) / runs;
+	}
+
+	t.deviation = sqrt(t.deviation);
+
+	return t;
+}
+
+// Print one result row
+// INPUT: Takes the case name, the timing, the pixel count and the bytes processed
+// OUTPUT: Does not return
+static void report(const string & name, const Timing & t, double pixels, double bytes)
+{
+	cout << "  " << left << setw(18) << name << right << fixed
+	     << setw(10) << setprecision(3) << t.mean * 1e9 / pixels << " ns/px"
+	     << setw(10) << setprecision(1) << bytes / t.mean / 1e6 << " MB/s"
+	     << setw(9) << setprecision(1) << (t.mean > 0 ? t.deviation / t.mean * 100.0 : 0.0) << " % dev"
+	     << setw(11) << setprecision(3) << t.best * 1e3 << " ms best" << endl;
+}
+
+// Benchmark every decode, filter and encode path on synthetic images
+// usage: bench [-n runs] [-j threads] [WxH ...]
+int main(int argc, char ** argv)
+{
+	int runs = 10;
+	vector<pair<int, int>> sizes;
+
+	for (int i = 1; i < argc; i++)
+	{
+		string option(argv[i]);
+		int width = 0;
+		int height = 0;
+
+		if (option == "-n" && i + 1 < argc)
+		{
+			runs = atoi(argv[++i]);
+		}
+		else if (option == "-j" && i + 1 < argc)
+		{
+			set_thread_count(atoi(argv[++i]));
+		}
+		else if (sscanf(option.c_str(), "%dx%d", &width, &height) == 2 && width > 0 && height > 0)
+		{
+			sizes.push_back({width, height});
+		}
+		else
+		{
+			cout << "usage: bench [-n runs] [-j threads] [WIDTHxHEIGHT ...]" << endl;
+			return 0;
+		}
+	}
+
+	if (sizes.empty())
+	{
+		sizes = {{640, 480}, {1920, 1080}, {4000, 3000}};
+	}
+
+	runs = runs < 1 ? 1 : runs;
+
+	Kernel gaussian5 = kernel_of<Gaussian5>();					// Run time kernels, the first of rank one
+	Kernel laplacian5 = {5, {0, 0, -1, 0, 0, 0, -1, -2, -1, 0, -1, -2, 17, -2, -1, 0, -1, -2, -1, 0, 0, 0, -1, 0, 0}, 0, 0};
+
+	vector<pair<string, function<void(Bitmap &)>>> filters =
+	{
+		{"cellShade", [](Bitmap & b) { cellShade(b); }},
+		{"cellShade bayer", [](Bitmap & b) { cellShade(b, DITHER_ORDERED); }},
+		{"cellShade floyd", [](Bitmap & b) { cellShade(b, DITHER_FLOYD_STEINBERG); }},
+		{"grayscale", [](Bitmap & b) { grayscale(b); }},
+		{"grayscale bt709", [](Bitmap & b) { grayscale(b, GRAY_BT709); }},
+		{"histogram", [](Bitmap & b) { histogram(b); }},
+		{"equalize", [](Bitmap & b) { equalize(b); }},
+		{"autolevels", [](Bitmap & b) { auto_level(b); }},
+		{"pixelate", [](Bitmap & b) { pixelate(b); }},
+		{"blur", [](Bitmap & b) { blur(b); }},
+		{"sharpen", [](Bitmap & b) { convolve<Sharpen3>(b); }},
+		{"sobel x", [](Bitmap & b) { convolve<SobelX3>(b); }},
+		{"kernel 5x5 rank 1", [&](Bitmap & b) { convolve(b, gaussian5); }},
+		{"kernel 5x5", [&](Bitmap & b) { convolve(b, laplacian5); }},
+		{"gaussian 3.0", [](Bitmap & b) { gaussian_blur(b, 3.0); }},
+		{"recursive 3.0", [](Bitmap & b) { recursive_gaussian_blur(b, 3.0); }},
+		{"recursive 20.0", [](Bitmap & b) { recursive_gaussian_blur(b, 20.0); }},
+		{"box 8", [](Bitmap & b) { box_blur(b, 8); }},
+		{"median 2", [](Bitmap & b) { median_filter(b, 2); }},
+		{"median 20", [](Bitmap & b) { median_filter(b, 20); }},
+		{"erode 2", [](Bitmap & b) { erode(b, 2); }},
+		{"erode 20", [](Bitmap & b) { erode(b, 20); }},
+		{"rot90", [](Bitmap & b) { rot90(b); }},
+		{"fliph", [](Bitmap & b) { fliph(b); }},
+		{"scaleUp", [](Bitmap & b) { scaleUp(b); }},
+		{"scaleDown", [](Bitmap & b) { scaleDown(b); }},
+		{"lanczos 1/3", [](Bitmap & b) { resample(b, b.get_width() / 3 + 1, b.get_height() / 3 + 1, RESAMPLE_LANCZOS); }},
+		{"ref cellShade", reference_cell_shade},
+		{"ref grayscale", reference_grayscale},
+		{"ref pixelate", reference_pixelate},
+		{"ref blur", reference_blur}
+	};
+
+	cout << thread_count() << " threads, " << runs << " runs per case" << endl;
+
+	for (auto & size : sizes)
+	{
+		for (int depth : {24, 32})
+		{
+			string file = synthesize(size.first, size.second, depth);
+			Bitmap original = decode(file);
+			double pixels = (double) size.first * size.second;
+			double bytes = (double) original.get_stride() * original.get_height();
+			Bitmap work;
+
+			cout << size.first << "x" << size.second << " " << depth << " bit" << endl;
+
+			report("decode", measure(runs, [] {}, [&] { work = decode(file); }), pixels, bytes);
+
+			report("encode", measure(runs, [] {}, [&]
+			{
+				ostringstream out;
+				out << original;
+			}), pixels, bytes);
+
+			if (depth == 24)
+			{
+				Bitmap normalized = original;
+				normalized.normalize();
+
+				report("normalize", measure(runs, [&] { work = original; }, [&] { work.normalize(); }), pixels, bytes);
+				report("denormalize", measure(runs, [&] { work = normalized; }, [&] { work.denormalize(); }), pixels, bytes);
+			}
+
+			for (auto & filter : filters)
+			{
+				report(filter.first, measure(runs, [&] { work = original; }, [&] { filter.second(work); }), pixels, bytes);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -1,4 +1,16 @@
 #include "bitmap.h"
+#include "simd.h"
+#include "pointops.h"
+#include "profile.h"
+#include "rle.h"
+#include "threadpool.h"
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
 
 // Cell shading
 // Adjusts individual pixel component values to nearest value of {0, 128, 255}
@@ -6,57 +18,26 @@
 // OUTPUT: Does not return
 void cellShade(Bitmap & b)
 {
-	int height = b.get_height();			// Get height
-	int width = b.get_width();			// Get width
+	PointOps().cell_shade().apply(b);
+}
 
-	for (int i = 0; i < height; i++)		
+// Gray scale kernel for one pixel format
+// INPUT: Takes the rows of a bitmap, its format and the gray weights
+// OUTPUT: Does not return
+template <class Format>
+static void grayscale_rows(PixelRows rows, Format format, const GrayWeights & w)
+{
+	for (int y = 0; y < rows.height(); y++)				// Traverse all rows
 	{
-		for (int j = 0; j < width; j++)
+		FormatRow<Format> row = {rows[y].pixels, format};
+
+		for (int x = 0; x < rows.width(); x++)
 		{
-			int redComponent = b.get_red(j, i);				// Get red component
-
-			if (redComponent >= 0 && redComponent <= 64)			// Set red component
-			{
-				b.set_red(j, i, 0);
-			}
-			else if (redComponent > 64 && redComponent <= 192)
-			{
-				b.set_red(j, i, 128);
-			}
-			else
-			{
-				b.set_red(j, i, 255);
-			}
-
-			int greenComponent = b.get_green(j, i);				// Get green component
-
-			if (greenComponent >= 0 && greenComponent <= 64)		// Set green component
-			{
-				b.set_green(j, i, 0);
-			}
-			else if (greenComponent > 64 && greenComponent <= 192)
-			{
-				b.set_green(j, i, 128);
-			}
-			else
-			{
-				b.set_green(j, i, 255);
-			}
-
-			int blueComponent = b.get_blue(j, i);				// Get blue component
-
-			if (blueComponent >= 0 && blueComponent <= 64)			// Set blue component
-			{
-				b.set_blue(j, i, 0);
-			}
-			else if (blueComponent > 64 && blueComponent <= 192)
-			{
-				b.set_blue(j, i, 128);
-			}
-			else
-			{
-				b.set_blue(j, i, 255);
-			}
+			uint8_t value = (row.r(x) * w.red + row.g(x) * w.green + row.b(x) * w.blue + w.bias) >> w.shift;	// Weighted average
+
+			row.r(x) = value;					// Set component values
+			row.g(x) = value;
+			row.b(x) = value;
 		}
 	}
 }
@@ -67,155 +48,293 @@ void cellShade(Bitmap & b)
 // OUTPUT: Does not return
 void grayscale(Bitmap & b)
 {
-	int height = b.get_height();			// Get height
-	int width = b.get_width();			// Get width
+	grayscale(b, GRAY_AVERAGE);
+}
+
+// Gray scale with a choice of channel weighting
+// Runs the SSE4.1 or AVX2 row kernel picked at startup, or the scalar
+// kernel when the processor has neither, on row bands in parallel
+// INPUT: Takes a reference to a bitmap object and a GrayMode
+// OUTPUT: Does not return
+void grayscale(Bitmap & b, GrayMode mode)
+{
+	PixelRows rows = b.rows();
+	RuntimeFormat layout = b.get_layout();
+	GrayWeights weights = gray_weights(mode);
 
-	for (int i = 0; i < height; i++)		// Traverse all bitmap (x, y) pairs
+	parallel_rows(rows.height(), [&](const Band & band)
 	{
-		for (int j = 0; j < width; j++)
-		{
-			int value = (b.get_red(j, i) + b.get_green(j, i) + b.get_blue(j, i)) / 3;	// Average component values
+		PixelRows part = rows.band(band.first, band.last);
 
-			b.set_red(j, i, value);		// Set component values
-			b.set_green(j, i, value);
-			b.set_blue(j, i, value);
+		if (!gray_rows_simd(part, layout, weights))
+		{
+			dispatch_format(b, [&](auto format) { grayscale_rows(part, format, weights); });
 		}
+	});
+}
+
+// Unchecked row view of the pixel data
+// Rows are in file order, top down images included
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a PixelRows view
+PixelRows Bitmap::rows()
+{
+	PixelRow layout = {nullptr, width, get_step(), redPixelOffset, greenPixelOffset, bluePixelOffset};
+
+	return PixelRows(_data.data(), rowStride, row_count(), layout);
+}
+
+// Returns the number of rows of pixel data
+// A negative height only says the rows are stored top down
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int Bitmap::row_count() const
+{
+	return height < 0 ? -height : height;
+}
+
+// Returns a pointer to the first byte of row y
+// Row 0 is the first row stored in the file
+// INPUT: Takes a row index
+// OUTPUT: Returns a pointer
+uint8_t * Bitmap::row(int y)
+{
+	return _data.data() + (size_t) y * rowStride;
+}
+
+// Returns the number of bytes between rows, padding included
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int Bitmap::get_stride() const
+{
+	return rowStride;
+}
+
+// Returns the number of bytes per pixel
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int Bitmap::get_step() const
+{
+	return colorDepth / 8;
+}
+
+// Returns the channel layout of the pixel data
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a PixelFormatId
+PixelFormatId Bitmap::get_format() const
+{
+	int layout = redPixelOffset * 100 + greenPixelOffset * 10 + bluePixelOffset;	// Offsets as digits
+
+	if (colorDepth == 24)
+	{
+		return layout == 210 ? FORMAT_BGR24 : FORMAT_OTHER;
 	}
+
+	switch (layout)
+	{
+		case 210:	return FORMAT_BGRA32;
+		case 12:	return FORMAT_RGBA32;
+		case 123:	return FORMAT_ARGB32;
+		case 321:	return FORMAT_ABGR32;
+	}
+
+	return FORMAT_OTHER;
 }
 
-// Pixelate 16x16
-// Averages the pixel component values across a 16x16 block of pixels
-// INPUT: Takes a reference to a bitmap object as input
+// Returns the channel layout as run time values
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a RuntimeFormat
+RuntimeFormat Bitmap::get_layout() const
+{
+	RuntimeFormat layout = {get_step(), redPixelOffset, greenPixelOffset, bluePixelOffset};
+
+	return layout;
+}
+
+static bool normalizeOnLoad = false;						// Set once by main before any loading
+
+// Normalize every bitmap as it is loaded and pack it again as it is
+// written, so filters only ever see the 4 byte per pixel path
+// INPUT: Takes a boolean
 // OUTPUT: Does not return
-void pixelate(Bitmap & b)
+void set_normalize_on_load(bool on)
 {
-	int height = b.get_height();
-	int width = b.get_width();
+	normalizeOnLoad = on;
+}
 
-	int redSum = 0;									// Storage for sums
-	int greenSum = 0;
-	int blueSum = 0;
+// Returns true if bitmaps are normalized as they are loaded
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool normalize_on_load()
+{
+	return normalizeOnLoad;
+}
 
-	int redAverage = 0;								// Storage for averages
-	int greenAverage = 0;
-	int blueAverage = 0;
+// Convert the pixels to the normalized layout: BGRA32 with no row
+// padding, so every row starts 4 byte aligned in the page aligned
+// buffer and filters can use full width vector loads. 24 bit files
+// gain an opaque alpha byte; 32 bit files with other masks are
+// reordered. The headers still describe the file and are untouched.
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+void Bitmap::normalize()
+{
+	if (colorDepth == 0 || get_format() == FORMAT_BGRA32)			// Nothing to convert
+	{
+		return;
+	}
+
+	int rowsCount = row_count();
+	int stride = width * 4;
+	ProfileScope scope("normalize", pixel_bytes() + (size_t) stride * rowsCount);
+	RuntimeFormat layout = get_layout();
+	PixelBuffer expanded;
+
+	expanded.allocate((size_t) stride * rowsCount);
 
-	for (int y = 0; y <= height - 16; y+=16)					// Traverse all 16x16 blocks of pixels
+	const uint8_t * source = as_const(_data).data();
+	uint8_t * destination = expanded.data();
+	int sourceStride = rowStride;
+
+	parallel_rows(rowsCount, [&](const Band & band)
 	{
-		for (int x = 0; x <= width - 16; x+=16)
+		for (int y = band.first; y < band.last; y++)
 		{
-			for (int i = 0; i < 16; i++)					// Collect 16x16 block
-			{
-				for (int j = 0; j < 16; j++)
-				{	
-					redSum += b.get_red(x + j, y + i);		// Update sums
-					greenSum += b.get_green(x + j, y + i);
-					blueSum += b.get_blue(x + j, y + i);
-				}
-			}
-
-			redAverage = redSum / 256;					// Calculate averages
-			greenAverage = greenSum / 256;
-			blueAverage = blueSum / 256;
-
-			for (int k = 0; k < 16; k++)					// Traverse 16x16 block
-			{
-				for (int l = 0; l < 16; l++)
-				{	
-					b.set_red(x + k, y + l, redAverage);		// Set component values
-					b.set_green(x + k, y + l, greenAverage);
-					b.set_blue(x + k, y + l, blueAverage);
-				}
-			}
-			
-			redSum = 0;							// Reset sums
-			greenSum = 0;
-			blueSum = 0;
-
-			redAverage = 0;							// Reset averages
-			greenAverage = 0;
-			blueAverage = 0;
+			expand_row(source + (size_t) y * sourceStride, destination + (size_t) y * stride, width, layout);
 		}
-	}
+	});
+
+	_data = std::move(expanded);
+	colorDepth = 32;
+	rowStride = stride;
+	pixelPadding = 0;
+	redPixelOffset = 2;
+	greenPixelOffset = 1;
+	bluePixelOffset = 0;
 }
 
-// Gaussian Blurring
-// Sets the pixel component values to the sum of the gaussian matrix
-// for the surrounding 5x5 block of pixels
-// INPUT: Takes a reference to a bitmap object as input
+// Convert the pixels back to the layout the headers describe
+// INPUT: Does not take input parameters
 // OUTPUT: Does not return
-void blur(Bitmap & b)
+void Bitmap::denormalize()
+{
+	if (!normalized())
+	{
+		return;
+	}
+
+	_data = packed_pixels();
+	colorDepth = _fileLayout.step * 8;
+	rowStride = file_stride();
+	pixelPadding = rowStride - width * _fileLayout.step;
+	redPixelOffset = _fileLayout.red;
+	greenPixelOffset = _fileLayout.green;
+	bluePixelOffset = _fileLayout.blue;
+}
+
+// Returns true while the pixels are held in a layout other than the file's
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool Bitmap::normalized() const
 {
-	int denominator = 256;
+	return colorDepth != 0 && (get_step() != _fileLayout.step || redPixelOffset != _fileLayout.red
+	       || greenPixelOffset != _fileLayout.green || bluePixelOffset != _fileLayout.blue);
+}
 
-	int numerator[25] = {1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4, 1, 4, 6, 4, 1};
-	
-	int height = b.get_height();
-	int width = b.get_width();
+// Returns the row stride of the file's pixel layout
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int Bitmap::file_stride() const
+{
+	return ((width * _fileLayout.step * 8 + 31) / 32) * 4;
+}
 
-	double redBlur = 0.0;								// Storage for blur values
-	double greenBlur = 0.0;
-	double blueBlur = 0.0;
+// Returns the size of the file's pixel array in bytes
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t Bitmap::file_pixel_bytes() const
+{
+	return (size_t) file_stride() * row_count();
+}
+
+// Pixels in the file layout, for writing a normalized bitmap
+// Row padding is zeroed
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a new pixel buffer
+PixelBuffer Bitmap::packed_pixels() const
+{
+	int rowsCount = row_count();
+	int stride = file_stride();
+	int used = width * _fileLayout.step;
+	ProfileScope scope("denormalize", pixel_bytes() + file_pixel_bytes());
+	PixelBuffer packed;
 
-	for (int y = 2; y <= height - 2 - 1; y += 5)					// Traverse all 5x5 blocks of pixels
+	packed.allocate(file_pixel_bytes());
+
+	const uint8_t * source = as_const(_data).data();
+	uint8_t * destination = packed.data();
+	RuntimeFormat layout = _fileLayout;
+	int sourceStride = rowStride;
+
+	parallel_rows(rowsCount, [&](const Band & band)
 	{
-		for (int x = 2; x <= width - 2 - 1; x += 5)
+		for (int y = band.first; y < band.last; y++)
 		{
-			int index = 0;							// Index for matrix access
-
-			for (int i = y - 2; i <= y + 2; i++)				// Collect 5x5 block
-			{
-				for (int j = x - 2; j <= x + 2; j++)
-				{
-					redBlur += ((b.get_red(j, i) * numerator[index]) / denominator);		// Add calculated blur values to sum
-					greenBlur += ((b.get_green(j, i) * numerator[index]) / denominator);
-					blueBlur += ((b.get_blue(j, i) * numerator[index]) / denominator);
-					index++;									// Increment index
-				}
-			}
-
-			if (redBlur < 0.0)						// Constrain red, gree, blue to 0 - 255
-			{
-				redBlur = 0.0;
-			}
-			else if (redBlur > 255.0)
-			{
-				redBlur = 255.0;
-			}
-			if (greenBlur < 0.0)
-			{
-				greenBlur = 0.0;
-			}
-			else if (greenBlur > 255.0)
-			{
-				greenBlur = 255.0;
-			}
-			if (blueBlur < 0.0)
-			{
-				blueBlur = 0.0;
-			}
-			else if (blueBlur > 255.0)
-			{
-				blueBlur = 255.0;
-			}
-
-			for (int i = y - 2; i <= y + 2; i++)				// Traverse 5x5 block
-			{
-				for (int j = x - 2; j <= x + 2; j++)
-				{
-					b.set_red(j, i, (int) redBlur);			// Set red, green, blue values
-					b.set_green(j, i, (int) greenBlur);
-					b.set_blue(j, i, (int) blueBlur);
-				}
-			}
-
-			index = 0;		// Reset index
-
-			redBlur = 0.0;		// Reset blur values
-			greenBlur = 0.0;
-			blueBlur = 0.0;
+			uint8_t * out = destination + (size_t) y * stride;
+
+			pack_row(source + (size_t) y * sourceStride, out, width, layout);
+			memset(out + used, 0, stride - used);				// Padding
 		}
-	}
+	});
+
+	return packed;
+}
+
+// Write a little endian 32 bit value into raw header bytes
+// INPUT: Takes a pointer to four bytes and the value
+// OUTPUT: Does not return
+static void write_u32(char * bytes, uint32_t value)
+{
+	bytes[0] = value;
+	bytes[1] = value >> 8;
+	bytes[2] = value >> 16;
+	bytes[3] = value >> 24;
+}
+
+// Returns the row stride for a width in this bitmap's pixel format
+// INPUT: Takes a width in pixels
+// OUTPUT: Returns an integer
+int Bitmap::stride_for(int pixels) const
+{
+	return ((pixels * colorDepth + 31) / 32) * 4;
+}
+
+// Change the dimensions of the bitmap
+// Updates the size fields of the headers and gives the bitmap a fresh
+// zero filled pixel array; the previous pixels are handed back so a
+// geometry filter can read from them while it fills the new array.
+// Top down bitmaps stay top down.
+// INPUT: Takes the new width and number of rows
+// OUTPUT: Returns the previous pixel data
+PixelBuffer Bitmap::reshape(int newWidth, int newHeight)
+{
+	PixelBuffer previous(std::move(_data));
+
+	width = newWidth;
+	height = height < 0 ? -newHeight : newHeight;
+	rowStride = stride_for(width);
+	pixelPadding = rowStride - width * get_step();
+
+	_data = PixelBuffer();
+	_data.resize(pixel_bytes());
+
+	size = file_bytes();
+	write_u32(&_headerOne[2], size);						// File size
+	write_u32(&_headerTwo[4], width);						// Width
+	write_u32(&_headerTwo[8], height);						// Height
+	write_u32(&_headerTwo[20], file_pixel_bytes());					// Image size
+
+	return previous;
 }
 
 // Returns the height of the bitmap
@@ -240,22 +359,13 @@ int Bitmap::get_width()
 // OUTPUT: Returns an integer, -1 if get unsuccessful
 int Bitmap::get_red(int x, int y)
 {
-	if (x >= 0 && x < width && y >= 0 && y < height)				// Error check
+	if (x >= 0 && x < width && y >= 0 && y < row_count())				// Error check
 	{
-		int location;
-	
-		if (colorDepth == 24)
-		{
-			location = (width * y + x) * 3;					// RGB
-		}
-		else
-		{
-			location = (width * y + x) * 4;					// RGBs
-		}
+		size_t location = (size_t) y * rowStride + x * get_step();		// Row start plus pixel, padding included
 
 		location += redPixelOffset;						// Add offset for red component
 
-		return (int) _data.at(location);
+		return (int) _data[location];
 	}
 	else
 	{
@@ -269,22 +379,13 @@ int Bitmap::get_red(int x, int y)
 // OUTPUT: Returns an integer, -1 if get unsuccessful
 int Bitmap::get_green(int x, int y)
 {
-	if (x >= 0 && x < width && y >= 0 && y < height)				// Error check
+	if (x >= 0 && x < width && y >= 0 && y < row_count())				// Error check
 	{
-		int location;
-	
-		if (colorDepth == 24)
-		{
-			location = (width * y + x) * 3;					// RGB
-		}
-		else
-		{
-			location = (width * y + x) * 4;					// RGBs
-		}
+		size_t location = (size_t) y * rowStride + x * get_step();		// Row start plus pixel, padding included
 
 		location += greenPixelOffset;						// Add offset for green component
 	
-		return (int) _data.at(location);
+		return (int) _data[location];
 	}
 	else
 	{
@@ -298,22 +399,13 @@ int Bitmap::get_green(int x, int y)
 // OUTPUT: Returns an integer, -1 if get unsuccessful
 int Bitmap::get_blue(int x, int y)
 {
-	if (x >= 0 && x < width && y >= 0 && y < height)				// Error check
+	if (x >= 0 && x < width && y >= 0 && y < row_count())				// Error check
 	{
-		int location;
-
-		if (colorDepth == 24)
-		{
-			location = (width * y + x) * 3	;				// RGB
-		}
-		else
-		{
-			location = (width * y + x) * 4;					// RGBs
-		}
+		size_t location = (size_t) y * rowStride + x * get_step();		// Row start plus pixel, padding included
 
 		location += bluePixelOffset;						// Add offset for blue component
 
-		return (int) _data.at(location);
+		return (int) _data[location];
 	}
 	else
 	{
@@ -327,22 +419,13 @@ int Bitmap::get_blue(int x, int y)
 // OUTPUT: Returns an integer, -1 if set unsuccessful
 int Bitmap::set_red(int x, int y, int value)
 {
-	if (value <= 255 && value >= 0 && x >= 0 && x < width && y >= 0 && y < height)		// Error check
+	if (value <= 255 && value >= 0 && x >= 0 && x < width && y >= 0 && y < row_count())		// Error check
 	{
-		int location;
-	
-		if (colorDepth == 24)
-		{
-			location = (width * y + x) * 3;					// RGB
-		}
-		else
-		{
-			location = (width * y + x) * 4;					// RGBs
-		}
+		size_t location = (size_t) y * rowStride + x * get_step();		// Row start plus pixel, padding included
 
 		location += redPixelOffset;						// Add offset for red component
 
-		_data.at(location) = value;						// Set value in vector
+		_data[location] = value;						// Set value in vector
 		return value;
 	}
 	else
@@ -357,22 +440,13 @@ int Bitmap::set_red(int x, int y, int value)
 // OUTPUT: Returns an integer, -1 if set unsuccessful
 int Bitmap::set_green(int x, int y, int value)
 {
-	if (value <= 255 && value >= 0 && x >= 0 && x < width && y >= 0 && y < height)		// Error check
+	if (value <= 255 && value >= 0 && x >= 0 && x < width && y >= 0 && y < row_count())		// Error check
 	{
-		int location;
-	
-		if (colorDepth == 24)
-		{
-			location = (width * y + x) * 3;					// RGB
-		}
-		else
-		{
-			location = (width * y + x) * 4;					// RGBs
-		}
+		size_t location = (size_t) y * rowStride + x * get_step();		// Row start plus pixel, padding included
 
 		location += greenPixelOffset;						// Add offset for green component
 
-		_data.at(location) = value;						// Set value in vector
+		_data[location] = value;						// Set value in vector
 		return value;
 	}
 	else
@@ -387,22 +461,13 @@ int Bitmap::set_green(int x, int y, int value)
 // OUTPUT: Returns an integer, -1 if set unsuccessful
 int Bitmap::set_blue(int x, int y, int value)
 {
-	if (value <= 255 && value >= 0 && x >= 0 && x < width && y >= 0 && y < height)		// Error check
+	if (value <= 255 && value >= 0 && x >= 0 && x < width && y >= 0 && y < row_count())		// Error check
 	{
-		int location;
-	
-		if (colorDepth == 24)
-		{
-			location = (width * y + x) * 3;					// RGB
-		}
-		else
-		{
-			location = (width * y + x) * 4;					// RGBs
-		}
+		size_t location = (size_t) y * rowStride + x * get_step();		// Row start plus pixel, padding included
 
 		location += bluePixelOffset;						// Add offset for blue component
 
-		_data.at(location) = value;						// Set value in vector
+		_data[location] = value;						// Set value in vector
 		return value;
 	}
 	else
@@ -431,7 +496,7 @@ void Bitmap::set_width(int value)
 // **USED FOR TESTING PURPOSES***
 void Bitmap::dump_pixels()
 {
-	for (int i = 0; i < height; i++)
+	for (int i = 0; i < row_count(); i++)
 	{
 		for (int j = 0; j < width; j++)
 		{
@@ -440,272 +505,716 @@ void Bitmap::dump_pixels()
 	}
 }
 
-// Extraction operator overloaded to read in bitmap data from a file
-// INPUT: Takes an input stream and a bitmap object
-// OUTPUT: Returns an input stream
-istream & operator >> (istream & in, Bitmap & b)
+// Read a little endian 16 bit value from raw header bytes
+// INPUT: Takes a pointer to two bytes
+// OUTPUT: Returns the value
+static uint16_t read_u16(const uint8_t * bytes)
+{
+	return bytes[0] | (bytes[1] << 8);
+}
+
+// Read a little endian 32 bit value from raw header bytes
+// INPUT: Takes a pointer to four bytes
+// OUTPUT: Returns the value
+static uint32_t read_u32(const uint8_t * bytes)
 {
-	char tag[TWO_BYTES];								// Read BM tag
-	in.read(tag, TWO_BYTES);
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
 
-	if (tag[0] != 'B' && tag[1] != 'M')						// Error Check
+// Determine which byte of a pixel a BI_BITFIELDS channel mask selects
+// INPUT: Takes a channel mask and the offset to use if the mask is not a whole byte
+// OUTPUT: Returns an integer byte offset
+static int mask_offset(uint32_t mask, int fallback)
+{
+	for (int i = 0; i < 4; i++)
 	{
-		std::cout << "Invalid bitmap tag. Must be BM! Exiting program." << endl;
-		return in;
+		if (mask == 255)
+		{
+			return i;
+		}
+		mask /= 256;
 	}
-	
-	for (char c : tag)								// Push BM tag to header one
+
+	return fallback;
+}
+
+// Parse header one, header two and everything up to the pixel array
+// directly from raw bytes (a file mapping or a buffer read from a stream)
+// INPUT: Takes a pointer to the start of the file and the number of bytes available
+// OUTPUT: Returns true if the headers are valid
+bool Bitmap::parse_header(const uint8_t * bytes, size_t length)
+{
+	ProfileScope scope("parse header");
+
+	if (length < HEADER_ONE + HEADER_TWO)						// Error check
 	{
-		b._headerOne.push_back(c);
+		std::cout << "Bitmap header is truncated! Exiting program." << endl;
+		return false;
 	}
 
-	in.read((char *) & b.size, FOUR_BYTES);						// Read size in uint32_t
+	if (bytes[0] != 'B' || bytes[1] != 'M')						// Error check
+	{
+		std::cout << "Invalid bitmap tag. Must be BM! Exiting program." << endl;
+		return false;
+	}
 
-	char size[FOUR_BYTES];								// Convert size to char
-	size[0] = b.size;
-	size[1] = b.size >> 8;
-	size[2] = b.size >> 16;
-	size[3] = b.size >> 24;
+	size_t offset = read_u32(bytes + PIXEL_OFFSET);					// Start of pixel array
+	size_t headerTwoSize = read_u32(bytes + HEADER_ONE);				// BITMAPINFOHEADER, V4 or V5
 
-	for (char c : size)								// Push char size to header one
+	if (headerTwoSize < HEADER_TWO || offset < HEADER_ONE + headerTwoSize || offset > length)	// Error check
 	{
-		b._headerOne.push_back(c);
+		std::cout << "Invalid pixel array offset! Exiting program." << endl;
+		return false;
 	}
 
-	char tempHeaderOne[8];
-	in.read((char *) & tempHeaderOne, 8);						// Read remainder of header one
-
-	for (char c : tempHeaderOne)							// Push remainder of header one
+	if (read_u16(bytes + 26) != 1)							// Error check
 	{
-		b._headerOne.push_back(c);
+		std::cout << "Color planes must be 1! Exiting program." << endl;
+		return false;
 	}
 
-	char headerTwoSize[FOUR_BYTES];
-	in.read((char *) & headerTwoSize, FOUR_BYTES);					// Read header two size
+	int depth = read_u16(bytes + 28);						// Read color depth
+	int compression = read_u32(bytes + 30);						// Read compression mode
+	bool rle = (compression == BI_RLE8 && depth == 8) || (compression == BI_RLE4 && depth == 4);
 
-	for (char c : headerTwoSize)							// Push header two size into header two
+	if (depth != 24 && depth != 32 && !rle)						// Error check
 	{
-		b._headerTwo.push_back(c);
+		std::cout << "Color depth must be 24 (RGB) or 32 (RGBs), or 8 or 4 with RLE! Exiting program." << endl;
+		return false;
 	}
-	
-	in.read((char *) & b.width, FOUR_BYTES);					// Read bitmap width
 
-	char width[FOUR_BYTES];
-	width[0] = b.width;								// Convert width to char
-	width[1] = b.width >> 8;
-	width[2] = b.width >> 16;
-	width[3] = b.width >> 24;
+	if (compression != 0 && compression != 3 && !rle)				// Error check
+	{
+		std::cout << "Compression mode must be 0, 1, 2 or 3! Exiting program." << endl;
+		return false;
+	}
 
-	for (char c : width)								// Push width to header two
+	if (rle && (int32_t) read_u32(bytes + 22) < 0)					// Error check
 	{
-		b._headerTwo.push_back(c);
+		std::cout << "RLE bitmaps must be stored bottom up! Exiting program." << endl;
+		return false;
 	}
-	
-	in.read((char *) & b.height, FOUR_BYTES);					// Read bitmap height
 
-	char height[FOUR_BYTES];
-	height[0] = b.height;								// Convert height to char
-	height[1] = b.height >> 8;
-	height[2] = b.height >> 16;
-	height[3] = b.height >> 24;
+	int32_t headerWidth = (int32_t) read_u32(bytes + 18);
+	int32_t headerHeight = (int32_t) read_u32(bytes + 22);
 
-	for (char c : height)								// Push height to header two
+	if (headerWidth <= 0 || headerHeight == 0 || headerHeight == INT32_MIN)	// Error check
 	{
-		b._headerTwo.push_back(c);
+		std::cout << "Bitmap width must be positive and height nonzero! Exiting program." << endl;
+		return false;
 	}
 
-	int16_t colorPlanes;
-	in.read((char *) & colorPlanes, TWO_BYTES);					// Read color planes
+	uint64_t rows = headerHeight < 0 ? -(int64_t) headerHeight : headerHeight;
+	uint64_t stride = ((uint64_t) headerWidth * (rle ? 24 : depth) + 31) / 32 * 4;
 
-	if (colorPlanes != 1)								// Error check
+	if ((uint64_t) headerWidth * 4 > INT32_MAX || stride * rows > MAX_PIXEL_BYTES)	// Strides are ints, also in 32 bit BGRA
 	{
-		std::cout << "Color planes must be 1! Exiting program." << endl;
-		return in;
+		std::cout << "Bitmap dimensions are too large! Exiting program." << endl;
+		return false;
 	}
 
-	char tempColorPlanes[TWO_BYTES];	
-	tempColorPlanes[0] = colorPlanes;						// Convert color planes to char
-	tempColorPlanes[1] = colorPlanes >> 8;
+	size = read_u32(bytes + 2);							// Read size
+	width = headerWidth;								// Read bitmap width
+	height = headerHeight;								// Read bitmap height
+	colorDepth = rle ? 24 : depth;							// RLE is decoded to 24 bit
+	compressionMode = compression;
 
-	for (char c : tempColorPlanes)							// Push color planes to header two
+	rowStride = ((width * colorDepth + 31) / 32) * 4;				// Rows are padded to four bytes
+	pixelPadding = rowStride - width * (colorDepth / 8);
+
+	redPixelOffset = 2;								// Default BGR pixel offsets
+	greenPixelOffset = 1;
+	bluePixelOffset = 0;
+
+	if (compressionMode == 3 && offset >= HEADER_ONE + HEADER_TWO + 3 * FOUR_BYTES)	// Masks follow header two
 	{
-		b._headerTwo.push_back(c);
+		const uint8_t * masks = bytes + HEADER_ONE + HEADER_TWO;
+
+		redPixelOffset = mask_offset(read_u32(masks), redPixelOffset);
+		greenPixelOffset = mask_offset(read_u32(masks + FOUR_BYTES), greenPixelOffset);
+		bluePixelOffset = mask_offset(read_u32(masks + 2 * FOUR_BYTES), bluePixelOffset);
 	}
 
-	in.read((char *) & b.colorDepth, TWO_BYTES);					// Read color depth
+	_headerOne.assign(bytes, bytes + HEADER_ONE);					// Keep headers verbatim for writing
+	_headerTwo.assign(bytes + HEADER_ONE, bytes + HEADER_ONE + HEADER_TWO);
+	_headerThree.assign(bytes + HEADER_ONE + HEADER_TWO, bytes + offset);
+	_fileLayout = get_layout();
+	scope.set_bytes(offset);
+
+	return true;
+}
+
+// Returns the size of the pixel array in bytes
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t Bitmap::pixel_bytes() const
+{
+	return (size_t) rowStride * row_count();
+}
+
+static bool rleOutput = false;							// Set once by main before any saving
+
+// Save bitmaps with at most 256 colors as 8 bit RLE when that is smaller
+// INPUT: Takes a boolean
+// OUTPUT: Does not return
+void set_rle_output(bool on)
+{
+	rleOutput = on;
+}
+
+// Returns true if bitmaps are saved as RLE when it pays
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool rle_output()
+{
+	return rleOutput;
+}
+
+// Build header one for a file of the given size and pixel offset
+// INPUT: Takes the file size and the pixel array offset
+// OUTPUT: Returns the header bytes
+static vector<char> file_header(uint32_t fileSize, uint32_t offset)
+{
+	vector<char> header(HEADER_ONE, 0);
+
+	header[0] = 'B';
+	header[1] = 'M';
+	write_u32(&header[2], fileSize);
+	write_u32(&header[PIXEL_OFFSET], offset);
+
+	return header;
+}
+
+// Build a 40 byte header two for a new pixel format, keeping the
+// dimensions and resolution of an existing header two
+// INPUT: Takes the existing header, the color depth, the compression
+// mode, the pixel array size and the palette size
+// OUTPUT: Returns the header bytes
+static vector<char> info_header(const vector<char> & original, int depth, int compression, uint32_t imageBytes, uint32_t colors)
+{
+	vector<char> header(original.begin(), original.begin() + HEADER_TWO);
+
+	write_u32(&header[0], HEADER_TWO);						// Plain BITMAPINFOHEADER
+	header[14] = depth;
+	header[15] = 0;
+	write_u32(&header[16], compression);
+	write_u32(&header[20], imageBytes);
+	write_u32(&header[32], colors);
+	write_u32(&header[36], 0);							// All colors important
 
-	if (b.colorDepth != 24 && b.colorDepth != 32)					// Error check
+	return header;
+}
+
+// Expand RLE8 or RLE4 pixel data into a 24 bit pixel array
+// The palette follows header two; afterwards the headers describe a
+// plain 24 bit file, which is what the bitmap will be saved as
+// INPUT: Takes the compressed data and its length
+// OUTPUT: Returns false if the data is malformed
+bool Bitmap::decode_rle(const uint8_t * data, size_t length)
+{
+	ProfileScope scope("decode rle", length);
+	int bits = compressionMode == BI_RLE8 ? 8 : 4;
+	size_t start = read_u32((const uint8_t *) _headerTwo.data()) - HEADER_TWO;	// Palette in header three
+	size_t available = _headerThree.size() > start ? (_headerThree.size() - start) / FOUR_BYTES : 0;
+	size_t colors = read_u32((const uint8_t *) &_headerTwo[32]);
+	vector<uint32_t> palette((size_t) 1 << bits, 0);				// Missing entries are black
+
+	colors = colors == 0 || colors > palette.size() ? palette.size() : colors;
+	colors = colors > available ? available : colors;
+
+	for (size_t i = 0; i < colors; i++)
 	{
-		std::cout << "Color depth must be 24 (RGB) or 32 (RGBs)! Exiting program." << endl;
-		return in;
+		palette[i] = read_u32((const uint8_t *) &_headerThree[start + i * FOUR_BYTES]) & 0xffffff;
 	}
 
-	char tempColorDepth[TWO_BYTES];
-	tempColorDepth[0] = b.colorDepth;						// Convert color depth to char
-	tempColorDepth[1] = b.colorDepth >> 8;
+	_data = PixelBuffer();
+	_data.resize(pixel_bytes());							// Skipped pixels are black
 
-	for (char c : tempColorDepth)							// Push color depth to header two
+	if (!rle_decode(data, length, bits, palette.data(), rows()))
 	{
-		b._headerTwo.push_back(c);
+		std::cout << "Invalid RLE pixel data! Exiting program." << endl;
+		return false;
 	}
 
-	if (b.colorDepth == 24)								// Check color depth
+	compressionMode = 0;
+	_headerTwo = info_header(_headerTwo, colorDepth, compressionMode, pixel_bytes(), 0);
+	_headerThree.clear();
+	_headerOne = file_header(file_bytes(), pixel_offset());
+	size = file_bytes();
+
+	return true;
+}
+
+// Encode the bitmap as a whole 8 bit RLE file: headers, palette and data
+// Fails if the image has more than 256 colors, is stored top down (RLE
+// must be bottom up) or would not come out smaller than it is now.
+// Alpha is not kept.
+// INPUT: Takes a vector to receive the file bytes
+// OUTPUT: Returns false if the bitmap should be saved as it is
+bool Bitmap::encode_rle(vector<uint8_t> & file) const
+{
+	ProfileScope scope("encode rle", pixel_bytes());
+	PixelRow layout = {nullptr, width, get_step(), redPixelOffset, greenPixelOffset, bluePixelOffset};
+	PixelRows pixels((uint8_t *) as_const(_data).data(), rowStride, height, layout);	// Only read
+	vector<uint32_t> palette;
+	vector<uint8_t> indices;
+
+	if (height <= 0 || !build_palette(pixels, palette, indices))
 	{
-		b.pixelPadding = b.width % 4;						// Calculate padding
+		return false;
 	}
-	else
+
+	vector<uint8_t> encoded;
+	rle8_encode(indices.data(), width, height, encoded);
+
+	uint32_t offset = HEADER_ONE + HEADER_TWO + palette.size() * FOUR_BYTES;
+	uint32_t fileSize = offset + encoded.size();
+
+	if (fileSize >= file_bytes())
 	{
-		b.pixelPadding = 0;							// Set padding to zero
+		return false;
 	}
 
-	in.read((char *) & b.compressionMode, FOUR_BYTES);				// Read compression mode
+	vector<char> headerOne = file_header(fileSize, offset);
+	vector<char> headerTwo = info_header(_headerTwo, 8, BI_RLE8, encoded.size(), palette.size());
+
+	file.assign(headerOne.begin(), headerOne.end());
+	file.insert(file.end(), headerTwo.begin(), headerTwo.end());
 
-	if (b.compressionMode != 0 && b.compressionMode != 3)				// Error check
+	for (uint32_t color : palette)							// Blue, green, red, reserved
 	{
-		std::cout << "Compression mode must be 0 or 3! Exiting program." << endl;
-		return in;
+		file.push_back(color);
+		file.push_back(color >> 8);
+		file.push_back(color >> 16);
+		file.push_back(0);
 	}
 
-	char tempCompressionMode[FOUR_BYTES];
-	tempCompressionMode[0] = b.compressionMode;					// Convert compression mode to char
-	tempCompressionMode[1] = b.compressionMode >> 8;
-	tempCompressionMode[2] = b.compressionMode >> 16;
-	tempCompressionMode[3] = b.compressionMode >> 24;
+	file.insert(file.end(), encoded.begin(), encoded.end());
+
+	return true;
+}
+
+// Load a bitmap by memory mapping the file
+// The headers are parsed in place and the pixel array inside the mapping
+// becomes the pixel data without being copied
+// INPUT: Takes a file name
+// OUTPUT: Returns LOAD_UNMAPPED if the file should be read as a stream,
+// LOAD_FAILED if it is invalid
+LoadStatus Bitmap::map_file(const string & filename)
+{
+	ProfileScope scope("map input");
+	int fd = open(filename.c_str(), O_RDONLY);
 
-	for (char c : tempCompressionMode)						// Push compression mode to header two
+	if (fd < 0)
 	{
-		b._headerTwo.push_back(c);
+		return LOAD_UNMAPPED;
 	}
 
-	char tempHeaderTwo[20];
-	in.read((char *) & tempHeaderTwo, 20);						// Read remainder of header two
+	struct stat info;
 
-	for (char c : tempHeaderTwo)							// Push remainder of header two to header two
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size < HEADER_ONE + HEADER_TWO)
 	{
-		b._headerTwo.push_back(c);
+		close(fd);
+		return LOAD_UNMAPPED;
 	}
 
-	if (b.compressionMode == 0)							// RGB
+	size_t length = info.st_size;
+	void * base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);	// Private copy on write mapping
+	close(fd);
+
+	if (base == MAP_FAILED)
 	{
-		b.redPixelOffset = 2;							// Set pixel offsets
-		b.greenPixelOffset = 1;
-		b.bluePixelOffset = 0;
+		return LOAD_UNMAPPED;
 	}
-	else										// RGBs
+
+	const uint8_t * bytes = (const uint8_t *) base;
+
+	if (!parse_header(bytes, length))						// Reported, nothing left to try
 	{
-		uint32_t redMask;
-		in.read((char *) & redMask, FOUR_BYTES);				// Read in red mask as int
+		munmap(base, length);
+		return LOAD_FAILED;
+	}
 
-		char redMaskChars[4];							// Convert red mask to char
-		redMaskChars[0] = redMask;
-		redMaskChars[1] = redMask >> 8;
-		redMaskChars[2] = redMask >> 16;
-		redMaskChars[3] = redMask >> 24;
+	size_t offset = read_u32(bytes + PIXEL_OFFSET);
 
-		for (int i = 0; i < 4; i++)
+	if (compressed())								// Decoded straight out of the mapping
+	{
+		bool decoded = decode_rle(bytes + offset, length - offset);
+		munmap(base, length);
+
+		if (decoded && normalizeOnLoad)
 		{
-			if (redMask == 255)
-			{
-				b.redPixelOffset = i;					// Determine red offset
-			}
-			redMask /= 256;
-			b._headerThree.push_back(redMaskChars[i]);			// Push to header three
+			normalize();
 		}
 
-		uint32_t greenMask;
-		in.read((char *) & greenMask, FOUR_BYTES);				// Read in green mask as int
-	
-		char greenMaskChars[4];							// Convert green mask to char
-		greenMaskChars[0] = greenMask;
-		greenMaskChars[1] = greenMask >> 8;
-		greenMaskChars[2] = greenMask >> 16;
-		greenMaskChars[3] = greenMask >> 24;
+		return decoded ? LOAD_OK : LOAD_FAILED;
+	}
 
-		for (int i = 0; i < 4; i++)
-		{
-			if (greenMask == 255)
-			{
-				b.greenPixelOffset = i;					// Determine green offset
-			}
-			greenMask /= 256;
-			b._headerThree.push_back(greenMaskChars[i]);			// Push to header three
-		}
+	if (pixel_bytes() > length - offset)						// Error check, before any pixel is touched
+	{
+		std::cout << "Bitmap pixel data is truncated! Exiting program." << endl;
+		munmap(base, length);
+		return LOAD_FAILED;
+	}
 
-		uint32_t blueMask;
-		in.read((char *) & blueMask, FOUR_BYTES);				// Read in blue mask as int
+	madvise(base, length, MADV_WILLNEED);						// Pages fault in during the first filter
+	_data.adopt_mapping(base, length, offset, pixel_bytes(), false, info);
+	scope.set_bytes(pixel_bytes());
+	scope.stop();
 
-		char blueMaskChars[4];
-		blueMaskChars[0] = blueMask;						// Convert blue mask to char
-		blueMaskChars[1] = blueMask >> 8;
-		blueMaskChars[2] = blueMask >> 16;
-		blueMaskChars[3] = blueMask >> 24;
+	if (normalizeOnLoad)
+	{
+		normalize();
+	}
 
-		for (int i = 0; i < 4; i++)
-		{
-			if (blueMask == 255)
-			{
-				b.bluePixelOffset = i;					// Determine blue mask offset
-			}
-			blueMask /= 256;
-			b._headerThree.push_back(blueMaskChars[i]);			// Push to header three
-		}
+	return LOAD_OK;
+}
+
+// Load a bitmap from a file
+// Maps the file when it can and reads it as a stream otherwise
+// INPUT: Takes a file name
+// OUTPUT: Returns false if the file could not be read or is invalid
+bool Bitmap::load(const string & filename)
+{
+	LoadStatus status = map_file(filename);
+
+	if (status != LOAD_UNMAPPED)
+	{
+		return status == LOAD_OK;
+	}
+
+	ifstream in(filename, ios::binary);
+
+	return (bool) (in >> *this);
+}
+
+// Read the headers from a stream, leaving it at the first pixel byte
+// The pixel data is left empty so the rows can be read in bands
+// INPUT: Takes an input stream
+// OUTPUT: Returns false if the headers could not be read or are invalid
+bool Bitmap::read_header(istream & in)
+{
+	ProfileScope scope("read header");
+	vector<uint8_t> header(HEADER_ONE);
+	in.read((char *) header.data(), HEADER_ONE);					// Read header one
+
+	size_t offset = read_u32(header.data() + PIXEL_OFFSET);
+
+	if (offset < HEADER_ONE + HEADER_TWO || offset > MAX_HEADER)			// Let the parser report a bad offset
+	{
+		offset = HEADER_ONE + HEADER_TWO;
+	}
+
+	header.resize(offset);
+	in.read((char *) header.data() + HEADER_ONE, offset - HEADER_ONE);		// Read everything up to the pixels
+	scope.set_bytes(offset);
+
+	return in && parse_header(header.data(), header.size());
+}
+
+// Write the three headers to a stream
+// INPUT: Takes an output stream
+// OUTPUT: Does not return
+void Bitmap::write_header(ostream & out) const
+{
+	out.write(_headerOne.data(), _headerOne.size());				// Write header one
+	out.write(_headerTwo.data(), _headerTwo.size());				// Write header two
+	out.write(_headerThree.data(), _headerThree.size());			// Write header three
+}
+
+// Returns the file offset of the pixel array
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t Bitmap::pixel_offset() const
+{
+	return _headerOne.size() + _headerTwo.size() + _headerThree.size();
+}
+
+// Returns true if the pixel data is still run length encoded, which is
+// only the case between reading the headers and decoding the pixels
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool Bitmap::compressed() const
+{
+	return compressionMode == BI_RLE8 || compressionMode == BI_RLE4;
+}
+
+// Read everything left in a stream
+// The stream is left good so the caller can report on the data instead
+// INPUT: Takes an input stream
+// OUTPUT: Returns the bytes
+static vector<uint8_t> read_rest(istream & in)
+{
+	vector<uint8_t> bytes(1 << 16);
+	size_t used = 0;
+
+	while (in.read((char *) bytes.data() + used, bytes.size() - used))		// Grow until the stream runs dry
+	{
+		used = bytes.size();
+		bytes.resize(bytes.size() * 2);
+	}
+
+	bytes.resize(used + in.gcount());
+	in.clear();
+
+	return bytes;
+}
+
+// Extraction operator overloaded to read in bitmap data from a file
+// Reads the headers, then the whole pixel array with a single read
+// INPUT: Takes an input stream and a bitmap object
+// OUTPUT: Returns an input stream
+istream & operator >> (istream & in, Bitmap & b)
+{
+	if (!b.read_header(in))
+	{
+		in.setstate(ios::failbit);
+		return in;
+	}
 
-		char tempHeaderThree[72];
-		in.read((char *) & tempHeaderThree, 72);				// Read remainder of header three
+	if (b.compressed())
+	{
+		ProfileScope scope("read pixels");
+		vector<uint8_t> packed = read_rest(in);
+		scope.set_bytes(packed.size());
+		scope.stop();
 
-		for (char c : tempHeaderThree)						// Push remainder of header three to header three
+		if (!b.decode_rle(packed.data(), packed.size()))
+		{
+			in.setstate(ios::failbit);
+		}
+		else if (normalizeOnLoad)
 		{
-			b._headerThree.push_back(c);
+			b.normalize();
 		}
+
+		return in;
 	}
 
-	uint8_t temp;
-	int iterations = b.size - HEADER_ONE - HEADER_TWO;				// Determine remaining characters to read
-	
-	if (b.compressionMode == 3)
+	streampos start = in.tellg();							// Seekable streams are checked before allocating
+
+	if (start != streampos(-1))
 	{
-		iterations -= HEADER_THREE;						// Decrememnt for header three if necessary
+		in.seekg(0, ios::end);
+		streampos end = in.tellg();
+		in.seekg(start);
+
+		if (end != streampos(-1) && (size_t) (end - start) < b.pixel_bytes())
+		{
+			std::cout << "Bitmap pixel data is truncated! Exiting program." << endl;
+			in.setstate(ios::failbit);
+			return in;
+		}
 	}
 
-	for (int i = 0; i < iterations; i++)
+	ProfileScope scope("read pixels", b.pixel_bytes());
+
+	b._data.allocate(b.pixel_bytes());						// Pool block, no clearing
+	in.read((char *) b._data.data(), b._data.size());				// Read pixel data
+	scope.stop();
+
+	if (in && normalizeOnLoad)
 	{
-		
-		in.read((char *) & temp, ONE_BYTE);					// Read character
-		b._data.push_back(temp);						// Push character to pixel data
+		b.normalize();
 	}
 
-	return in;									
+	return in;
 }
 
 // Insertion operator overloaded to write bitmap data to a file
+// Each header and the whole pixel array go out in one write apiece
 // INPUT: Takes an output stream and a bitmap object as inputs
 // OUTPUT: Returns an output stream
 ostream & operator << (ostream & out, const Bitmap & b)
 {
-	for (char c : b._headerOne)							// Write header one
+	vector<uint8_t> encoded;
+
+	if (rleOutput && b.encode_rle(encoded))
+	{
+		ProfileScope scope("write", encoded.size());
+		out.write((const char *) encoded.data(), encoded.size());
+		return out;
+	}
+
+	PixelBuffer packed = b.normalized() ? b.packed_pixels() : PixelBuffer();
+	const PixelBuffer & pixels = b.normalized() ? packed : b._data;		// Pixels as the file stores them
+	ProfileScope scope("write", b.file_bytes());
+
+	b.write_header(out);
+	out.write((const char *) pixels.data(), pixels.size());			// Write pixel data
+
+	return out;
+}
+
+// Size of the whole file as written (headers plus pixel array)
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t Bitmap::file_bytes() const
+{
+	return _headerOne.size() + _headerTwo.size() + _headerThree.size() + file_pixel_bytes();
+}
+
+// Pull the pixels out of a private input mapping before the named file
+// is truncated, since the mapping would otherwise lose its backing pages
+// INPUT: Takes the file name about to be overwritten
+// OUTPUT: Does not return
+void Bitmap::detach_from(const string & filename)
+{
+	if (_data.mapped() && !_data.shared() && _data.mapped_from(filename))
 	{
-		out.write((char *) & c, ONE_BYTE);
+		_data.resize(_data.size());
 	}
+}
 
-	for (char c : b._headerTwo)							// Write header two
+// Write the bitmap to a file with a single gathered write
+// INPUT: Takes a file name
+// OUTPUT: Returns false if the file could not be written
+bool Bitmap::write_file(const string & filename)
+{
+	detach_from(filename);
+
+	vector<uint8_t> encoded;
+	bool rle = rleOutput && encode_rle(encoded);
+	PixelBuffer packed = !rle && normalized() ? packed_pixels() : PixelBuffer();
+	const PixelBuffer & pixels = normalized() ? packed : _data;			// Pixels as the file stores them
+	ProfileScope scope("write", rle ? encoded.size() : file_bytes());
+
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
 	{
-		out.write((char *) & c, ONE_BYTE);
+		return false;
 	}
 
-	for (char c : b._headerThree)							// Write header three
+	struct iovec parts[4];								// Headers and pixels in order
+	parts[0].iov_base = _headerOne.data();
+	parts[0].iov_len = _headerOne.size();
+	parts[1].iov_base = _headerTwo.data();
+	parts[1].iov_len = _headerTwo.size();
+	parts[2].iov_base = _headerThree.data();
+	parts[2].iov_len = _headerThree.size();
+	parts[3].iov_base = (void *) pixels.data();					// Reading needs no private copy
+	parts[3].iov_len = pixels.size();
+
+	struct iovec * next = parts;
+	int count = 4;
+
+	if (rle)									// The encoded file is a single part
 	{
-		out.write((char *) & c, ONE_BYTE);
+		parts[0].iov_base = encoded.data();
+		parts[0].iov_len = encoded.size();
+		count = 1;
 	}
 
-	for (char c : b._data)								// Write pixel data
+	while (count > 0)								// writev may stop short
 	{
-		out.write((char *) & c, ONE_BYTE);
+		ssize_t written = writev(fd, next, count);
+
+		if (written < 0)
+		{
+			close(fd);
+			return false;
+		}
+
+		while (count > 0 && (size_t) written >= next->iov_len)			// Skip finished parts
+		{
+			written -= next->iov_len;
+			next++;
+			count--;
+		}
+
+		if (count > 0)								// Advance into a partial part
+		{
+			next->iov_base = (char *) next->iov_base + written;
+			next->iov_len -= written;
+		}
 	}
 
-	return out;
+	return close(fd) == 0;
+}
+
+// Create the output file at its final size, map it shared and move the
+// pixel data into it, so filters that follow write straight into the
+// destination and save() only has to flush the mapping
+// INPUT: Takes a file name
+// OUTPUT: Returns false if the output could not be mapped
+bool Bitmap::map_output(const string & filename)
+{
+	if (normalized() || rleOutput)							// Memory layout is not the file's
+	{
+		return false;
+	}
+
+	detach_from(filename);
+
+	ProfileScope scope("map output", file_bytes());
+
+	int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	size_t length = file_bytes();
+	struct stat info;
+
+	if (length == 0 || ftruncate(fd, length) != 0 || fstat(fd, &info) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void * base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED)
+	{
+		return false;
+	}
+
+	size_t offset = length - _data.size();						// Pixels follow the headers
+
+	memcpy((uint8_t *) base + offset, _data.data(), _data.size());
+	_data.adopt_mapping(base, length, offset, _data.size(), true, info);
+	write_headers(_data.map_base());
+
+	return true;
+}
+
+// Copy the three headers to the start of a file image
+// INPUT: Takes a pointer to the destination
+// OUTPUT: Does not return
+void Bitmap::write_headers(uint8_t * destination) const
+{
+	memcpy(destination, _headerOne.data(), _headerOne.size());
+	destination += _headerOne.size();
+	memcpy(destination, _headerTwo.data(), _headerTwo.size());
+	destination += _headerTwo.size();
+	memcpy(destination, _headerThree.data(), _headerThree.size());
+}
+
+// Save the bitmap, flushing the output mapping in place if the pixel
+// data still lives in a mapping of the named file with the same layout
+// INPUT: Takes a file name
+// OUTPUT: Returns false if the file could not be written
+bool Bitmap::save(const string & filename)
+{
+	if (_data.shared() && _data.mapped_from(filename) && _data.map_length() == file_bytes()
+	    && as_const(_data).data() == _data.map_base() + file_bytes() - _data.size())
+	{
+		ProfileScope scope("sync output", file_bytes());
+
+		write_headers(_data.map_base());					// Headers may have been edited by a filter
+		_data.sync();
+		return true;
+	}
+
+	return write_file(filename);
 }
 
-Bitmap::Bitmap()									// Default constructor
+Bitmap::Bitmap() : size(0), width(0), height(0), colorDepth(0), compressionMode(0), pixelPadding(0),	// Default constructor
+                   rowStride(0), redPixelOffset(2), greenPixelOffset(1), bluePixelOffset(0), _fileLayout({0, 2, 1, 0})
 {
 }
 
@@ -714,38 +1223,83 @@ Bitmap::~Bitmap()									// Destructor
 }
 
 Bitmap::Bitmap(const Bitmap & b)							// Copy constructor
+	: size(b.size), width(b.width), height(b.height), colorDepth(b.colorDepth), compressionMode(b.compressionMode),
+	  pixelPadding(b.pixelPadding), rowStride(b.rowStride), redPixelOffset(b.redPixelOffset),
+	  greenPixelOffset(b.greenPixelOffset), bluePixelOffset(b.bluePixelOffset), _fileLayout(b._fileLayout),
+	  _headerOne(b._headerOne), _headerTwo(b._headerTwo), _headerThree(b._headerThree), _data(b._data)
 {
-	size = b.size;
-	width = b.width;
-	height = b.height;
-	colorDepth = b.colorDepth;
-	compressionMode = b.compressionMode;
-	pixelPadding = b.pixelPadding;
-	redPixelOffset = b.redPixelOffset;
-	greenPixelOffset = b.greenPixelOffset;
-	bluePixelOffset = b.bluePixelOffset;
+}
 
-	for (char c : b._headerOne)
-	{
-		_headerOne.push_back(c);
-	}
+Bitmap::Bitmap(Bitmap && b)								// Move constructor
+	: size(b.size), width(b.width), height(b.height), colorDepth(b.colorDepth), compressionMode(b.compressionMode),
+	  pixelPadding(b.pixelPadding), rowStride(b.rowStride), redPixelOffset(b.redPixelOffset),
+	  greenPixelOffset(b.greenPixelOffset), bluePixelOffset(b.bluePixelOffset), _fileLayout(b._fileLayout),
+	  _headerOne(std::move(b._headerOne)), _headerTwo(std::move(b._headerTwo)),
+	  _headerThree(std::move(b._headerThree)), _data(std::move(b._data))
+{
+	b.size = b.width = b.height = b.colorDepth = b.compressionMode = b.pixelPadding = b.rowStride = 0;	// Leave b empty
+}
 
-	for (char c : b._headerTwo)
+Bitmap & Bitmap::operator=(const Bitmap & b)						// Copy assignment
+{
+	if (this != &b)
 	{
-		_headerTwo.push_back(c);
+		Bitmap copy(b);
+		*this = std::move(copy);
 	}
 
-	for (char c : b._headerThree)
-	{
-		_headerThree.push_back(c);
-	}
+	return *this;
+}
 
-	for (uint8_t i : b._data)
+Bitmap & Bitmap::operator=(Bitmap && b)							// Move assignment
+{
+	if (this != &b)
 	{
-		_data.push_back(i);
+		size = b.size;
+		width = b.width;
+		height = b.height;
+		colorDepth = b.colorDepth;
+		compressionMode = b.compressionMode;
+		pixelPadding = b.pixelPadding;
+		rowStride = b.rowStride;
+		redPixelOffset = b.redPixelOffset;
+		greenPixelOffset = b.greenPixelOffset;
+		bluePixelOffset = b.bluePixelOffset;
+		_fileLayout = b._fileLayout;
+		_headerOne = std::move(b._headerOne);
+		_headerTwo = std::move(b._headerTwo);
+		_headerThree = std::move(b._headerThree);
+		_data = std::move(b._data);
+
+		b.size = b.width = b.height = b.colorDepth = b.compressionMode = b.pixelPadding = b.rowStride = 0;
 	}
+
+	return *this;
 }
 
-Bitmap::Bitmap(Bitmap && b)								// Move constructor
+// Copy of the bitmap sharing its pixels copy on write
+// Only the headers are copied; the pixels are duplicated the first time
+// either bitmap is written to, so unchanged images cost nothing to pass on
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a Bitmap
+Bitmap Bitmap::share() const
 {
+	Bitmap view;
+	view.size = size;
+	view.width = width;
+	view.height = height;
+	view.colorDepth = colorDepth;
+	view.compressionMode = compressionMode;
+	view.pixelPadding = pixelPadding;
+	view.rowStride = rowStride;
+	view.redPixelOffset = redPixelOffset;
+	view.greenPixelOffset = greenPixelOffset;
+	view.bluePixelOffset = bluePixelOffset;
+	view._fileLayout = _fileLayout;
+	view._headerOne = _headerOne;
+	view._headerTwo = _headerTwo;
+	view._headerThree = _headerThree;
+	view._data = _data.share();
+
+	return view;
 }
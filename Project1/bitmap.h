@@ -1,7 +1,14 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
 #include <iostream>
 #include <ostream>
 #include <vector>
 #include <cstring>
+#include <cstdint>
+#include <string>
+#include "pixelbuffer.h"
+#include "pixelformat.h"
 
 using namespace std;
 
@@ -12,6 +19,96 @@ const int FOUR_BYTES = 4;			// For reading four bytes
 const int HEADER_ONE = 14;			// Header one size
 const int HEADER_TWO = 40;			// Header two size
 const int HEADER_THREE = 84;			// Header three size
+const int PIXEL_OFFSET = 10;			// Offset of pixel array offset in header one
+const int MAX_HEADER = 65536;			// Largest accepted pixel array offset
+const size_t MAX_PIXEL_BYTES = (size_t) 1 << 40;	// Largest accepted pixel array, decoded and padded
+const int BI_RLE8 = 1;				// Compression mode of run length encoded 8 bit files
+const int BI_RLE4 = 2;				// Compression mode of run length encoded 4 bit files
+
+// Outcome of mapping an input file
+enum LoadStatus
+{
+	LOAD_OK,				// Headers and pixels loaded
+	LOAD_UNMAPPED,				// Could not be mapped, read it as a stream instead
+	LOAD_FAILED				// Invalid file, already reported
+};
+
+// Channel weighting used when converting to gray
+enum GrayMode
+{
+	GRAY_AVERAGE,				// Plain average of red, green and blue
+	GRAY_BT601,				// Rec. 601 luma weights
+	GRAY_BT709				// Rec. 709 luma weights
+};
+
+// Unchecked view of one row of pixels
+// Channel bytes for pixel x live at pixels[x * step + offset]
+struct PixelRow
+{
+	uint8_t * pixels;			// First byte of the row
+	int width;				// Pixels in the row
+	int step;				// Bytes per pixel, 3 or 4
+	int red;				// Byte offsets of the channels within a pixel
+	int green;
+	int blue;
+
+	uint8_t & r(int x) { return pixels[x * step + red]; }		// Channel access
+	uint8_t & g(int x) { return pixels[x * step + green]; }
+	uint8_t & b(int x) { return pixels[x * step + blue]; }
+};
+
+// Unchecked view of all rows of a bitmap: base pointer, row stride and
+// channel layout. Row 0 is the first row stored in the file.
+class PixelRows
+{
+	private:
+
+		uint8_t * _base;			// First byte of row 0
+		int _stride;				// Bytes between rows, padding included
+		int _height;				// Number of rows
+		PixelRow _layout;			// Width and channel layout shared by all rows
+
+	public:
+
+		class iterator				// Forward iterator over rows
+		{
+			private:
+
+				const PixelRows * _rows;
+				int _y;
+
+			public:
+
+				iterator(const PixelRows * rows, int y) : _rows(rows), _y(y) {}
+				PixelRow operator*() const { return (*_rows)[_y]; }
+				iterator & operator++() { _y++; return *this; }
+				bool operator!=(const iterator & i) const { return _y != i._y; }
+		};
+
+		PixelRows(uint8_t * base, int stride, int height, PixelRow layout)
+			: _base(base), _stride(stride), _height(height), _layout(layout) {}
+
+		PixelRow operator[](int y) const				// Row y
+		{
+			PixelRow row = _layout;
+			row.pixels = _base + (size_t) y * _stride;
+			return row;
+		}
+
+		PixelRows band(int first, int last) const			// Rows [first, last) as their own view
+		{
+			return PixelRows(_base + (size_t) first * _stride, _stride, last - first, _layout);
+		}
+
+		uint8_t * data() const { return _base; }			// First byte of row 0
+		int stride() const { return _stride; }				// Bytes between rows
+		int height() const { return _height; }				// Number of rows
+		int width() const { return _layout.width; }			// Pixels per row
+		int step() const { return _layout.step; }			// Bytes per pixel
+
+		iterator begin() const { return iterator(this, 0); }
+		iterator end() const { return iterator(this, _height); }
+};
 
 class Bitmap
 {
@@ -23,14 +120,28 @@ class Bitmap
 		int colorDepth;			// Color depth of bitmap
 		int compressionMode;		// The compression mode of the bitmap
 		int pixelPadding;		// Pixel padding if using RGB color depth
+		int rowStride;			// Bytes per row of pixel data, padding included
 		int redPixelOffset;		// Offset of pixel's red value
 		int greenPixelOffset;		// Offset of pixel's green value
 		int bluePixelOffset;		// Offset of pixel's blue value
+		RuntimeFormat _fileLayout;	// Pixel layout in the file, differs from the above while normalized
 
 		vector<char> _headerOne;		// First file header
 		vector<char> _headerTwo;		// Second file header
 		vector<char> _headerThree;		// Third file header
-		vector<uint8_t> _data;			// Pixel data
+		PixelBuffer _data;			// Pixel data
+
+		bool parse_header(const uint8_t *, size_t);	// Parse all headers from raw bytes
+		int row_count() const;				// Rows of pixel data, whichever way they are stored
+		size_t pixel_bytes() const;			// Size of the pixel array in bytes
+		size_t file_bytes() const;			// Size of the written file in bytes
+		int file_stride() const;			// Row stride in the file's pixel layout
+		size_t file_pixel_bytes() const;		// Size of the file's pixel array in bytes
+		PixelBuffer packed_pixels() const;		// Pixels converted back to the file layout
+		bool decode_rle(const uint8_t *, size_t);	// Expand RLE pixel data to 24 bit
+		bool encode_rle(vector<uint8_t> &) const;	// Whole RLE8 file image, if it pays
+		void detach_from(const string&);		// Copy pixels out of a mapping of a file
+		void write_headers(uint8_t *) const;		// Copy headers to a file image
 		
 		friend istream & operator >> (istream & in, Bitmap & b);		// For reading bitmap data
     		friend ostream & operator << (ostream & out, const Bitmap & b);		// For writing bitmap data
@@ -39,11 +150,35 @@ class Bitmap
 
     		Bitmap();				// Default constructor
     		Bitmap(const Bitmap&);			// Copy constructor
-    		Bitmap operator=(const Bitmap&);	// Assignment operator
+    		Bitmap & operator=(const Bitmap&);	// Assignment operator
    		Bitmap(Bitmap&&);			// Move constructor
+		Bitmap & operator=(Bitmap&&);		// Move assignment
+		Bitmap share() const;			// Copy sharing the pixels copy on write
     		~Bitmap();				// Destructor
 
-		int get_height();			// Get height of bitmap
+		bool read_header(istream&);		// Read the headers but not the pixels
+		void write_header(ostream&) const;	// Write the headers but not the pixels
+		size_t pixel_offset() const;		// File offset of the pixel array
+		bool compressed() const;		// True until RLE pixel data has been decoded
+		LoadStatus map_file(const string&);	// Load bitmap by memory mapping a file
+		bool load(const string&);		// Map a file, or read it as a stream if it cannot be mapped
+		bool map_output(const string&);		// Move pixels into a shared mapping of the output file
+		bool write_file(const string&);		// Write bitmap with one gathered write
+		bool save(const string&);		// Flush output mapping or write the file
+
+		PixelRows rows();			// Unchecked row view of the pixel data
+		uint8_t * row(int);			// Pointer to first byte of row y
+		int get_stride() const;			// Bytes between rows, padding included
+		int get_step() const;			// Bytes per pixel
+		PixelFormatId get_format() const;	// Channel layout of the pixel data
+		RuntimeFormat get_layout() const;	// Channel layout as run time values
+		int stride_for(int) const;		// Row stride for a width in this format
+		PixelBuffer reshape(int, int);		// Change dimensions, returning the old pixels
+		void normalize();			// Convert pixels to unpadded BGRA32
+		void denormalize();			// Convert pixels back to the file layout
+		bool normalized() const;		// True while the pixels differ from the file layout
+
+		int get_height();			// Get height of bitmap, negative if stored top down
 		int get_width();			// Get width of bitmap
 
 		int get_red(int, int);			// Get red pixel (x, y) value
@@ -61,7 +196,48 @@ class Bitmap
 };
 
 
+// Run a kernel specialized for the bitmap's pixel format
+// The format is resolved once per image and the kernel is called with
+// a compile time PixelFormat (or a RuntimeFormat for unusual layouts)
+// INPUT: Takes a bitmap and a callable taking a format object
+// OUTPUT: Does not return
+template <class Kernel>
+void dispatch_format(const Bitmap & b, Kernel && kernel)
+{
+	switch (b.get_format())
+	{
+		case FORMAT_BGR24:	kernel(BGR24()); break;
+		case FORMAT_BGRA32:	kernel(BGRA32()); break;
+		case FORMAT_RGBA32:	kernel(RGBA32()); break;
+		case FORMAT_ARGB32:	kernel(ARGB32()); break;
+		case FORMAT_ABGR32:	kernel(ABGR32()); break;
+		default:		kernel(b.get_layout()); break;
+	}
+}
+
+void set_normalize_on_load(bool);		// Normalize every bitmap as it is loaded
+bool normalize_on_load();
+void set_rle_output(bool);			// Save 8 bit RLE when it is smaller
+bool rle_output();
+
 void cellShade(Bitmap & b);			// Function prototypes
 void grayscale(Bitmap & b);
-void pixelate(Bitmap & b);
+void grayscale(Bitmap & b, GrayMode mode);
+void pixelate(Bitmap & b, int block = 16);
+void box_blur(Bitmap & b, int radius);
+void rot90(Bitmap & b);
+void rot180(Bitmap & b);
+void rot270(Bitmap & b);
+void flipv(Bitmap & b);
+void fliph(Bitmap & b);
+void flipd1(Bitmap & b);
+void flipd2(Bitmap & b);
+void scaleUp(Bitmap & b);
+void scaleDown(Bitmap & b);
 void blur(Bitmap & b);
+void gaussian_blur(Bitmap & b, double sigma, int radius = 0);
+void recursive_gaussian_blur(Bitmap & b, double sigma);
+void separable_blur(Bitmap & b, const vector<int> & weights);
+vector<int> gaussian_weights(double sigma, int radius);
+
+#endif
@@ -0,0 +1,170 @@
+#include "bufferpool.h"
+#include <sys/mman.h>
+
+const size_t PAGE = 4096;				// Smallest class and block alignment
+const size_t HUGE_PAGE = 2 << 20;			// Transparent huge page size on x86-64
+const size_t MAX_PER_CLASS = 8;				// Released blocks kept per class
+const size_t MAX_BLOCK = (size_t) 1 << 48;		// Past any address space mmap can give
+
+BufferPool::BufferPool() : _hugePages(false), _maxPerClass(MAX_PER_CLASS), _mapped(0), _reused(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+	trim();
+}
+
+// Size class a request is rounded up to
+// Classes are a quarter of a power of two apart, so at most a fifth of
+// a block is unused
+// INPUT: Takes a size in bytes
+// OUTPUT: Returns the class size in bytes, 0 if no block could be that large
+size_t BufferPool::class_size(size_t bytes)
+{
+	if (bytes > MAX_BLOCK)
+	{
+		return 0;
+	}
+
+	size_t power = PAGE;
+
+	while (power * 2 <= bytes)
+	{
+		power *= 2;
+	}
+
+	size_t step = power / 4 > PAGE ? power / 4 : PAGE;
+
+	return (bytes + step - 1) / step * step;
+}
+
+// Hand out a block of at least n bytes
+// The contents of a reused block are whatever its last owner left there
+// INPUT: Takes the size in bytes and a size to receive the capacity
+// OUTPUT: Returns the block, nullptr if the system is out of memory
+void * BufferPool::acquire(size_t bytes, size_t & capacity)
+{
+	capacity = class_size(bytes > 0 ? bytes : 1);
+
+	if (capacity == 0)
+	{
+		return nullptr;
+	}
+
+	{
+		lock_guard<mutex> lock(_lock);
+		vector<void *> & blocks = _free[capacity];
+
+		if (!blocks.empty())
+		{
+			void * block = blocks.back();
+			blocks.pop_back();
+			_reused++;
+			return block;
+		}
+	}
+
+	void * block = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (block == MAP_FAILED)
+	{
+		return nullptr;
+	}
+
+	{
+		lock_guard<mutex> lock(_lock);
+		_mapped++;							// Only blocks actually obtained
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (_hugePages && capacity >= HUGE_PAGE)
+	{
+		madvise(block, capacity, MADV_HUGEPAGE);
+	}
+#endif
+
+	return block;
+}
+
+// Give a block back to the pool
+// Blocks beyond the per class limit go back to the system
+// INPUT: Takes the block and its capacity
+// OUTPUT: Does not return
+void BufferPool::release(void * block, size_t capacity)
+{
+	if (block == nullptr)
+	{
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(_lock);
+		vector<void *> & blocks = _free[capacity];
+
+		if (blocks.size() < _maxPerClass)
+		{
+			blocks.push_back(block);
+			return;
+		}
+	}
+
+	munmap(block, capacity);
+}
+
+// Back large blocks obtained from now on with huge pages
+// INPUT: Takes a boolean
+// OUTPUT: Does not return
+void BufferPool::set_huge_pages(bool enabled)
+{
+	lock_guard<mutex> lock(_lock);
+	_hugePages = enabled;
+}
+
+// Return every cached block to the system
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+void BufferPool::trim()
+{
+	lock_guard<mutex> lock(_lock);
+
+	for (auto & entry : _free)
+	{
+		for (void * block : entry.second)
+		{
+			munmap(block, entry.first);
+		}
+
+		entry.second.clear();
+	}
+}
+
+// Returns the number of blocks obtained from the system so far
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t BufferPool::mapped() const
+{
+	lock_guard<mutex> lock(_lock);
+	return _mapped;
+}
+
+// Returns the number of blocks handed out again so far
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t BufferPool::reused() const
+{
+	lock_guard<mutex> lock(_lock);
+	return _reused;
+}
+
+// Returns the pool shared by all pixel buffers
+// Never destroyed, so buffers released during static destruction still
+// have somewhere to go
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a reference to the pool
+BufferPool & buffer_pool()
+{
+	static BufferPool * pool = new BufferPool;
+
+	return *pool;
+}
@@ -0,0 +1,50 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Recycles page aligned blocks for pixel data
+// Requests are rounded up to a size class (a page, or a quarter of the
+// power of two below the size, whichever is larger) so images of the
+// same dimensions share a class. Released blocks are kept per class and
+// handed out again, so a batch of same sized images stops allocating
+// after the first few. Blocks come straight from mmap, which aligns them
+// to pages; with huge pages on, large blocks are also advised to be
+// backed by transparent huge pages.
+class BufferPool
+{
+	private:
+
+		mutable mutex _lock;
+		map<size_t, vector<void *>> _free;	// Released blocks by class size
+		bool _hugePages;			// Advise huge pages for large blocks
+		size_t _maxPerClass;			// Released blocks kept per class
+		size_t _mapped;				// Blocks obtained from the system
+		size_t _reused;				// Blocks handed out again
+
+	public:
+
+		BufferPool();
+		~BufferPool();				// Return every cached block to the system
+		BufferPool(const BufferPool &) = delete;
+		BufferPool & operator=(const BufferPool &) = delete;
+
+		static size_t class_size(size_t);	// Size class a request is rounded up to
+
+		void * acquire(size_t, size_t &);	// Block of at least n bytes, its capacity filled in
+		void release(void *, size_t);		// Give a block back
+		void set_huge_pages(bool);		// Back large blocks with huge pages
+		void trim();				// Return cached blocks to the system
+
+		size_t mapped() const;			// Blocks obtained from the system so far
+		size_t reused() const;			// Blocks handed out again so far
+};
+
+BufferPool & buffer_pool();			// Pool shared by all pixel buffers
+
+#endif
@@ -0,0 +1,482 @@
+#include "convolve.h"
+#include "simd.h"
+#include "threadpool.h"
+#include <climits>
+#include <utility>
+
+// Run time kernel seen through the same members as a FixedKernel
+struct RuntimeKernel
+{
+	int size;
+	int shift;
+	int offset;
+	const int * weights;
+	bool separable;
+	const int * column;
+	const int * row;
+};
+
+// Copy a row into a buffer extended by replicating the edge pixels
+// INPUT: Takes the source row, the buffer, the width, bytes per pixel and the radius
+// OUTPUT: Does not return
+static void extend_row(const uint8_t * source, uint8_t * extended, int width, int step, int radius)
+{
+	int bytes = width * step;
+
+	for (int k = 0; k < radius; k++)
+	{
+		memcpy(extended + k * step, source, step);
+		memcpy(extended + (radius + width + k) * step, source + bytes - step, step);
+	}
+
+	memcpy(extended + radius * step, source, bytes);
+}
+
+// Round and saturate the sums of one row into it, keeping its alpha
+// INPUT: Takes the sums, the row, the width, bytes per pixel, the alpha
+// byte (-1 for none), the kernel shift and offset and a scratch buffer
+// OUTPUT: Does not return
+static void store_row(const int32_t * sums, uint8_t * out, int width, int step, int alpha, int shift, int offset,
+                      vector<uint8_t> & saved)
+{
+	if (alpha < 0)
+	{
+		saturate_row(sums, out, width * step, shift, offset);
+		return;
+	}
+
+	for (int x = 0; x < width; x++)
+	{
+		saved[x] = out[x * step + alpha];
+	}
+
+	saturate_row(sums, out, width * step, shift, offset);
+
+	for (int x = 0; x < width; x++)
+	{
+		out[x * step + alpha] = saved[x];
+	}
+}
+
+// Convolve with the factors of a rank one kernel
+// The horizontal pass keeps its exact sums in a 32 bit scratch image and
+// the vertical pass accumulates those, so nothing is rounded in between
+// INPUT: Takes the rows, the kernel, the row direction of the kernel's
+// first row and the alpha byte
+// OUTPUT: Does not return
+template <class K>
+static void convolve_separable(PixelRows rows, const K & k, int direction, int alpha)
+{
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+	int bytes = width * step;
+	int radius = k.size / 2;
+
+	vector<int32_t> horizontal((size_t) bytes * height);				// Zeroed sums of the first pass
+
+	parallel_rows(height, [&](const Band & band)					// Horizontal pass
+	{
+		vector<uint8_t> extended((width + 2 * radius) * step);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			int32_t * sums = &horizontal[(size_t) y * bytes];
+			extend_row(rows[y].pixels, extended.data(), width, step, radius);
+
+			for (int j = 0; j < k.size; j++)					// One tap at a time across the row
+			{
+				if (k.row[j] != 0)
+				{
+					mac_row(sums, &extended[j * step], k.row[j], bytes);
+				}
+			}
+		}
+	});
+
+	parallel_rows(height, [&](const Band & band)					// Vertical pass, whole rows at a time
+	{
+		vector<int32_t> sums(bytes);
+		vector<uint8_t> saved(width);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			fill(sums.begin(), sums.end(), 0);
+
+			for (int i = 0; i < k.size; i++)
+			{
+				if (k.column[i] != 0)
+				{
+					int source = y + direction * (i - radius);
+					source = source < 0 ? 0 : source >= height ? height - 1 : source;	// Clamp to the edge row
+					mac_row(sums.data(), &horizontal[(size_t) source * bytes], k.column[i], bytes);
+				}
+			}
+
+			store_row(sums.data(), rows[y].pixels, width, step, alpha, k.shift, k.offset, saved);
+		}
+	});
+}
+
+// Convolve tap by tap over the whole window
+// The source is first copied with its rows extended at both ends, which
+// also keeps bands from reading rows another band has already written
+// INPUT: Takes the rows, the kernel, the row direction of the kernel's
+// first row and the alpha byte
+// OUTPUT: Does not return
+template <class K>
+static void convolve_direct(PixelRows rows, const K & k, int direction, int alpha)
+{
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+	int bytes = width * step;
+	int radius = k.size / 2;
+	int stride = (width + 2 * radius) * step;
+
+	vector<uint8_t> extended((size_t) stride * height);
+
+	parallel_rows(height, [&](const Band & band)
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			extend_row(rows[y].pixels, &extended[(size_t) y * stride], width, step, radius);
+		}
+	});
+
+	parallel_rows(height, [&](const Band & band)
+	{
+		vector<int32_t> sums(bytes);
+		vector<uint8_t> saved(width);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			fill(sums.begin(), sums.end(), 0);
+
+			for (int i = 0; i < k.size; i++)
+			{
+				int source = y + direction * (i - radius);
+				source = source < 0 ? 0 : source >= height ? height - 1 : source;
+				const uint8_t * line = &extended[(size_t) source * stride];
+
+				for (int j = 0; j < k.size; j++)
+				{
+					if (k.weights[i * k.size + j] != 0)
+					{
+						mac_row(sums.data(), line + j * step, k.weights[i * k.size + j], bytes);
+					}
+				}
+			}
+
+			store_row(sums.data(), rows[y].pixels, width, step, alpha, k.shift, k.offset, saved);
+		}
+	});
+}
+
+// Convolve a bitmap with a run time kernel
+// Kernel rows run top down as the image is shown, which is bottom up in
+// memory unless the height is negative
+// INPUT: Takes a reference to a bitmap object and the kernel
+// OUTPUT: Does not return
+template <class K>
+static void run_kernel(Bitmap & b, const K & k)
+{
+	PixelRows rows = b.rows();
+
+	if (rows.width() == 0 || rows.height() == 0)
+	{
+		return;
+	}
+
+	RuntimeFormat layout = b.get_layout();
+	int alpha = layout.step == 4 ? 6 - layout.red - layout.green - layout.blue : -1;
+	int direction = b.get_height() < 0 ? 1 : -1;
+
+	if (k.separable)
+	{
+		convolve_separable(rows, k, direction, alpha);
+	}
+	else
+	{
+		convolve_direct(rows, k, direction, alpha);
+	}
+}
+
+// One tap of a compile time kernel
+// The weight is a constant, so a zero tap gives no code at all
+// INPUT: Takes the source value
+// OUTPUT: Returns the weighted value
+template <int Weight, class T>
+static inline int32_t tap(const T * source)
+{
+	if constexpr (Weight == 0)
+	{
+		return 0;
+	}
+	else
+	{
+		return Weight * (int32_t) *source;
+	}
+}
+
+// Horizontal taps of a rank one compile time kernel at one byte
+// INPUT: Takes the extended row at the first tap
+// OUTPUT: Returns the sum of the row factor's taps
+template <class K, int Step, size_t... J>
+static inline int32_t row_taps(const uint8_t * source, index_sequence<J...>)
+{
+	return (0 + ... + tap<K::factors.row[J]>(source + J * Step));
+}
+
+// Vertical taps of a rank one compile time kernel at one byte
+// INPUT: Takes the horizontal sums of the rows under the taps and the byte
+// OUTPUT: Returns the sum of the column factor's taps
+template <class K, size_t... I>
+static inline int32_t column_taps(const int32_t * const * lines, int x, index_sequence<I...>)
+{
+	return (0 + ... + tap<K::factors.column[I]>(lines[I] + x));
+}
+
+// Every tap of a compile time kernel at one byte
+// INPUT: Takes the extended rows under the kernel rows and the byte
+// OUTPUT: Returns the weighted sum of the window
+template <class K, int Step, size_t... T>
+static inline int32_t window_taps(const uint8_t * const * lines, int x, index_sequence<T...>)
+{
+	return (0 + ... + tap<K::weights[T]>(lines[T / K::size] + x + (T % K::size) * Step));
+}
+
+// Convolve with the factors of a rank one compile time kernel
+// As convolve_separable, with each pass a single expression per byte
+// INPUT: Takes the rows, the row direction of the kernel's first row and
+// the alpha byte
+// OUTPUT: Does not return
+template <class K, int Step>
+static void fixed_separable(PixelRows rows, int direction, int alpha)
+{
+	int width = rows.width();
+	int height = rows.height();
+	int bytes = width * Step;
+	int radius = K::size / 2;
+
+	vector<int32_t> horizontal((size_t) bytes * height);
+
+	parallel_rows(height, [&](const Band & band)					// Horizontal pass
+	{
+		vector<uint8_t> extended((width + 2 * radius) * Step);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			int32_t * sums = &horizontal[(size_t) y * bytes];
+			extend_row(rows[y].pixels, extended.data(), width, Step, radius);
+
+			for (int x = 0; x < bytes; x++)
+			{
+				sums[x] = row_taps<K, Step>(&extended[x], make_index_sequence<K::size>());
+			}
+		}
+	});
+
+	parallel_rows(height, [&](const Band & band)					// Vertical pass
+	{
+		vector<int32_t> sums(bytes);
+		vector<uint8_t> saved(width);
+		const int32_t * lines[K::size];
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			for (int i = 0; i < K::size; i++)
+			{
+				int source = y + direction * (i - radius);
+				source = source < 0 ? 0 : source >= height ? height - 1 : source;	// Clamp to the edge row
+				lines[i] = &horizontal[(size_t) source * bytes];
+			}
+
+			for (int x = 0; x < bytes; x++)
+			{
+				sums[x] = column_taps<K>(lines, x, make_index_sequence<K::size>());
+			}
+
+			store_row(sums.data(), rows[y].pixels, width, Step, alpha, K::shift, K::offset, saved);
+		}
+	});
+}
+
+// Convolve with every tap of a compile time kernel
+// As convolve_direct, with the whole window a single expression per byte
+// INPUT: Takes the rows, the row direction of the kernel's first row and
+// the alpha byte
+// OUTPUT: Does not return
+template <class K, int Step>
+static void fixed_direct(PixelRows rows, int direction, int alpha)
+{
+	int width = rows.width();
+	int height = rows.height();
+	int bytes = width * Step;
+	int radius = K::size / 2;
+	int stride = (width + 2 * radius) * Step;
+
+	vector<uint8_t> extended((size_t) stride * height);
+
+	parallel_rows(height, [&](const Band & band)
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			extend_row(rows[y].pixels, &extended[(size_t) y * stride], width, Step, radius);
+		}
+	});
+
+	parallel_rows(height, [&](const Band & band)
+	{
+		vector<int32_t> sums(bytes);
+		vector<uint8_t> saved(width);
+		const uint8_t * lines[K::size];
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			for (int i = 0; i < K::size; i++)
+			{
+				int source = y + direction * (i - radius);
+				source = source < 0 ? 0 : source >= height ? height - 1 : source;
+				lines[i] = &extended[(size_t) source * stride];
+			}
+
+			for (int x = 0; x < bytes; x++)
+			{
+				sums[x] = window_taps<K, Step>(lines, x, make_index_sequence<K::size * K::size>());
+			}
+
+			store_row(sums.data(), rows[y].pixels, width, Step, alpha, K::shift, K::offset, saved);
+		}
+	});
+}
+
+// Convolve with a compile time kernel at a fixed pixel size
+// INPUT: Takes the rows, the row direction of the kernel's first row and
+// the alpha byte
+// OUTPUT: Does not return
+template <class K, int Step>
+static void run_fixed(PixelRows rows, int direction, int alpha)
+{
+	if constexpr (K::separable)
+	{
+		fixed_separable<K, Step>(rows, direction, alpha);
+	}
+	else
+	{
+		fixed_direct<K, Step>(rows, direction, alpha);
+	}
+}
+
+// Convolve with a compile time kernel
+// Gives the same bytes as the run time kernel with the same weights
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+template <class K>
+void convolve(Bitmap & b)
+{
+	PixelRows rows = b.rows();
+
+	if (rows.width() == 0 || rows.height() == 0)
+	{
+		return;
+	}
+
+	RuntimeFormat layout = b.get_layout();
+	int alpha = layout.step == 4 ? 6 - layout.red - layout.green - layout.blue : -1;
+	int direction = b.get_height() < 0 ? 1 : -1;
+
+	if (layout.step == 4)
+	{
+		run_fixed<K, 4>(rows, direction, alpha);
+	}
+	else
+	{
+		run_fixed<K, 3>(rows, direction, alpha);
+	}
+}
+
+template void convolve<Gaussian5>(Bitmap &);
+template void convolve<Sharpen3>(Bitmap &);
+template void convolve<Emboss3>(Bitmap &);
+template void convolve<SobelX3>(Bitmap &);
+template void convolve<SobelY3>(Bitmap &);
+
+// Convolve with a run time kernel
+// Kernels whose sums could overflow 32 bits are refused
+// INPUT: Takes a reference to a bitmap object and the kernel
+// OUTPUT: Returns false if the kernel is malformed
+bool convolve(Bitmap & b, const Kernel & kernel)
+{
+	int size = kernel.size;
+
+	if (size < 1 || size % 2 == 0 || kernel.weights.size() != (size_t) size * size || kernel.shift < 0 || kernel.shift > 30)
+	{
+		return false;
+	}
+
+	long long reach = 0;								// Largest sum magnitude over 255
+
+	for (int w : kernel.weights)
+	{
+		reach += w < 0 ? -(long long) w : w;
+	}
+
+	if (reach * 255 > INT_MAX)
+	{
+		return false;
+	}
+
+	vector<int> column(size);
+	vector<int> row(size);
+	RuntimeKernel k = {size, kernel.shift, kernel.offset, kernel.weights.data(),
+	                   factor_kernel(kernel.weights.data(), size, column.data(), row.data()), column.data(), row.data()};
+
+	run_kernel(b, k);
+
+	return true;
+}
+
+// Returns true if a kernel is unchanged by horizontal and vertical flips
+// INPUT: Takes a kernel
+// OUTPUT: Returns a boolean
+bool kernel_symmetric(const Kernel & kernel)
+{
+	int n = kernel.size;
+
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			int w = kernel.weights[i * n + j];
+
+			if (w != kernel.weights[i * n + n - 1 - j] || w != kernel.weights[(n - 1 - i) * n + j])
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Returns true if a kernel is unchanged by transposition
+// INPUT: Takes a kernel
+// OUTPUT: Returns a boolean
+bool kernel_isotropic(const Kernel & kernel)
+{
+	int n = kernel.size;
+
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < i; j++)
+		{
+			if (kernel.weights[i * n + j] != kernel.weights[j * n + i])
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
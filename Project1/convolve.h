@@ -0,0 +1,194 @@
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <vector>
+#include "bitmap.h"
+
+// Square convolution kernel with integer weights, known at run time
+// Weights are listed row by row, top row first as the image is shown.
+// Each result is the weighted sum divided by 2^shift, rounded to
+// nearest, plus offset, saturated to 0 .. 255.
+struct Kernel
+{
+	int size;				// Odd width and height
+	vector<int> weights;			// size * size weights
+	int shift;				// Sums are divided by 2^shift
+	int offset;				// Added after dividing, 128 centers signed results
+};
+
+// Greatest common divisor, usable at compile time
+// INPUT: Takes two integers
+// OUTPUT: Returns their gcd, never negative
+constexpr int kernel_gcd(int a, int b)
+{
+	a = a < 0 ? -a : a;
+	b = b < 0 ? -b : b;
+
+	while (b != 0)
+	{
+		int r = a % b;
+		a = b;
+		b = r;
+	}
+
+	return a;
+}
+
+// Split a kernel of rank one into a column times a row
+// The row is the first nonzero kernel row over the gcd of its weights,
+// so when the kernel has rank one every kernel row is a whole multiple of
+// it and both factors are integers: convolving with them in turn gives
+// the same sums as the full kernel. Usable at compile time.
+// INPUT: Takes the weights, the size and arrays of size for the factors
+// OUTPUT: Returns false if the kernel does not have rank one
+constexpr bool factor_kernel(const int * weights, int size, int * column, int * row)
+{
+	int first = 0;									// First nonzero row
+
+	while (first < size * size && weights[first] == 0)
+	{
+		first++;
+	}
+
+	if (first == size * size)							// All zero
+	{
+		return false;
+	}
+
+	first /= size;
+	int divisor = 0;
+
+	for (int j = 0; j < size; j++)
+	{
+		divisor = kernel_gcd(divisor, weights[first * size + j]);
+	}
+
+	for (int j = 0; j < size; j++)
+	{
+		row[j] = weights[first * size + j] / divisor;
+	}
+
+	int pivot = 0;									// A nonzero column of the row
+
+	while (row[pivot] == 0)
+	{
+		pivot++;
+	}
+
+	for (int i = 0; i < size; i++)
+	{
+		if (weights[i * size + pivot] % row[pivot] != 0)
+		{
+			return false;
+		}
+
+		column[i] = weights[i * size + pivot] / row[pivot];
+	}
+
+	for (int i = 0; i < size; i++)							// Check every product
+	{
+		for (int j = 0; j < size; j++)
+		{
+			if (column[i] * row[j] != weights[i * size + j])
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Factors of a compile time kernel
+template <int Size>
+struct KernelFactors
+{
+	bool separable;
+	int column[Size];
+	int row[Size];
+};
+
+// Factor a compile time kernel
+// INPUT: Takes the weights
+// OUTPUT: Returns a KernelFactors
+template <int Size>
+constexpr KernelFactors<Size> kernel_factors(const int (& weights)[Size * Size])
+{
+	KernelFactors<Size> f = {};
+	f.separable = factor_kernel(weights, Size, f.column, f.row);
+	return f;
+}
+
+// Kernel fixed at compile time
+// The weights are template arguments and the factors are found by the
+// compiler. convolve<K>() expands the taps into one expression per byte,
+// with the weights as constants and zero taps left out.
+template <int Size, int Shift, int Offset, int... Weights>
+struct FixedKernel
+{
+	static_assert(Size % 2 == 1 && sizeof...(Weights) == Size * Size, "Kernels are odd squares");
+
+	static constexpr int size = Size;
+	static constexpr int shift = Shift;
+	static constexpr int offset = Offset;
+	static constexpr int weights[Size * Size] = {Weights...};
+	static constexpr KernelFactors<Size> factors = kernel_factors<Size>(weights);
+	static constexpr bool separable = factors.separable;
+	static constexpr const int * column = factors.column;
+	static constexpr const int * row = factors.row;
+};
+
+using Gaussian5 = FixedKernel<5, 8, 0,				// {1, 4, 6, 4, 1} x {1, 4, 6, 4, 1} / 256
+	1,  4,  6,  4, 1,
+	4, 16, 24, 16, 4,
+	6, 24, 36, 24, 6,
+	4, 16, 24, 16, 4,
+	1,  4,  6,  4, 1>;
+
+using Sharpen3 = FixedKernel<3, 0, 0,
+	 0, -1,  0,
+	-1,  5, -1,
+	 0, -1,  0>;
+
+using Emboss3 = FixedKernel<3, 0, 0,
+	-2, -1, 0,
+	-1,  1, 1,
+	 0,  1, 2>;
+
+using SobelX3 = FixedKernel<3, 2, 128,				// Horizontal gradient, flat areas become 128
+	-1, 0, 1,
+	-2, 0, 2,
+	-1, 0, 1>;
+
+using SobelY3 = FixedKernel<3, 2, 128,				// Vertical gradient, flat areas become 128
+	-1, -2, -1,
+	 0,  0,  0,
+	 1,  2,  1>;
+
+// Convolve with a compile time kernel
+// Instantiated in convolve.cpp for the kernels above
+template <class K>
+void convolve(Bitmap & b);
+
+// Convolve with a run time kernel
+// Rank one kernels run as a horizontal and a vertical pass, others tap by
+// tap over the whole window. Every tap is a multiply-accumulate of whole
+// rows into 32 bit sums, which are rounded and saturated once at the end,
+// so the separable passes give exactly the sums of the full kernel.
+// Edges are clamped; alpha is left as it is.
+// Returns false if the kernel is malformed.
+bool convolve(Bitmap & b, const Kernel & kernel);
+
+// Run time copy of a compile time kernel
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a Kernel
+template <class K>
+Kernel kernel_of()
+{
+	return {K::size, vector<int>(K::weights, K::weights + K::size * K::size), K::shift, K::offset};
+}
+
+bool kernel_symmetric(const Kernel &);		// Unchanged by horizontal and vertical flips
+bool kernel_isotropic(const Kernel &);		// Unchanged by transposition
+
+#endif
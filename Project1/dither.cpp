@@ -0,0 +1,237 @@
+#include "dither.h"
+#include "pointops.h"
+#include "threadpool.h"
+
+const int DIFFUSION_TILE = 128;			// Columns and rows of an error diffusion tile, rows must not exceed columns
+const int CELL_LEVELS[3] = {0, 128, 255};	// Cell shade levels
+
+// 8x8 Bayer index matrix, thresholds (m + 0.5) / 64
+const uint8_t BAYER[8][8] =
+{
+	{ 0, 32,  8, 40,  2, 34, 10, 42},
+	{48, 16, 56, 24, 50, 18, 58, 26},
+	{12, 44,  4, 36, 14, 46,  6, 38},
+	{60, 28, 52, 20, 62, 30, 54, 22},
+	{ 3, 35, 11, 43,  1, 33,  9, 41},
+	{51, 19, 59, 27, 49, 17, 57, 25},
+	{15, 47,  7, 39, 13, 45,  5, 37},
+	{63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+// Nearest level to every value
+// Values up to the midpoint of two levels, rounded up, go to the lower
+// one, so the cell levels 0, 128 and 255 split at 64 and 192 exactly as
+// cellShade() does
+// INPUT: Takes the sorted levels
+// OUTPUT: Returns a Lut
+static Lut nearest_table(const vector<int> & levels)
+{
+	Lut table;
+	size_t k = 0;
+
+	for (int v = 0; v < 256; v++)
+	{
+		while (k + 1 < levels.size() && 2 * v > levels[k] + levels[k + 1] + 1)
+		{
+			k++;
+		}
+
+		table[v] = levels[k];
+	}
+
+	return table;
+}
+
+// Ordered dithering
+// Row m of the table maps a value to the upper of the two levels around
+// it when its position between them is above threshold m
+// INPUT: Takes the rows, the channel offsets and the levels
+// OUTPUT: Does not return
+static void ordered_dither(PixelRows rows, const int channel[3], const vector<int> & levels)
+{
+	vector<Lut> tables(64);
+
+	for (int m = 0; m < 64; m++)
+	{
+		size_t k = 0;
+
+		for (int v = 0; v < 256; v++)
+		{
+			while (k + 1 < levels.size() && levels[k + 1] <= v)
+			{
+				k++;
+			}
+
+			bool last = k + 1 == levels.size() || v < levels[0];
+			int low = levels[k];
+			int high = last ? low : levels[k + 1];
+
+			tables[m][v] = !last && 64 * (v - low) > (m + 0.5) * (high - low) ? high : low;
+		}
+	}
+
+	int step = rows.step();
+
+	parallel_rows(rows.height(), [&](const Band & band)
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			uint8_t * p = rows[y].pixels;
+			const uint8_t * thresholds = BAYER[y & 7];
+
+			for (int x = 0; x < rows.width(); x++, p += step)
+			{
+				const Lut & table = tables[thresholds[x & 7]];
+
+				p[channel[0]] = table[p[channel[0]]];
+				p[channel[1]] = table[p[channel[1]]];
+				p[channel[2]] = table[p[channel[2]]];
+			}
+		}
+	}, 0, 8);									// Bands keep the pattern's rows in step
+}
+
+// Floyd-Steinberg error diffusion of one tile
+// Row r of tile (i, j) holds the pixels [j * W - r, (j + 1) * W - r) of
+// row i * H + r, so everything a row needs from the row above is in the
+// same tile or in tiles of earlier waves
+// INPUT: Takes the rows, the channel offsets, the table of nearest
+// levels, the error image and the tile
+// OUTPUT: Does not return
+static void diffuse_tile(PixelRows rows, const int channel[3], const Lut & nearest, vector<int16_t> & errors,
+                         int i, int j)
+{
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+
+	for (int r = 0; r < DIFFUSION_TILE && i * DIFFUSION_TILE + r < height; r++)
+	{
+		int y = i * DIFFUSION_TILE + r;
+		int first = j * DIFFUSION_TILE - r;
+		int last = first + DIFFUSION_TILE;
+		first = first < 0 ? 0 : first;
+		last = last > width ? width : last;
+
+		uint8_t * p = rows[y].pixels;
+		int16_t * here = &errors[(size_t) y * width * 3];			// Errors owed to this row, in 1/16ths
+		int16_t * below = y + 1 < height ? here + (size_t) width * 3 : nullptr;
+
+		for (int x = first; x < last; x++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				uint8_t & component = p[x * step + channel[c]];
+				int value = (component * 16 + here[x * 3 + c] + 8) >> 4;
+				value = value < 0 ? 0 : value > 255 ? 255 : value;
+
+				int e = value - nearest[value];
+				component = nearest[value];
+
+				if (x + 1 < width)
+				{
+					here[(x + 1) * 3 + c] += 7 * e;
+				}
+
+				if (below != nullptr)
+				{
+					if (x > 0)
+					{
+						below[(x - 1) * 3 + c] += 3 * e;
+					}
+
+					below[x * 3 + c] += 5 * e;
+
+					if (x + 1 < width)
+					{
+						below[(x + 1) * 3 + c] += e;
+					}
+				}
+			}
+		}
+	}
+}
+
+// Floyd-Steinberg dithering over diagonal waves of tiles
+// Tile (i, j) waits on (i, j - 1) and (i - 1, j + 1). The last row of
+// (i, j) also adds error to the first cell of (i + 1, j - 2)'s first row,
+// which that tile adds to as well, so they must not run together: wave w
+// holds the tiles with j + 3i = w and each wave is one batch on the pool
+// INPUT: Takes the rows, the channel offsets and the levels
+// OUTPUT: Does not return
+static void floyd_steinberg(PixelRows rows, const int channel[3], const vector<int> & levels)
+{
+	int width = rows.width();
+	int height = rows.height();
+	Lut nearest = nearest_table(levels);
+	vector<int16_t> errors((size_t) width * height * 3);				// Zeroed
+
+	int down = (height + DIFFUSION_TILE - 1) / DIFFUSION_TILE;
+	int across = (width + 2 * DIFFUSION_TILE - 2) / DIFFUSION_TILE;		// Rows lean left by up to a tile
+
+	for (int wave = 0; wave < across + 3 * (down - 1); wave++)
+	{
+		int top = wave - (across - 1) > 0 ? (wave - across + 3) / 3 : 0;	// First tile row with j < across
+		int bottom = wave / 3 < down - 1 ? wave / 3 : down - 1;
+
+		if (bottom < top)
+		{
+			continue;
+		}
+
+		thread_pool().run(bottom - top + 1, [&](int k)
+		{
+			int i = top + k;
+			diffuse_tile(rows, channel, nearest, errors, i, wave - 3 * i);
+		});
+	}
+}
+
+// Quantize every color channel to a set of levels
+// INPUT: Takes a reference to a bitmap object, the levels and the dither mode
+// OUTPUT: Does not return
+void dither(Bitmap & b, const vector<int> & levels, DitherMode mode)
+{
+	PixelRows rows = b.rows();
+
+	if (levels.empty() || rows.width() == 0 || rows.height() == 0)
+	{
+		return;
+	}
+
+	RuntimeFormat layout = b.get_layout();
+	int channel[3] = {layout.red, layout.green, layout.blue};
+
+	switch (mode)
+	{
+		case DITHER_ORDERED:
+			ordered_dither(rows, channel, levels);
+			break;
+
+		case DITHER_FLOYD_STEINBERG:
+			floyd_steinberg(rows, channel, levels);
+			break;
+
+		default:
+		{
+			Lut table = nearest_table(levels);
+			PointOps().map(table, table, table).apply(b);
+			break;
+		}
+	}
+}
+
+// Cell shading with a dither mode
+// Without dithering this is cellShade(), whose thresholds are 64 and 192
+// INPUT: Takes a reference to a bitmap object and the dither mode
+// OUTPUT: Does not return
+void cellShade(Bitmap & b, DitherMode mode)
+{
+	if (mode == DITHER_NONE)
+	{
+		cellShade(b);
+		return;
+	}
+
+	dither(b, vector<int>(CELL_LEVELS, CELL_LEVELS + 3), mode);
+}
@@ -0,0 +1,28 @@
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <vector>
+#include "bitmap.h"
+
+// How a quantizer spreads the error of snapping values to a few levels
+enum DitherMode
+{
+	DITHER_NONE,				// Nearest level
+	DITHER_ORDERED,				// 8x8 Bayer thresholds
+	DITHER_FLOYD_STEINBERG			// Error diffusion
+};
+
+// Quantize red, green and blue to a sorted set of levels; alpha is left as it is
+// Ordered dithering picks between the two levels around a value by
+// comparing its position between them with a Bayer threshold tiled over
+// the image, a table lookup per byte. Floyd-Steinberg passes each
+// pixel's error on to its unprocessed neighbours (7/16 right, 3/16,
+// 5/16 and 1/16 below) in scan order. Each pixel needs the row above
+// done one pixel further along, so the image is cut into tiles that
+// lean one pixel left per row and each diagonal wave of tiles runs in
+// parallel; the result is the same as a single thread's.
+void dither(Bitmap & b, const vector<int> & levels, DitherMode mode);
+
+void cellShade(Bitmap & b, DitherMode mode);	// Cell shade with dithering
+
+#endif
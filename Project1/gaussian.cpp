@@ -0,0 +1,440 @@
+#include "bitmap.h"
+#include "convolve.h"
+#include "threadpool.h"
+#include <cmath>
+#include <complex>
+
+const int WEIGHT_SHIFT = 16;				// Weights are fixed point with 16 fraction bits
+const int WEIGHT_ONE = 1 << WEIGHT_SHIFT;
+const int COLUMN_BATCH = 64;				// Channel columns per task of the recursive vertical pass
+const complex<double> RECURSIVE_POLES[3] = {{1.41650, 1.00829}, {1.41650, -1.00829}, {1.86543, 0.0}};	// Sigma 2 at q = 1
+
+// Fixed point Gaussian weights for taps -radius .. radius
+// Rounding error is folded into the center tap so the weights sum to one
+// INPUT: Takes sigma and the radius
+// OUTPUT: Returns a vector of 2 * radius + 1 weights
+vector<int> gaussian_weights(double sigma, int radius)
+{
+	vector<double> exact(2 * radius + 1);
+	double total = 0.0;
+
+	for (int k = -radius; k <= radius; k++)
+	{
+		exact[k + radius] = exp(-(k * k) / (2.0 * sigma * sigma));
+		total += exact[k + radius];
+	}
+
+	vector<int> weights(2 * radius + 1);
+	int sum = 0;
+
+	for (int k = 0; k <= 2 * radius; k++)
+	{
+		weights[k] = (int) lround(exact[k] / total * WEIGHT_ONE);
+		sum += weights[k];
+	}
+
+	weights[radius] += WEIGHT_ONE - sum;
+
+	return weights;
+}
+
+// Filter one row of interleaved channel bytes with a symmetric kernel
+// The row is first copied into a buffer extended by replicating the
+// edge pixels, so the tap loop has no bounds checks and vectorizes
+// INPUT: Takes the source and destination rows, the width, bytes per
+// pixel, the weights and scratch buffers
+// OUTPUT: Does not return
+static void filter_row(const uint8_t * src, uint8_t * dst, int width, int step, const vector<int> & weights,
+                       vector<uint8_t> & extended, vector<int> & sums)
+{
+	int radius = weights.size() / 2;
+	int bytes = width * step;
+
+	for (int k = 0; k < radius; k++)						// Replicate edge pixels
+	{
+		memcpy(&extended[k * step], src, step);
+		memcpy(&extended[(radius + width + k) * step], src + bytes - step, step);
+	}
+
+	memcpy(&extended[radius * step], src, bytes);
+
+	int * acc = sums.data();
+
+	for (int i = 0; i < bytes; i++)
+	{
+		acc[i] = WEIGHT_ONE / 2;						// Rounding
+	}
+
+	for (int k = 0; k <= 2 * radius; k++)						// One tap at a time across the row
+	{
+		const uint8_t * tap = &extended[k * step];
+		int w = weights[k];
+
+		for (int i = 0; i < bytes; i++)
+		{
+			acc[i] += w * tap[i];
+		}
+	}
+
+	for (int i = 0; i < bytes; i++)
+	{
+		dst[i] = acc[i] >> WEIGHT_SHIFT;
+	}
+}
+
+// Blur with a separable symmetric kernel given as fixed point weights
+// A horizontal pass writes into a scratch image and a vertical pass
+// writes back into the bitmap; both clamp at the image edges and run
+// on row bands in parallel, each band with its own accumulators. Only
+// the color bytes are written back, alpha is left as it is.
+// INPUT: Takes a reference to a bitmap object and the weights
+// OUTPUT: Does not return
+void separable_blur(Bitmap & b, const vector<int> & weights)
+{
+	PixelRows rows = b.rows();
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+	int bytes = width * step;
+	int radius = weights.size() / 2;
+	RuntimeFormat layout = b.get_layout();
+	int alpha = step == 4 ? 6 - layout.red - layout.green - layout.blue : -1;
+
+	if (width == 0 || height == 0)
+	{
+		return;
+	}
+
+	vector<uint8_t> horizontal((size_t) bytes * height);				// Result of the first pass
+
+	parallel_rows(height, [&](const Band & band)					// Horizontal pass
+	{
+		vector<uint8_t> extended((width + 2 * radius) * step);
+		vector<int> sums(bytes);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			filter_row(rows[y].pixels, &horizontal[(size_t) y * bytes], width, step, weights, extended, sums);
+		}
+	});
+
+	parallel_rows(height, [&](const Band & band)					// Vertical pass, whole rows at a time
+	{
+		vector<int> sums(bytes);
+		vector<uint8_t> saved(width);
+		int * acc = sums.data();
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			for (int i = 0; i < bytes; i++)
+			{
+				acc[i] = WEIGHT_ONE / 2;
+			}
+
+			for (int k = -radius; k <= radius; k++)
+			{
+				int source = y + k < 0 ? 0 : y + k >= height ? height - 1 : y + k;	// Clamp to the edge row
+				const uint8_t * tap = &horizontal[(size_t) source * bytes];
+				int w = weights[k + radius];
+
+				for (int i = 0; i < bytes; i++)
+				{
+					acc[i] += w * tap[i];
+				}
+			}
+
+			uint8_t * out = rows[y].pixels;
+
+			for (int x = 0; alpha >= 0 && x < width; x++)
+			{
+				saved[x] = out[x * step + alpha];
+			}
+
+			for (int i = 0; i < bytes; i++)
+			{
+				out[i] = acc[i] >> WEIGHT_SHIFT;
+			}
+
+			for (int x = 0; alpha >= 0 && x < width; x++)
+			{
+				out[x * step + alpha] = saved[x];
+			}
+		}
+	});
+}
+
+// Gaussian blur
+// Two one dimensional passes with fixed point weights, so the cost per
+// pixel grows with the radius rather than its square
+// INPUT: Takes a reference to a bitmap object, sigma and the radius
+// (0 picks 3 sigma)
+// OUTPUT: Does not return
+void gaussian_blur(Bitmap & b, double sigma, int radius)
+{
+	if (sigma <= 0.0)
+	{
+		return;
+	}
+
+	if (radius <= 0)
+	{
+		radius = (int) ceil(3.0 * sigma);
+	}
+
+	separable_blur(b, gaussian_weights(sigma, radius));
+}
+
+// Coefficients of the third order recursive Gaussian
+// The causal pass is y[n] = gain * x[n] + a[0] y[n - 1] + a[1] y[n - 2] + a[2] y[n - 3]
+// and the anticausal pass the same run backwards over its output
+struct RecursiveGaussian
+{
+	double gain;
+	double a[3];
+	double edge[3][3];		// Starts the anticausal pass from the causal pass's last three outputs
+};
+
+// Variance of the filter built from the base poles raised to 1 / q
+// INPUT: Takes q
+// OUTPUT: Returns the variance in pixels squared
+static double recursive_variance(double q)
+{
+	double variance = 0.0;
+
+	for (const complex<double> & pole : RECURSIVE_POLES)
+	{
+		complex<double> d = exp(log(pole) / q);
+		variance += (2.0 * d / ((d - 1.0) * (d - 1.0))).real();
+	}
+
+	return variance;
+}
+
+// Coefficients for a sigma
+// The poles of van Vliet, Young and Verbeek (1998) are scaled until the
+// variance of the forward and backward passes together is sigma^2. The
+// edge matrix (Triggs and Sdika, 2006) is found by running an offset
+// from each of the last three causal outputs on into a constant
+// extension of the row and back again, so clamped edges come out as if
+// the row went on forever.
+// INPUT: Takes sigma, at least 0.5
+// OUTPUT: Returns a RecursiveGaussian
+static RecursiveGaussian recursive_coefficients(double sigma)
+{
+	double low = 0.35;								// Variance rises from below 0.25 here
+	double high = sigma + 1.0;
+
+	for (int i = 0; i < 60; i++)							// Bisect for q
+	{
+		double q = (low + high) / 2.0;
+		(recursive_variance(q) < sigma * sigma ? low : high) = q;
+	}
+
+	double q = (low + high) / 2.0;
+	complex<double> d[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		d[i] = exp(log(RECURSIVE_POLES[i]) / q);
+	}
+
+	double scale = (d[0] * d[1] * d[2]).real();
+	RecursiveGaussian g = {};
+
+	g.a[0] = ((d[0] * d[1] + d[0] * d[2] + d[1] * d[2]) / scale).real();
+	g.a[1] = (-(d[0] + d[1] + d[2]) / scale).real();
+	g.a[2] = 1.0 / scale;
+	g.gain = 1.0 - g.a[0] - g.a[1] - g.a[2];					// Unit gain for flat rows
+
+	int length = (int) (40.0 * sigma) + 64;						// Far enough for the response to vanish
+	vector<double> causal(length);
+	vector<double> anticausal(length + 3);
+
+	for (int j = 0; j < 3; j++)
+	{
+		double last[3] = {0.0, 0.0, 0.0};					// Causal outputs n - 1, n - 2, n - 3
+		last[j] = 1.0;
+
+		for (int t = 0; t < length; t++)					// On into the extension
+		{
+			causal[t] = g.a[0] * last[0] + g.a[1] * last[1] + g.a[2] * last[2];
+			last[2] = last[1];
+			last[1] = last[0];
+			last[0] = causal[t];
+		}
+
+		fill(anticausal.begin(), anticausal.end(), 0.0);
+
+		for (int t = length - 1; t >= 0; t--)					// And back to the edge
+		{
+			anticausal[t] = g.gain * causal[t] + g.a[0] * anticausal[t + 1] + g.a[1] * anticausal[t + 2]
+			                + g.a[2] * anticausal[t + 3];
+		}
+
+		for (int r = 0; r < 3; r++)
+		{
+			g.edge[r][j] = anticausal[r];
+		}
+	}
+
+	return g;
+}
+
+// Causal then anticausal recursion along one direction, in place
+// Element k of lane i is at data[k * stride + i]. Each step reads whole
+// rows of lanes, so with many lanes the inner loops run in vector
+// registers and a column batch stays in cache from one row to the next.
+// The feedback is kept in doubles: at large sigmas the gain is tiny and
+// float feedback drifts by whole levels.
+// INPUT: Takes the data, the count along the direction, the lanes, the
+// stride, the coefficients and a scratch buffer of 4 * lanes doubles
+// OUTPUT: Does not return
+static void recursive_pass(float * data, int count, int lanes, size_t stride, const RecursiveGaussian & g, double * scratch)
+{
+	double * y1 = scratch;								// Outputs one, two and three steps back
+	double * y2 = scratch + lanes;
+	double * y3 = scratch + 2 * lanes;
+	double * last = scratch + 3 * lanes;						// Input at the end
+
+	for (int i = 0; i < lanes; i++)							// Flat before the start
+	{
+		y1[i] = y2[i] = y3[i] = data[i];
+		last[i] = data[(count - 1) * stride + i];
+	}
+
+	for (int k = 0; k < count; k++)							// Causal
+	{
+		float * x = data + k * stride;
+
+		for (int i = 0; i < lanes; i++)
+		{
+			y3[i] = g.gain * x[i] + g.a[0] * y1[i] + g.a[1] * y2[i] + g.a[2] * y3[i];
+			x[i] = y3[i];
+		}
+
+		swap(y2, y3);								// Newest becomes y1
+		swap(y1, y2);
+	}
+
+	for (int i = 0; i < lanes; i++)							// Edge state
+	{
+		double w[3] = {y1[i] - last[i], y2[i] - last[i], y3[i] - last[i]};
+
+		y1[i] = last[i] + g.edge[0][0] * w[0] + g.edge[0][1] * w[1] + g.edge[0][2] * w[2];
+		y2[i] = last[i] + g.edge[1][0] * w[0] + g.edge[1][1] * w[1] + g.edge[1][2] * w[2];
+		y3[i] = last[i] + g.edge[2][0] * w[0] + g.edge[2][1] * w[1] + g.edge[2][2] * w[2];
+	}
+
+	for (int k = count - 1; k >= 0; k--)						// Anticausal
+	{
+		float * x = data + k * stride;
+
+		for (int i = 0; i < lanes; i++)
+		{
+			y3[i] = g.gain * x[i] + g.a[0] * y1[i] + g.a[1] * y2[i] + g.a[2] * y3[i];
+			x[i] = y3[i];
+		}
+
+		swap(y2, y3);
+		swap(y1, y2);
+	}
+}
+
+// Recursive Gaussian blur
+// Third order IIR passes down the columns and then along the rows, so
+// the cost per pixel is the same for any sigma. The vertical pass runs
+// on batches of COLUMN_BATCH adjacent channel columns, each batch a
+// task of its own. Sigmas below 0.5, where the recursive fit is poor,
+// use the FIR gaussian_blur instead. Alpha is left as it is.
+// INPUT: Takes a reference to a bitmap object and sigma
+// OUTPUT: Does not return
+void recursive_gaussian_blur(Bitmap & b, double sigma)
+{
+	if (sigma < 0.5)
+	{
+		gaussian_blur(b, sigma);
+		return;
+	}
+
+	PixelRows rows = b.rows();
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+	int bytes = width * step;
+
+	if (width == 0 || height == 0)
+	{
+		return;
+	}
+
+	RuntimeFormat layout = b.get_layout();
+	int alpha = step == 4 ? 6 - layout.red - layout.green - layout.blue : -1;
+	RecursiveGaussian g = recursive_coefficients(sigma);
+	vector<float> work((size_t) bytes * height);
+
+	parallel_rows(height, [&](const Band & band)					// To floats
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			const uint8_t * in = rows[y].pixels;
+			float * out = &work[(size_t) y * bytes];
+
+			for (int i = 0; i < bytes; i++)
+			{
+				out[i] = in[i];
+			}
+		}
+	});
+
+	int batches = (bytes + COLUMN_BATCH - 1) / COLUMN_BATCH;
+
+	thread_pool().run(batches, [&](int batch)					// Vertical pass
+	{
+		int first = batch * COLUMN_BATCH;
+		int lanes = first + COLUMN_BATCH < bytes ? COLUMN_BATCH : bytes - first;
+		double scratch[4 * COLUMN_BATCH];
+
+		recursive_pass(&work[first], height, lanes, bytes, g, scratch);
+	});
+
+	parallel_rows(height, [&](const Band & band)					// Horizontal pass and back to bytes
+	{
+		double scratch[4 * 4];
+		vector<uint8_t> saved(width);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			float * in = &work[(size_t) y * bytes];
+			uint8_t * out = rows[y].pixels;
+
+			recursive_pass(in, width, step, step, g, scratch);
+
+			for (int x = 0; alpha >= 0 && x < width; x++)
+			{
+				saved[x] = out[x * step + alpha];
+			}
+
+			for (int i = 0; i < bytes; i++)
+			{
+				float v = in[i] + 0.5f;
+				out[i] = v < 0.0f ? 0 : v >= 255.0f ? 255 : (uint8_t) v;
+			}
+
+			for (int x = 0; alpha >= 0 && x < width; x++)
+			{
+				out[x * step + alpha] = saved[x];
+			}
+		}
+	});
+}
+
+// Gaussian Blurring
+// Applies the 5x5 gaussian matrix {1, 4, 6, 4, 1} x {1, 4, 6, 4, 1} / 256
+// around every pixel; the engine finds the factors at compile time and
+// runs two passes
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void blur(Bitmap & b)
+{
+	convolve<Gaussian5>(b);
+}
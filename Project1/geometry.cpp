@@ -0,0 +1,277 @@
+#include "geometry.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define GEOMETRY_SSE2 1
+#endif
+
+const int TILE = 64;					// Output tile edge in pixels
+
+// Rotations and flips that keep rows as rows, done in place
+// Mirroring y swaps whole rows, mirroring x reverses the pixels of a row;
+// bands of row pairs run in parallel
+// INPUT: Takes a reference to a bitmap object and the transform
+// OUTPUT: Does not return
+static void mirror_in_place(Bitmap & b, Transform t)
+{
+	PixelRows rows = b.rows();
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+	int bytes = width * step;
+
+	auto reverse = [&](uint8_t * left)
+	{
+		uint8_t * right = left + bytes - step;
+
+		for (; left < right; left += step, right -= step)
+		{
+			swap_ranges(left, left + step, right);
+		}
+	};
+
+	if (t.mirrorY)
+	{
+		parallel_rows((height + 1) / 2, [&](const Band & band)			// Row y pairs with its mirror
+		{
+			for (int y = band.first; y < band.last; y++)
+			{
+				uint8_t * top = rows[y].pixels;
+				uint8_t * bottom = rows[height - 1 - y].pixels;
+
+				if (top != bottom)
+				{
+					swap_ranges(top, top + bytes, bottom);
+				}
+
+				if (t.mirrorX)
+				{
+					reverse(top);
+
+					if (top != bottom)
+					{
+						reverse(bottom);
+					}
+				}
+			}
+		});
+	}
+	else if (t.mirrorX)
+	{
+		parallel_rows(height, [&](const Band & band)
+		{
+			for (int y = band.first; y < band.last; y++)
+			{
+				reverse(rows[y].pixels);
+			}
+		});
+	}
+}
+
+// Copy one output tile pixel by pixel
+// INPUT: Takes the first source pixel, the source steps per output x and
+// y, the first output pixel, the output stride, tile size and pixel size
+// OUTPUT: Does not return
+template <int Step>
+static void copy_tile(const uint8_t * src, ptrdiff_t dx, ptrdiff_t dy, uint8_t * dst, int stride, int columns, int lines)
+{
+	for (int j = 0; j < lines; j++)
+	{
+		const uint8_t * s = src + j * dy;
+		uint8_t * d = dst + (ptrdiff_t) j * stride;
+
+		for (int i = 0; i < columns; i++, s += dx, d += Step)
+		{
+			memcpy(d, s, Step);
+		}
+	}
+}
+
+#ifdef GEOMETRY_SSE2
+
+// Transpose one 4x4 block of 32 bit pixels
+// Source lanes run along output rows; a backwards source step reverses them
+// INPUT: Takes the first source pixel, the source steps per output x and
+// y, the first output pixel and the output stride
+// OUTPUT: Does not return
+static inline void transpose4(const uint8_t * src, ptrdiff_t dx, ptrdiff_t dy, uint8_t * dst, int stride)
+{
+	__m128i v[4];
+
+	for (int i = 0; i < 4; i++)					// Column i of the block, 4 pixels along dy
+	{
+		if (dy > 0)
+		{
+			v[i] = _mm_loadu_si128((const __m128i *) (src + i * dx));
+		}
+		else
+		{
+			v[i] = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (src + i * dx + 3 * dy)), 0x1b);
+		}
+	}
+
+	__m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+	__m128i t1 = _mm_unpacklo_epi32(v[2], v[3]);
+	__m128i t2 = _mm_unpackhi_epi32(v[0], v[1]);
+	__m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+
+	_mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *) (dst + stride), _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *) (dst + 2 * stride), _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *) (dst + 3 * stride), _mm_unpackhi_epi64(t2, t3));
+}
+
+#endif
+
+// Copy one output tile of a transposing transform
+// 32 bit pixels go through 4x4 register transposes, the rest one at a time
+// INPUT: Takes the first source pixel, the source steps per output x and
+// y, the first output pixel, the output stride and the tile size
+// OUTPUT: Does not return
+template <int Step>
+static void transpose_tile(const uint8_t * src, ptrdiff_t dx, ptrdiff_t dy, uint8_t * dst, int stride, int columns, int lines)
+{
+#ifdef GEOMETRY_SSE2
+	if (Step == 4)
+	{
+		int fullColumns = columns & ~3;
+		int fullLines = lines & ~3;
+
+		for (int j = 0; j < fullLines; j += 4)
+		{
+			for (int i = 0; i < fullColumns; i += 4)
+			{
+				transpose4(src + i * dx + j * dy, dx, dy, dst + (ptrdiff_t) j * stride + i * 4, stride);
+			}
+		}
+
+		copy_tile<Step>(src + fullColumns * dx, dx, dy, dst + fullColumns * 4, stride, columns - fullColumns, fullLines);
+		copy_tile<Step>(src + fullLines * dy, dx, dy, dst + (ptrdiff_t) fullLines * stride, stride, columns, lines - fullLines);
+		return;
+	}
+#endif
+
+	copy_tile<Step>(src, dx, dy, dst, stride, columns, lines);
+}
+
+// Rotations and flips that turn rows into columns
+// The output is filled in square tiles so both the rows written and the
+// source columns read stay within a few pages at a time; tiles are spread
+// over the thread pool
+// INPUT: Takes the source pixels, a reference to the reshaped bitmap, the
+// source dimensions and stride, and the transform
+// OUTPUT: Does not return
+template <int Step>
+static void transpose_tiled(const uint8_t * source, Bitmap & b, int width, int height, int sourceStride, Transform t)
+{
+	PixelRows rows = b.rows();
+	int outWidth = rows.width();
+	int outHeight = rows.height();
+
+	ptrdiff_t dx = t.mirrorY ? -sourceStride : sourceStride;			// Output x walks source rows
+	ptrdiff_t dy = t.mirrorX ? -Step : Step;					// Output y walks source columns
+	const uint8_t * origin = source + (t.mirrorY ? (ptrdiff_t) (height - 1) * sourceStride : 0)
+	                                + (t.mirrorX ? (ptrdiff_t) (width - 1) * Step : 0);	// Source of output (0, 0)
+
+	parallel_tiles(outWidth, outHeight, TILE, [&](const Tile & tile)
+	{
+		transpose_tile<Step>(origin + tile.x * dx + tile.y * dy, dx, dy, rows[tile.y].pixels + tile.x * Step, rows.stride(),
+		                     tile.width, tile.height);
+	});
+}
+
+// Apply a rotation or flip
+// Transforms that keep rows as rows run in place; the others swap the
+// width and height in the headers and fill a new pixel array in tiles.
+// Rows of a top down bitmap run the other way, so a turn in file order
+// is mirrored: both axes flip, which swaps the two rotations and the two
+// diagonals.
+// INPUT: Takes a reference to a bitmap object and the transform
+// OUTPUT: Does not return
+void transform(Bitmap & b, Transform t)
+{
+	if (!t.transpose)
+	{
+		mirror_in_place(b, t);
+		return;
+	}
+
+	if (b.get_height() < 0)
+	{
+		t.mirrorX = !t.mirrorX;
+		t.mirrorY = !t.mirrorY;
+	}
+
+	int width = b.get_width();
+	int height = abs(b.get_height());
+	int sourceStride = b.get_stride();
+	PixelBuffer source = b.reshape(height, width);
+
+	if (b.get_step() == 4)
+	{
+		transpose_tiled<4>(source.data(), b, width, height, sourceStride, t);
+	}
+	else
+	{
+		transpose_tiled<3>(source.data(), b, width, height, sourceStride, t);
+	}
+}
+
+// Rotate 90 degrees clockwise
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void rot90(Bitmap & b)
+{
+	transform(b, ROTATE_90);
+}
+
+// Rotate 180 degrees
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void rot180(Bitmap & b)
+{
+	transform(b, ROTATE_180);
+}
+
+// Rotate 270 degrees clockwise
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void rot270(Bitmap & b)
+{
+	transform(b, ROTATE_270);
+}
+
+// Flip top to bottom
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void flipv(Bitmap & b)
+{
+	transform(b, FLIP_VERTICAL);
+}
+
+// Flip left to right
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void fliph(Bitmap & b)
+{
+	transform(b, FLIP_HORIZONTAL);
+}
+
+// Flip across the top left to bottom right diagonal
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void flipd1(Bitmap & b)
+{
+	transform(b, FLIP_DIAGONAL_1);
+}
+
+// Flip across the bottom left to top right diagonal
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void flipd2(Bitmap & b)
+{
+	transform(b, FLIP_DIAGONAL_2);
+}
@@ -0,0 +1,28 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include "bitmap.h"
+
+// One of the eight rotations and flips of a rectangle
+// Output pixel (x, y) is read from input pixel (u, v) with
+// (u, v) = transpose ? (y, x) : (x, y), then u mirrored across the input
+// width if mirrorX and v mirrored across the input height if mirrorY
+struct Transform
+{
+	bool transpose;
+	bool mirrorX;
+	bool mirrorY;
+};
+
+const Transform IDENTITY = {false, false, false};
+const Transform ROTATE_90 = {true, true, false};		// Clockwise
+const Transform ROTATE_180 = {false, true, true};
+const Transform ROTATE_270 = {true, false, true};
+const Transform FLIP_VERTICAL = {false, false, true};
+const Transform FLIP_HORIZONTAL = {false, true, false};
+const Transform FLIP_DIAGONAL_1 = {true, true, true};		// Across the top left to bottom right diagonal
+const Transform FLIP_DIAGONAL_2 = {true, false, false};		// Across the bottom left to top right diagonal
+
+void transform(Bitmap & b, Transform t);		// Apply a rotation or flip
+
+#endif
@@ -0,0 +1,205 @@
+#include "histogram.h"
+#include "threadpool.h"
+#include <cmath>
+
+// Private bins of one thread
+// Even and odd pixels count into separate copies, so a run of equal
+// values does not make every increment wait on the one before it
+struct alignas(64) Bins
+{
+	uint64_t counts[2][3][256];		// Copy, channel (red, green, blue), value
+};
+
+// Count kernel for one pixel format
+// INPUT: Takes the rows of a bitmap, its format and the bins to add to
+// OUTPUT: Does not return
+template <class Format>
+static void count_rows(PixelRows rows, Format format, Bins & bins)
+{
+	uint64_t (* even)[256] = bins.counts[0];
+	uint64_t (* odd)[256] = bins.counts[1];
+	int width = rows.width();
+
+	for (int y = 0; y < rows.height(); y++)
+	{
+		FormatRow<Format> row = {rows[y].pixels, format};
+		int x = 0;
+
+		for (; x + 1 < width; x += 2)
+		{
+			even[0][row.r(x)]++;
+			even[1][row.g(x)]++;
+			even[2][row.b(x)]++;
+			odd[0][row.r(x + 1)]++;
+			odd[1][row.g(x + 1)]++;
+			odd[2][row.b(x + 1)]++;
+		}
+
+		if (x < width)								// Odd width
+		{
+			even[0][row.r(x)]++;
+			even[1][row.g(x)]++;
+			even[2][row.b(x)]++;
+		}
+	}
+}
+
+// Count every channel of a bitmap
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Returns a Histogram
+Histogram histogram(Bitmap & b)
+{
+	PixelRows rows = b.rows();
+	int height = rows.height();
+	int slices = thread_count();
+	vector<Bins> bins(slices);							// Zeroed
+
+	thread_pool().run(slices, [&](int slice)					// One slice and one set of bins per thread
+	{
+		int first = (long long) height * slice / slices;
+		int last = (long long) height * (slice + 1) / slices;
+		PixelRows part = rows.band(first, last);
+
+		dispatch_format(b, [&](auto format) { count_rows(part, format, bins[slice]); });
+	});
+
+	Histogram h = {};
+	Counts * channels[3] = {&h.red, &h.green, &h.blue};
+
+	for (const Bins & slice : bins)							// Merge
+	{
+		for (int copy = 0; copy < 2; copy++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				for (int v = 0; v < 256; v++)
+				{
+					(*channels[c])[v] += slice.counts[copy][c][v];
+				}
+			}
+		}
+	}
+
+	h.pixels = (uint64_t) rows.width() * height;
+
+	return h;
+}
+
+// Histogram equalization
+// The red, green and blue counts are pooled into one distribution and a
+// single table maps each value to its share of the cumulative count,
+// stretched so the darkest value present becomes 0. One table for all
+// channels keeps hues from shifting the way per channel equalization does.
+// INPUT: Takes a histogram
+// OUTPUT: Returns the point ops applying the table
+PointOps equalization(const Histogram & h)
+{
+	uint64_t cumulative[256];
+	uint64_t running = 0;
+
+	for (int v = 0; v < 256; v++)
+	{
+		running += h.red[v] + h.green[v] + h.blue[v];
+		cumulative[v] = running;
+	}
+
+	uint64_t lowest = 0;								// Count up to the darkest value present
+
+	for (int v = 0; v < 256 && lowest == 0; v++)
+	{
+		lowest = cumulative[v];
+	}
+
+	Lut table;
+
+	for (int v = 0; v < 256; v++)
+	{
+		table[v] = running > lowest ? lround((double) (cumulative[v] > lowest ? cumulative[v] - lowest : 0)
+		                                     * 255.0 / (running - lowest)) : v;	// One value leaves nothing to spread
+	}
+
+	return PointOps().map(table, table, table);
+}
+
+// Table stretching one channel between its clipped extremes
+// INPUT: Takes the counts, the pixel total and the fraction to clip at each end
+// OUTPUT: Returns a Lut
+static Lut stretch_table(const Counts & counts, uint64_t pixels, double clip)
+{
+	uint64_t limit = (uint64_t) (clip * pixels);
+	uint64_t below = 0;
+	uint64_t above = 0;
+	int low = 0;
+	int high = 255;
+
+	while (low < 255 && below + counts[low] <= limit)				// Darkest value kept
+	{
+		below += counts[low++];
+	}
+
+	while (high > 0 && above + counts[high] <= limit)				// Brightest value kept
+	{
+		above += counts[high--];
+	}
+
+	Lut table;
+
+	for (int v = 0; v < 256; v++)
+	{
+		if (high <= low)							// Flat channel, leave it
+		{
+			table[v] = v;
+		}
+		else
+		{
+			double value = (v - low) * 255.0 / (high - low);
+			table[v] = value < 0.0 ? 0 : value > 255.0 ? 255 : lround(value);
+		}
+	}
+
+	return table;
+}
+
+// Auto levels
+// Each channel is stretched linearly so its darkest and brightest values,
+// ignoring a small fraction of outliers at either end, span 0 to 255
+// INPUT: Takes a histogram and the fraction of pixels to clip at each end
+// OUTPUT: Returns the point ops applying the tables
+PointOps auto_levels(const Histogram & h, double clip)
+{
+	clip = clip < 0.0 ? 0.0 : clip > 0.5 ? 0.5 : clip;
+
+	return PointOps().map(stretch_table(h.red, h.pixels, clip), stretch_table(h.green, h.pixels, clip),
+	                      stretch_table(h.blue, h.pixels, clip));
+}
+
+// Histogram equalization of a bitmap
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+void equalize(Bitmap & b)
+{
+	equalization(histogram(b)).apply(b);
+}
+
+// Auto levels of a bitmap
+// INPUT: Takes a reference to a bitmap object and the fraction to clip at each end
+// OUTPUT: Does not return
+void auto_level(Bitmap & b, double clip)
+{
+	auto_levels(histogram(b), clip).apply(b);
+}
+
+// Print the counts as CSV with a header line
+// INPUT: Takes a histogram and an output stream
+// OUTPUT: Does not return
+void print_histogram(const Histogram & h, ostream & out)
+{
+	out << "value,red,green,blue\n";
+
+	for (int v = 0; v < 256; v++)
+	{
+		out << v << "," << h.red[v] << "," << h.green[v] << "," << h.blue[v] << "\n";
+	}
+
+	out.flush();
+}
@@ -0,0 +1,34 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include "bitmap.h"
+#include "pointops.h"
+
+using Counts = array<uint64_t, 256>;		// Pixels with each value of one channel
+
+// Per channel counts of the component values of an image
+struct Histogram
+{
+	Counts red;
+	Counts green;
+	Counts blue;
+	uint64_t pixels;			// Pixels counted, the total of each channel
+};
+
+// Count every channel in one pass
+// Each thread of the pool counts a slice of rows into bins of its own,
+// which are added together at the end, so no counter is shared
+Histogram histogram(Bitmap & b);
+
+PointOps equalization(const Histogram &);		// One table spreading the combined channel counts evenly
+PointOps auto_levels(const Histogram &, double);	// Per channel stretch, clipping a fraction at each end
+
+void equalize(Bitmap & b);				// Equalize in a histogram pass and a table pass
+void auto_level(Bitmap & b, double clip = 0.005);	// Auto levels in a histogram pass and a table pass
+
+void print_histogram(const Histogram &, ostream &);	// Counts as CSV, one line per value
+
+#endif
@@ -0,0 +1,237 @@
+#include "integral.h"
+#include "threadpool.h"
+
+// Build the summed area table for a bitmap
+// Rows are prefix summed in parallel bands, then strips of columns are
+// accumulated down the table in parallel
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Constructs the table
+IntegralImage::IntegralImage(Bitmap & b) : _width(b.rows().width()), _height(b.rows().height()),
+                                           _sums((size_t) (_width + 1) * (_height + 1) * 3, 0)
+{
+	PixelRows rows = b.rows();
+	size_t entries = (size_t) (_width + 1) * 3;				// uint64_t values per table row
+
+	parallel_rows(_height, [&](const Band & band)				// Running sums along each row
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			PixelRow row = rows[y];
+			uint64_t * sums = &_sums[(size_t) (y + 1) * entries];
+			uint64_t red = 0;
+			uint64_t green = 0;
+			uint64_t blue = 0;
+
+			for (int x = 0; x < _width; x++)
+			{
+				red += row.r(x);
+				green += row.g(x);
+				blue += row.b(x);
+
+				sums[(x + 1) * 3] = red;
+				sums[(x + 1) * 3 + 1] = green;
+				sums[(x + 1) * 3 + 2] = blue;
+			}
+		}
+	});
+
+	parallel_rows((int) entries, [&](const Band & strip)			// Add each table row to the one below
+	{
+		for (int y = 1; y < _height; y++)
+		{
+			const uint64_t * above = &_sums[(size_t) y * entries];
+			uint64_t * sums = &_sums[(size_t) (y + 1) * entries];
+
+			for (int i = strip.first; i < strip.last; i++)
+			{
+				sums[i] += above[i];
+			}
+		}
+	}, 0, 64);
+}
+
+// Returns the width of the bitmap the table was built from
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int IntegralImage::get_width() const
+{
+	return _width;
+}
+
+// Returns the height of the bitmap the table was built from
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int IntegralImage::get_height() const
+{
+	return _height;
+}
+
+// Red, green and blue sums over the box [x0, x1) x [y0, y1)
+// INPUT: Takes the box corners and an array receiving three sums
+// OUTPUT: Does not return
+void IntegralImage::box_sum(int x0, int y0, int x1, int y1, uint64_t sums[3]) const
+{
+	size_t entries = (size_t) (_width + 1) * 3;
+	const uint64_t * top = &_sums[(size_t) y1 * entries];
+	const uint64_t * bottom = &_sums[(size_t) y0 * entries];
+
+	for (int c = 0; c < 3; c++)
+	{
+		sums[c] = top[x1 * 3 + c] - top[x0 * 3 + c] - bottom[x1 * 3 + c] + bottom[x0 * 3 + c];
+	}
+}
+
+// Pixelate
+// Averages the pixel component values across square blocks of pixels;
+// blocks cut off by the right and top edges are averaged over what is left
+// INPUT: Takes a reference to a bitmap object and the block size
+// OUTPUT: Does not return
+void pixelate(Bitmap & b, int block)
+{
+	if (block < 1)
+	{
+		return;
+	}
+
+	IntegralImage sums(b);
+	PixelRows rows = b.rows();
+	int height = rows.height();
+	int width = rows.width();
+
+	parallel_rows(height, [&](const Band & band)					// Bands hold whole rows of blocks
+	{
+		int top;
+
+		for (int y = band.first; y < band.last; y = top)			// Traverse all blocks of pixels
+		{
+			top = block < height - y ? y + block : height;			// Clipped without overflowing
+			int right;
+
+			for (int x = 0; x < width; x = right)
+			{
+				right = block < width - x ? x + block : width;
+				uint64_t area = (uint64_t) (right - x) * (top - y);
+				uint64_t total[3];
+
+				sums.box_sum(x, y, right, top, total);			// Sum of the block in O(1)
+
+				uint8_t redAverage = total[0] / area;			// Calculate averages
+				uint8_t greenAverage = total[1] / area;
+				uint8_t blueAverage = total[2] / area;
+
+				for (int i = y; i < top; i++)				// Traverse block
+				{
+					PixelRow row = rows[i];
+
+					for (int j = x; j < right; j++)
+					{
+						row.r(j) = redAverage;			// Set component values
+						row.g(j) = greenAverage;
+						row.b(j) = blueAverage;
+					}
+				}
+			}
+		}
+	}, 0, block);
+}
+
+// Box blur
+// Averages every pixel over the (2r + 1) x (2r + 1) box around it using
+// running sums: a horizontal window slides along each row, then column
+// sums slide down the image a whole row at a time, so the cost per pixel
+// does not depend on the radius. Edges are clamped; alpha is left as it is.
+// INPUT: Takes a reference to a bitmap object and the radius
+// OUTPUT: Does not return
+void box_blur(Bitmap & b, int radius)
+{
+	PixelRows rows = b.rows();
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+	int bytes = width * step;
+	RuntimeFormat layout = b.get_layout();
+	int alpha = step == 4 ? 6 - layout.red - layout.green - layout.blue : -1;
+
+	if (radius < 1 || width == 0 || height == 0)
+	{
+		return;
+	}
+
+	vector<uint32_t> horizontal((size_t) bytes * height);				// Row window sums
+	int last = width - 1;
+
+	parallel_rows(height, [&](const Band & band)					// Horizontal running sums
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			const uint8_t * p = rows[y].pixels;
+			uint32_t * out = &horizontal[(size_t) y * bytes];
+
+			for (int c = 0; c < step; c++)
+			{
+				uint32_t sum = 0;
+
+				for (int k = -radius; k <= radius; k++)			// Window around x = 0
+				{
+					int x = k < 0 ? 0 : k > last ? last : k;
+					sum += p[x * step + c];
+				}
+
+				for (int x = 0; x < width; x++)
+				{
+					out[x * step + c] = sum;
+
+					int enter = x + radius + 1 > last ? last : x + radius + 1;	// Slide the window right
+					int leave = x - radius < 0 ? 0 : x - radius;
+					sum += p[enter * step + c] - p[leave * step + c];
+				}
+			}
+		}
+	});
+
+	uint64_t area = (uint64_t) (2 * radius + 1) * (2 * radius + 1);
+	uint64_t reciprocal = ((uint64_t) 1 << 32) / area;				// Division by multiplication
+
+	parallel_rows(height, [&](const Band & band)					// Vertical running sums per band
+	{
+		vector<uint32_t> column(bytes, 0);
+		vector<uint8_t> saved(width);
+
+		for (int k = -radius; k <= radius; k++)					// Column window around the band's first row
+		{
+			int y = band.first + k;
+			y = y < band.top ? band.top : y >= band.bottom ? band.bottom - 1 : y;	// Halo clamped to the image
+			const uint32_t * in = &horizontal[(size_t) y * bytes];
+
+			for (int i = 0; i < bytes; i++)
+			{
+				column[i] += in[i];
+			}
+		}
+
+		for (int y = band.first; y < band.last; y++)				// Slide down a row at a time
+		{
+			uint8_t * out = rows[y].pixels;
+			int enter = y + radius + 1 >= height ? height - 1 : y + radius + 1;
+			int leave = y - radius < 0 ? 0 : y - radius;
+			const uint32_t * in = &horizontal[(size_t) enter * bytes];
+			const uint32_t * out_of = &horizontal[(size_t) leave * bytes];
+
+			for (int x = 0; alpha >= 0 && x < width; x++)
+			{
+				saved[x] = out[x * step + alpha];
+			}
+
+			for (int i = 0; i < bytes; i++)
+			{
+				out[i] = (column[i] * reciprocal + ((uint64_t) 1 << 31)) >> 32;
+				column[i] += in[i] - out_of[i];
+			}
+
+			for (int x = 0; alpha >= 0 && x < width; x++)
+			{
+				out[x * step + alpha] = saved[x];
+			}
+		}
+	}, radius);
+}
@@ -0,0 +1,30 @@
+#ifndef INTEGRAL_H
+#define INTEGRAL_H
+
+#include <cstdint>
+#include <vector>
+#include "bitmap.h"
+
+// Summed area table of the red, green and blue channels of a bitmap
+// Entry (x, y) holds the sums over all pixels left of x and below y.
+// Sums are kept in 64 bits, so they cannot wrap on any image a bitmap
+// can hold and a box sum is exact whatever the size of the box.
+class IntegralImage
+{
+	private:
+
+		int _width;				// Width of the bitmap in pixels
+		int _height;				// Height of the bitmap in pixels
+		vector<uint64_t> _sums;			// (width + 1) x (height + 1) entries of three sums
+
+	public:
+
+		IntegralImage(Bitmap &);		// Build the table for a bitmap
+
+		int get_width() const;			// Width of the bitmap
+		int get_height() const;			// Height of the bitmap
+
+		void box_sum(int, int, int, int, uint64_t[3]) const;	// Channel sums over [x0, x1) x [y0, y1)
+};
+
+#endif
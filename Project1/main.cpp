@@ -1,20 +1,119 @@
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
 #include <string>
+#include "batch.h"
 #include "bitmap.h"
+#include "bufferpool.h"
+#include "histogram.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "stream.h"
+#include "threadpool.h"
 
 int main(int argc, char** argv)
 {
-    if(argc != 4)
+    bool mapOutput = false;
+    bool batch = false;
+    bool profile = false;
+    bool json = false;
+    bool counts = false;
+    size_t streamBudget = 0;
+    int first = 1;
+
+    for(; first < argc && string(argv[first]).compare(0, 2, "--") == 0; first++)
+    {
+        string mode(argv[first]);
+
+        if(mode == "--map-output"s)
+        {
+            mapOutput = true;
+        }
+        else if(mode == "--huge-pages"s)
+        {
+            buffer_pool().set_huge_pages(true);
+        }
+        else if(mode == "--rgba"s)
+        {
+            set_normalize_on_load(true);
+        }
+        else if(mode == "--histogram"s)
+        {
+            counts = true;
+        }
+        else if(mode == "--rle"s)
+        {
+            set_rle_output(true);
+        }
+        else if(mode == "--batch"s)
+        {
+            batch = true;
+        }
+        else if(mode == "--profile"s || mode == "--profile=json"s)
+        {
+            profile = true;
+            json = mode == "--profile=json"s;
+        }
+        else if(mode.compare(0, 9, "--stream=") == 0)
+        {
+            streamBudget = (size_t) atol(mode.c_str() + 9) << 20;
+        }
+        else
+        {
+            cout << "Error: unknown mode " << mode << endl;
+            return 0;
+        }
+    }
+
+    if(argc - first < 3)
     {
         cout << "usage:\n"
-             << "bitmap option inputfile.bmp outputfile.bmp\n"
+             << "bitmap [--map-output | --stream=MB | --rle] [--huge-pages] [--rgba] [--histogram] [--profile[=json]] option... inputfile.bmp outputfile.bmp\n"
+             << "bitmap --batch [--huge-pages] [--rgba] [--rle] [--profile[=json]] option... (directory | manifest.txt) outputdirectory\n"
+             << "  --profile print the time and bytes of every read, filter and write step\n"
+             << "  --profile=json print the same breakdown as JSON\n"
+             << "  --map-output filter in place inside a mapping of the output file\n"
+             << "  --stream=MB filter in row bands using at most MB megabytes of pixels\n"
+             << "  --batch filter every .bmp in a directory or listed in a manifest, overlapping\n"
+             << "          reads, filtering and writes, and report throughput\n"
+             << "  --huge-pages back large pixel buffers with transparent huge pages\n"
+             << "  --rgba filter in unpadded 32 bit BGRA, converting on load and save\n"
+             << "  --histogram print the per channel counts of the result as CSV, not with\n"
+             << "              --stream or --batch\n"
+             << "  --rle save as 8 bit RLE when the result has at most 256 colors and shrinks,\n"
+             << "        not with --stream\n"
+             << "  options run left to right on one decoded image\n"
+             << "  -j N run filters on N threads (default: every core)\n"
              << "options:\n"
              << "  -i identity\n"
              << "  -c cell shade\n"
+             << "  -c=bayer cell shade with 8x8 ordered dithering\n"
+             << "  -c=floyd cell shade with Floyd-Steinberg error diffusion\n"
              << "  -g gray scale\n"
+             << "  -g601 gray scale with Rec. 601 luma weights\n"
+             << "  -g709 gray scale with Rec. 709 luma weights\n"
+             << "  -invert negate\n"
+             << "  -posterize=N reduce to N levels per channel\n"
+             << "  -brightness=N add N to every component\n"
+             << "  -contrast=F scale components around mid gray\n"
+             << "  -gamma=G gamma correct\n"
              << "  -p pixelate\n"
+             << "  -pixelate=N pixelate with N pixel blocks\n"
              << "  -b blur\n"
+             << "  -gauss=S gaussian blur with sigma S\n"
+             << "  -rgauss=S recursive gaussian blur with sigma S, as fast for any S\n"
+             << "  -box=R box blur with radius R\n"
+             << "  -median=R median of the window of radius R, denoises (R at most 127)\n"
+             << "  -erode=R minimum of the window of radius R\n"
+             << "  -dilate=R maximum of the window of radius R\n"
+             << "  -open=R erode then dilate\n"
+             << "  -close=R dilate then erode\n"
+             << "  -sharpen sharpen\n"
+             << "  -emboss emboss\n"
+             << "  -sobelx horizontal Sobel gradient around mid gray\n"
+             << "  -sobely vertical Sobel gradient around mid gray\n"
+             << "  -kernel=W,W,...[/D] convolve with an odd square kernel, rows from the top,\n"
+             << "          divided by D, a power of two\n"
              << "  -r90 rotate 90\n"
              << "  -r180 rotate 180\n"
              << "  -r270 rotate 270\n"
@@ -23,81 +122,97 @@ int main(int argc, char** argv)
              << "  -d1 flip diagonally 1\n"
              << "  -d2 flip diagonally 2\n"
              << "  -grow scale the image by 2\n"
-             << "  -shrink scale the image by .5" << endl;
+             << "  -shrink scale the image by .5\n"
+             << "  -resize=WxH bilinear resize to W by H\n"
+             << "  -lanczos=WxH lanczos resize to W by H\n"
+             << "  -equalize histogram equalization\n"
+             << "  -autolevels[=P] stretch each channel, clipping P percent at each end (default .5)" << endl;
 
         return 0;
     }
 
-    try
+    if(streamBudget > 0 && !batch && (rle_output() || counts))
     {
-        string flag(argv[1]);
-        string infile(argv[2]);
-        string outfile(argv[3]);
+        cout << "Error: --rle and --histogram cannot run in streaming mode" << endl;
+        return 0;
+    }
 
-        ifstream in;
-        Bitmap image;
-        ofstream out;
+    if(batch && counts)
+    {
+        cout << "Error: --histogram cannot run in batch mode" << endl;
+        return 0;
+    }
 
-        in.open(infile, ios::binary);
-        in >> image;
-        in.close();
+    try
+    {
+        Pipeline pipeline;
+        string infile(argv[argc - 2]);
+        string outfile(argv[argc - 1]);
 
-        if(flag == "-c"s)
-        {
-            cellShade(image);
-        }
-        if(flag == "-g"s)
-        {
-            grayscale(image);
-        }
-        if(flag == "-p"s)
-        {
-            pixelate(image);
-        }
-        if(flag == "-b"s)
-        {
-            blur(image);
-        }
-        if(flag == "-r90"s)
-        {
-            //rot90(image);
-        }
-        if(flag == "-r180"s)
-        {
-            //rot180(image);
-        }
-        if(flag == "-r270"s)
+        for(int i = first; i < argc - 2; i++)
         {
-            //rot270(image);
+            if(string(argv[i]) == "-j"s && i + 1 < argc - 2)
+            {
+                set_thread_count(atoi(argv[++i]));
+            }
+            else if(!pipeline.add(argv[i]))
+            {
+                cout << "Error: unknown option " << argv[i] << endl;
+                return 0;
+            }
         }
-        if(flag == "-v"s)
+
+        pipeline.fuse();
+
+        if(profile)
         {
-            //flipv(image);
+            profiler().enable();
         }
-        if(flag == "-h"s)
+
+        if(batch)
         {
-            //fliph(image);
+            run_batch(infile, outfile, pipeline);
         }
-        if(flag == "-d1"s)
+        else if(streamBudget > 0)
         {
-            //flipd1(image);
+            stream_file(infile, outfile, pipeline, streamBudget);
         }
-        if(flag == "-d2"s)
+        else
         {
-            //flipd2(image);
+            Bitmap image;
+
+            if(!image.load(infile))
+            {
+                cout << "Error: could not read " << infile << endl;
+                return 0;
+            }
+
+            if(mapOutput)
+            {
+                image.map_output(outfile);
+            }
+
+            pipeline.run(image);
+
+            if(counts)
+            {
+                print_histogram(histogram(image), cout);
+            }
+
+            if(!image.save(outfile))
+            {
+                cout << "Error: could not write " << outfile << endl;
+            }
         }
-        if(flag == "-grow"s)
+
+        if(profile && json)
         {
-            //scaleUp(image);
+            profiler().report_json(cout);
         }
-        if(flag == "-shrink"s)
+        else if(profile)
         {
-            //scaleDown(image);
+            profiler().report(cout);
         }
-
-        out.open(outfile, ios::binary);
-        out << image;
-        out.close();
     }
     catch(...)
     {
@@ -0,0 +1,549 @@
+#include "pipeline.h"
+#include "convolve.h"
+#include "dither.h"
+#include "histogram.h"
+#include "profile.h"
+#include "rank.h"
+#include "resample.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// Make a stage holding point ops
+// INPUT: Takes the option name and the ops
+// OUTPUT: Returns a Stage
+static Stage point_stage(const string & name, const PointOps & ops)
+{
+	Stage stage = {STAGE_POINT, name, ops, IDENTITY, nullptr, 0, 1, true, true, false};
+	return stage;
+}
+
+// Make a stage holding a rotation or flip
+// INPUT: Takes the option name and the transform
+// OUTPUT: Returns a Stage
+static Stage transform_stage(const string & name, Transform t)
+{
+	Stage stage = {STAGE_TRANSFORM, name, PointOps(), t, nullptr, 0, 1, false, false, false};
+	return stage;
+}
+
+// Make a stage running a neighborhood filter
+// INPUT: Takes the option name, the filter, its halo, its row alignment
+// and whether it commutes with flips and with transposes
+// OUTPUT: Returns a Stage
+static Stage neighborhood_stage(const string & name, function<void(Bitmap &)> run, int halo, int alignment,
+                                bool symmetric, bool isotropic)
+{
+	Stage stage = {STAGE_NEIGHBORHOOD, name, PointOps(), IDENTITY, run, halo, alignment, symmetric, isotropic, false};
+	return stage;
+}
+
+// Make a stage that needs the whole image at once
+// Histograms do not change under rotations and flips, so those move past
+// it; filters whose result depends on direction are not symmetric
+// INPUT: Takes the option name, the filter and whether it is symmetric
+// OUTPUT: Returns a Stage
+static Stage global_stage(const string & name, function<void(Bitmap &)> run, bool symmetric = true)
+{
+	Stage stage = {STAGE_GLOBAL, name, PointOps(), IDENTITY, run, 0, 1, symmetric, symmetric, false};
+	return stage;
+}
+
+// Make a stage that changes the image size
+// INPUT: Takes the option name, the filter and whether it replicates pixels
+// OUTPUT: Returns a Stage
+static Stage resize_stage(const string & name, function<void(Bitmap &)> run, bool replicates)
+{
+	Stage stage = {STAGE_RESIZE, name, PointOps(), IDENTITY, run, 0, 1, replicates, replicates, replicates};
+	return stage;
+}
+
+// Source coordinates a transform reads for an output pixel
+// INPUT: Takes the transform, the input size and the output pixel
+// OUTPUT: Updates x and y to the source pixel
+static void source_of(Transform t, int width, int height, int & x, int & y)
+{
+	int u = t.transpose ? y : x;
+	int v = t.transpose ? x : y;
+
+	x = t.mirrorX ? width - 1 - u : u;
+	y = t.mirrorY ? height - 1 - v : v;
+}
+
+// Returns the transform equal to applying first and then second
+// Found by tracing every pixel of a small non square image through both
+// INPUT: Takes two transforms
+// OUTPUT: Returns a Transform
+Transform compose(Transform first, Transform second)
+{
+	const int width = 2;
+	const int height = 3;
+	int middleWidth = first.transpose ? height : width;
+	int middleHeight = first.transpose ? width : height;
+	int outWidth = second.transpose ? middleHeight : middleWidth;
+	int outHeight = second.transpose ? middleWidth : middleHeight;
+
+	for (int candidate = 0; candidate < 8; candidate++)
+	{
+		Transform t = {(candidate & 4) != 0, (candidate & 2) != 0, (candidate & 1) != 0};
+		bool same = true;
+
+		for (int y = 0; y < outHeight && same; y++)
+		{
+			for (int x = 0; x < outWidth && same; x++)
+			{
+				int ax = x, ay = y;					// Through both transforms
+				source_of(second, middleWidth, middleHeight, ax, ay);
+				source_of(first, width, height, ax, ay);
+
+				int bx = x, by = y;					// Through the candidate
+				source_of(t, width, height, bx, by);
+
+				same = ax == bx && ay == by;
+			}
+		}
+
+		if (same)
+		{
+			return t;
+		}
+	}
+
+	return IDENTITY;
+}
+
+// Parse the number after an '=' in an option
+// INPUT: Takes the option and the prefix before the number
+// OUTPUT: Returns the number
+static double option_value(const string & option, const string & prefix)
+{
+	return atof(option.c_str() + prefix.size());
+}
+
+// Parse a WxH size after an '=' in an option
+// INPUT: Takes the option, the prefix and the width and height to fill
+// OUTPUT: Returns false if the size is malformed
+static bool option_size(const string & option, const string & prefix, int & width, int & height)
+{
+	return sscanf(option.c_str() + prefix.size(), "%dx%d", &width, &height) == 2 && width > 0 && height > 0;
+}
+
+// Parse a kernel after an '=' in an option: comma separated weights, row
+// by row from the top, then optionally /D with D a power of two divisor
+// INPUT: Takes the option, the prefix and the kernel to fill
+// OUTPUT: Returns false if the kernel is malformed
+static bool option_kernel(const string & option, const string & prefix, Kernel & kernel)
+{
+	const char * p = option.c_str() + prefix.size();
+	char * end = nullptr;
+
+	kernel.weights.clear();
+	kernel.shift = 0;
+	kernel.offset = 0;
+
+	do
+	{
+		kernel.weights.push_back((int) strtol(p, &end, 10));
+
+		if (end == p)
+		{
+			return false;
+		}
+
+		p = end;
+	}
+	while (*p++ == ',');
+
+	if (p[-1] == '/')
+	{
+		long divisor = strtol(p, &end, 10);
+
+		if (end == p || *end != '\0' || divisor < 1 || (divisor & (divisor - 1)) != 0)
+		{
+			return false;
+		}
+
+		while ((1L << kernel.shift) < divisor)
+		{
+			kernel.shift++;
+		}
+	}
+	else if (p[-1] != '\0')
+	{
+		return false;
+	}
+
+	kernel.size = (int) lround(sqrt((double) kernel.weights.size()));
+
+	return kernel.size % 2 == 1 && (size_t) kernel.size * kernel.size == kernel.weights.size();
+}
+
+// Make a convolution stage, which may move past rotations and flips that
+// leave its kernel unchanged
+// INPUT: Takes the option name, the filter and its kernel
+// OUTPUT: Returns a Stage
+static Stage kernel_stage(const string & name, function<void(Bitmap &)> run, const Kernel & kernel)
+{
+	return neighborhood_stage(name, run, kernel.size / 2, 1, kernel_symmetric(kernel), kernel_isotropic(kernel));
+}
+
+// Returns true if an option starts with a prefix
+// INPUT: Takes the option and the prefix
+// OUTPUT: Returns a boolean
+static bool starts_with(const string & option, const string & prefix)
+{
+	return option.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Add the stage for a command line option
+// INPUT: Takes the option
+// OUTPUT: Returns false if the option is not recognized
+bool Pipeline::add(const string & option)
+{
+	int width = 0;
+	int height = 0;
+	Kernel kernel;
+
+	if (option == "-i")								// Identity
+	{
+		return true;
+	}
+	else if (option == "-c")
+	{
+		add(point_stage(option, PointOps().cell_shade()));
+	}
+	else if (option == "-c=bayer")
+	{
+		add(neighborhood_stage(option, [](Bitmap & b) { cellShade(b, DITHER_ORDERED); }, 0, 8, false, false));	// Bands start on whole tiles of the pattern
+	}
+	else if (option == "-c=floyd")
+	{
+		add(global_stage(option, [](Bitmap & b) { cellShade(b, DITHER_FLOYD_STEINBERG); }, false));
+	}
+	else if (option == "-g")
+	{
+		add(point_stage(option, PointOps().gray()));
+	}
+	else if (option == "-g601")
+	{
+		add(point_stage(option, PointOps().gray(GRAY_BT601)));
+	}
+	else if (option == "-g709")
+	{
+		add(point_stage(option, PointOps().gray(GRAY_BT709)));
+	}
+	else if (option == "-invert")
+	{
+		add(point_stage(option, PointOps().invert()));
+	}
+	else if (starts_with(option, "-posterize="))
+	{
+		add(point_stage(option, PointOps().posterize((int) option_value(option, "-posterize="))));
+	}
+	else if (starts_with(option, "-brightness="))
+	{
+		add(point_stage(option, PointOps().brightness((int) option_value(option, "-brightness="))));
+	}
+	else if (starts_with(option, "-contrast="))
+	{
+		add(point_stage(option, PointOps().contrast(option_value(option, "-contrast="))));
+	}
+	else if (starts_with(option, "-gamma="))
+	{
+		add(point_stage(option, PointOps().gamma(option_value(option, "-gamma="))));
+	}
+	else if (option == "-equalize")
+	{
+		add(global_stage(option, [](Bitmap & b) { equalize(b); }));
+	}
+	else if (option == "-autolevels" || starts_with(option, "-autolevels="))
+	{
+		double clip = option == "-autolevels" ? 0.005 : option_value(option, "-autolevels=") / 100.0;
+		add(global_stage(option, [clip](Bitmap & b) { auto_level(b, clip); }));
+	}
+	else if (option == "-p" || starts_with(option, "-pixelate="))
+	{
+		int block = option == "-p" ? 16 : (int) option_value(option, "-pixelate=");
+		block = block < 1 ? 1 : block;
+		add(neighborhood_stage(option, [block](Bitmap & b) { pixelate(b, block); }, block - 1, block, false, false));	// A block reaches block - 1 rows away
+	}
+	else if (option == "-b")
+	{
+		add(kernel_stage(option, [](Bitmap & b) { blur(b); }, kernel_of<Gaussian5>()));
+	}
+	else if (option == "-sharpen")
+	{
+		add(kernel_stage(option, [](Bitmap & b) { convolve<Sharpen3>(b); }, kernel_of<Sharpen3>()));
+	}
+	else if (option == "-emboss")
+	{
+		add(kernel_stage(option, [](Bitmap & b) { convolve<Emboss3>(b); }, kernel_of<Emboss3>()));
+	}
+	else if (option == "-sobelx")
+	{
+		add(kernel_stage(option, [](Bitmap & b) { convolve<SobelX3>(b); }, kernel_of<SobelX3>()));
+	}
+	else if (option == "-sobely")
+	{
+		add(kernel_stage(option, [](Bitmap & b) { convolve<SobelY3>(b); }, kernel_of<SobelY3>()));
+	}
+	else if (starts_with(option, "-kernel=") && option_kernel(option, "-kernel=", kernel))
+	{
+		add(kernel_stage(option, [kernel](Bitmap & b) { convolve(b, kernel); }, kernel));
+	}
+	else if (starts_with(option, "-gauss="))
+	{
+		double sigma = option_value(option, "-gauss=");
+		add(neighborhood_stage(option, [sigma](Bitmap & b) { gaussian_blur(b, sigma); }, (int) ceil(3.0 * sigma), 1, true, false));
+	}
+	else if (starts_with(option, "-rgauss="))
+	{
+		double sigma = option_value(option, "-rgauss=");
+		add(global_stage(option, [sigma](Bitmap & b) { recursive_gaussian_blur(b, sigma); }, false));	// Feedback runs the whole column, float rounding depends on direction
+	}
+	else if (starts_with(option, "-box="))
+	{
+		int radius = (int) option_value(option, "-box=");
+		add(neighborhood_stage(option, [radius](Bitmap & b) { box_blur(b, radius); }, radius, 1, true, true));
+	}
+	else if (starts_with(option, "-median="))
+	{
+		int radius = (int) option_value(option, "-median=");
+		add(neighborhood_stage(option, [radius](Bitmap & b) { median_filter(b, radius); }, radius, 1, true, true));
+	}
+	else if (starts_with(option, "-erode="))
+	{
+		int radius = (int) option_value(option, "-erode=");
+		add(neighborhood_stage(option, [radius](Bitmap & b) { erode(b, radius); }, radius, 1, true, true));
+	}
+	else if (starts_with(option, "-dilate="))
+	{
+		int radius = (int) option_value(option, "-dilate=");
+		add(neighborhood_stage(option, [radius](Bitmap & b) { dilate(b, radius); }, radius, 1, true, true));
+	}
+	else if (starts_with(option, "-open="))						// Erode then dilate
+	{
+		int radius = (int) option_value(option, "-open=");
+		add(neighborhood_stage(option, [radius](Bitmap & b) { erode(b, radius); }, radius, 1, true, true));
+		add(neighborhood_stage(option, [radius](Bitmap & b) { dilate(b, radius); }, radius, 1, true, true));
+	}
+	else if (starts_with(option, "-close="))					// Dilate then erode
+	{
+		int radius = (int) option_value(option, "-close=");
+		add(neighborhood_stage(option, [radius](Bitmap & b) { dilate(b, radius); }, radius, 1, true, true));
+		add(neighborhood_stage(option, [radius](Bitmap & b) { erode(b, radius); }, radius, 1, true, true));
+	}
+	else if (option == "-r90")
+	{
+		add(transform_stage(option, ROTATE_90));
+	}
+	else if (option == "-r180")
+	{
+		add(transform_stage(option, ROTATE_180));
+	}
+	else if (option == "-r270")
+	{
+		add(transform_stage(option, ROTATE_270));
+	}
+	else if (option == "-v")
+	{
+		add(transform_stage(option, FLIP_VERTICAL));
+	}
+	else if (option == "-h")
+	{
+		add(transform_stage(option, FLIP_HORIZONTAL));
+	}
+	else if (option == "-d1")
+	{
+		add(transform_stage(option, FLIP_DIAGONAL_1));
+	}
+	else if (option == "-d2")
+	{
+		add(transform_stage(option, FLIP_DIAGONAL_2));
+	}
+	else if (option == "-grow")
+	{
+		add(resize_stage(option, [](Bitmap & b) { scaleUp(b); }, true));
+	}
+	else if (option == "-shrink")
+	{
+		add(resize_stage(option, [](Bitmap & b) { scaleDown(b); }, false));
+	}
+	else if (starts_with(option, "-resize=") && option_size(option, "-resize=", width, height))
+	{
+		add(resize_stage(option, [width, height](Bitmap & b) { resample(b, width, height, RESAMPLE_BILINEAR); }, false));
+	}
+	else if (starts_with(option, "-lanczos=") && option_size(option, "-lanczos=", width, height))
+	{
+		add(resize_stage(option, [width, height](Bitmap & b) { resample(b, width, height, RESAMPLE_LANCZOS); }, false));
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+// Add a stage
+// INPUT: Takes a stage
+// OUTPUT: Does not return
+void Pipeline::add(const Stage & stage)
+{
+	_stages.push_back(stage);
+}
+
+// Reorder and merge stages
+// Only swaps that cannot change the output are made: point ops commute
+// with rotations, flips and pixel replication, and rotations and flips
+// commute with replication, with histogram based ops and with
+// neighborhood ops that treat both
+// directions alike (the separable blurs round between their passes, so
+// they only commute with transforms that do not transpose)
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+void Pipeline::fuse()
+{
+	bool changed = true;
+
+	while (changed)									// Bubble point ops forward, transforms back
+	{
+		changed = false;
+
+		for (size_t i = 0; i + 1 < _stages.size(); i++)
+		{
+			Stage & a = _stages[i];
+			Stage & b = _stages[i + 1];
+			bool commutes = b.symmetric && (b.isotropic || !a.transform.transpose);
+			bool transformBack = a.kind == STAGE_TRANSFORM && b.kind != STAGE_TRANSFORM && commutes;
+			bool pointForward = b.kind == STAGE_POINT && a.kind == STAGE_RESIZE && a.replicates;
+
+			if (transformBack || pointForward)
+			{
+				swap(a, b);
+				changed = true;
+			}
+		}
+	}
+
+	vector<Stage> fused;
+
+	for (const Stage & stage : _stages)						// Merge neighbours
+	{
+		Stage * last = fused.empty() ? nullptr : &fused.back();
+
+		if (last != nullptr && last->kind == STAGE_POINT && stage.kind == STAGE_POINT)
+		{
+			last->point.then(stage.point);
+			last->name += " " + stage.name;
+		}
+		else if (last != nullptr && last->kind == STAGE_TRANSFORM && stage.kind == STAGE_TRANSFORM)
+		{
+			last->transform = compose(last->transform, stage.transform);
+			last->name += " " + stage.name;
+		}
+		else
+		{
+			fused.push_back(stage);
+		}
+
+		Stage & back = fused.back();
+
+		if (back.kind == STAGE_TRANSFORM && !back.transform.transpose && !back.transform.mirrorX && !back.transform.mirrorY)
+		{
+			fused.pop_back();						// Rotations and flips that cancel out
+		}
+	}
+
+	_stages = fused;
+}
+
+// Run every stage on an image
+// Each stage is profiled under its option name; the bytes it touches
+// are its input pixels read plus its output pixels written
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+void Pipeline::run(Bitmap & b) const
+{
+	for (const Stage & stage : _stages)
+	{
+		size_t input = (size_t) b.get_stride() * abs(b.get_height());
+		ProfileScope scope(stage.name.c_str());
+
+		switch (stage.kind)
+		{
+			case STAGE_POINT:	stage.point.apply(b); break;
+			case STAGE_TRANSFORM:	transform(b, stage.transform); break;
+			default:		stage.run(b); break;
+		}
+
+		scope.set_bytes(input + (size_t) b.get_stride() * abs(b.get_height()));
+	}
+}
+
+// Returns the stages in run order
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a vector of stages
+const vector<Stage> & Pipeline::stages() const
+{
+	return _stages;
+}
+
+// Returns true if every stage can run on row bands of the image
+// Rotations, vertical flips, resizes and whole image statistics need the whole image at once
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool Pipeline::streamable() const
+{
+	for (const Stage & stage : _stages)
+	{
+		bool rowLocal = stage.kind == STAGE_TRANSFORM && !stage.transform.transpose && !stage.transform.mirrorY;
+
+		if (stage.kind != STAGE_POINT && stage.kind != STAGE_NEIGHBORHOOD && !rowLocal)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Context rows the whole chain needs around each output row
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int Pipeline::halo() const
+{
+	int total = 0;
+
+	for (const Stage & stage : _stages)
+	{
+		total += stage.halo;
+	}
+
+	return total;
+}
+
+// Row alignment the whole chain needs for bands
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int Pipeline::alignment() const
+{
+	int result = 1;
+
+	for (const Stage & stage : _stages)
+	{
+		int a = result;								// Least common multiple
+		int b = stage.alignment;
+
+		while (b != 0)
+		{
+			int t = a % b;
+			a = b;
+			b = t;
+		}
+
+		result = result / a * stage.alignment;
+	}
+
+	return result;
+}
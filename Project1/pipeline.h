@@ -0,0 +1,64 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "bitmap.h"
+#include "geometry.h"
+#include "pointops.h"
+
+// What a stage does to the image, which decides how it may be fused
+enum StageKind
+{
+	STAGE_POINT,				// Per pixel lookup tables
+	STAGE_TRANSFORM,			// Rotation or flip
+	STAGE_NEIGHBORHOOD,			// Reads the pixels around each pixel
+	STAGE_GLOBAL,				// Needs the whole image: statistics, error diffusion or recursive filters
+	STAGE_RESIZE				// Changes the pixel count
+};
+
+// One step of a pipeline
+struct Stage
+{
+	StageKind kind;
+	string name;				// Options the stage came from
+	PointOps point;				// STAGE_POINT ops
+	Transform transform;			// STAGE_TRANSFORM rotation or flip
+	function<void(Bitmap &)> run;		// STAGE_NEIGHBORHOOD, STAGE_GLOBAL and STAGE_RESIZE body
+	int halo;				// Rows of context needed above and below each row
+	int alignment;				// Row bands must start on multiples of this
+	bool symmetric;				// Gives the same result if the image is flipped first
+	bool isotropic;				// Gives the same result if the image is transposed first
+	bool replicates;			// Pixel replication, so point ops give the same result before it
+};
+
+// Ordered chain of operations run on one decoded image
+// fuse() reorders stages where that cannot change the result and merges
+// neighbours: point ops move ahead of rotations, flips and pixel
+// replication and fold into one table pass; rotations and flips move
+// behind point ops, replication and neighborhood ops that treat every
+// direction alike, then compose into a single transform, which
+// disappears if it is the identity
+class Pipeline
+{
+	private:
+
+		vector<Stage> _stages;			// Stages in run order
+
+	public:
+
+		bool add(const string &);		// Add the stage for a command line option
+		void add(const Stage &);		// Add a stage
+		void fuse();				// Reorder and merge stages
+		void run(Bitmap &) const;		// Run every stage on an image
+
+		const vector<Stage> & stages() const;	// Stages in run order
+		bool streamable() const;		// True if the chain can run band by band
+		int halo() const;			// Context rows the whole chain needs
+		int alignment() const;			// Band alignment the whole chain needs
+};
+
+Transform compose(Transform first, Transform second);	// Transform equal to first then second
+
+#endif
@@ -0,0 +1,274 @@
+#include "pixelbuffer.h"
+#include "bufferpool.h"
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+
+PixelStorage::PixelStorage() : block(nullptr), capacity(0), mapBase(nullptr), mapLength(0), shared(false), mapDevice(0), mapInode(0)
+{
+}
+
+PixelStorage::~PixelStorage()
+{
+	if (mapBase != nullptr)
+	{
+		munmap(mapBase, mapLength);
+	}
+
+	buffer_pool().release(block, capacity);
+}
+
+PixelBuffer::PixelBuffer() : _begin(nullptr), _size(0)					// Default constructor
+{
+}
+
+PixelBuffer::PixelBuffer(const PixelBuffer & p) : _begin(nullptr), _size(0)		// Copy constructor
+{
+	*this = p;
+}
+
+PixelBuffer::PixelBuffer(PixelBuffer && p) : _storage(std::move(p._storage)), _begin(p._begin), _size(p._size)	// Move constructor
+{
+	p._begin = nullptr;
+	p._size = 0;
+}
+
+PixelBuffer & PixelBuffer::operator=(const PixelBuffer & p)				// Copy assignment
+{
+	if (this != &p)
+	{
+		allocate(p._size);
+		memcpy(_begin, p._begin, p._size);
+	}
+
+	return *this;
+}
+
+PixelBuffer & PixelBuffer::operator=(PixelBuffer && p)					// Move assignment
+{
+	if (this != &p)
+	{
+		_storage = std::move(p._storage);
+		_begin = p._begin;
+		_size = p._size;
+
+		p._begin = nullptr;
+		p._size = 0;
+	}
+
+	return *this;
+}
+
+PixelBuffer::~PixelBuffer()								// Destructor
+{
+}
+
+// Copy on write view of the same pixel bytes
+// Nothing is copied until one of the buffers asks for writable access
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a PixelBuffer sharing this buffer's storage
+PixelBuffer PixelBuffer::share() const
+{
+	PixelBuffer view;
+	view._storage = _storage;
+	view._begin = _begin;
+	view._size = _size;
+
+	return view;
+}
+
+// Returns true if no other buffer shares the storage
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool PixelBuffer::unique() const
+{
+	return _storage.use_count() <= 1;
+}
+
+// Take a private copy of the bytes if the storage is shared
+// Called before handing out writable access; filters take their row
+// pointers once up front, so this never runs inside a parallel loop
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+void PixelBuffer::detach()
+{
+	if (_storage.use_count() > 1)
+	{
+		own(_size, _size);
+	}
+}
+
+// Switch to a pool block only this buffer uses
+// INPUT: Takes the new size and how many of the current bytes to keep
+// OUTPUT: Does not return
+void PixelBuffer::own(size_t size, size_t keep)
+{
+	shared_ptr<PixelStorage> storage = make_shared<PixelStorage>();
+	storage->block = (uint8_t *) buffer_pool().acquire(size, storage->capacity);
+
+	if (storage->block == nullptr)
+	{
+		throw bad_alloc();
+	}
+
+	memcpy(storage->block, _begin, keep);
+
+	_storage = std::move(storage);
+	_begin = _storage->block;
+	_size = size;
+}
+
+// Take ownership of a file mapping and expose the pixel array inside it
+// INPUT: Takes the mapping base and length, the byte offset of the
+// pixel array within the mapping, the pixel array length, whether the
+// mapping is shared and the stat of the mapped file
+// OUTPUT: Does not return
+void PixelBuffer::adopt_mapping(void * base, size_t length, size_t offset, size_t size, bool shared, const struct stat & source)
+{
+	_storage = make_shared<PixelStorage>();
+	_storage->mapBase = base;
+	_storage->mapLength = length;
+	_storage->shared = shared;
+	_storage->mapDevice = source.st_dev;
+	_storage->mapInode = source.st_ino;
+
+	_begin = (uint8_t *) base + offset;
+	_size = size;
+}
+
+// Resize the buffer, moving mapped or shared contents into a pool block
+// of its own first; new bytes are zero filled
+// INPUT: Takes the new size in bytes
+// OUTPUT: Does not return
+void PixelBuffer::resize(size_t size)
+{
+	size_t keep = size < _size ? size : _size;
+
+	if (!_storage || mapped() || !unique() || size > _storage->capacity)
+	{
+		own(size, keep);
+	}
+
+	_size = size;
+	memset(_begin + keep, 0, size - keep);
+}
+
+// Resize the buffer for bytes about to be overwritten
+// Reuses the block when it is private and large enough, otherwise takes
+// another from the pool; nothing is copied or cleared
+// INPUT: Takes the new size in bytes
+// OUTPUT: Does not return
+void PixelBuffer::allocate(size_t size)
+{
+	if (!_storage || mapped() || !unique() || size > _storage->capacity)
+	{
+		own(size, 0);
+	}
+
+	_size = size;
+}
+
+// Returns true if the pixel bytes live inside a file mapping
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool PixelBuffer::mapped() const
+{
+	return _storage && _storage->mapBase != nullptr;
+}
+
+// Returns true if writes to the pixel bytes reach the mapped file
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool PixelBuffer::shared() const
+{
+	return mapped() && _storage->shared;
+}
+
+// Returns true if the pixel bytes are mapped from the named file
+// INPUT: Takes a file name
+// OUTPUT: Returns a boolean
+bool PixelBuffer::mapped_from(const string & filename) const
+{
+	struct stat info;
+
+	if (!mapped() || stat(filename.c_str(), &info) != 0)
+	{
+		return false;
+	}
+
+	return info.st_dev == _storage->mapDevice && info.st_ino == _storage->mapInode;
+}
+
+// Returns the first byte of the mapping, nullptr if pool backed
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a pointer
+uint8_t * PixelBuffer::map_base()
+{
+	return mapped() ? (uint8_t *) _storage->mapBase : nullptr;
+}
+
+// Returns the length of the mapping, zero if pool backed
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t PixelBuffer::map_length() const
+{
+	return mapped() ? _storage->mapLength : 0;
+}
+
+// Schedule write back of a shared mapping to its file
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+void PixelBuffer::sync()
+{
+	if (shared())
+	{
+		msync(_storage->mapBase, _storage->mapLength, MS_ASYNC);
+	}
+}
+
+// Returns the number of pixel bytes
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a size
+size_t PixelBuffer::size() const
+{
+	return _size;
+}
+
+// Returns a pointer to the first pixel byte
+// Writable access first detaches from storage shared copy on write
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a pointer
+uint8_t * PixelBuffer::data()
+{
+	detach();
+	return _begin;
+}
+
+const uint8_t * PixelBuffer::data() const
+{
+	return _begin;
+}
+
+// Bounds checked element access
+// INPUT: Takes a byte index
+// OUTPUT: Returns a reference to the byte, throws out_of_range on error
+uint8_t & PixelBuffer::at(size_t i)
+{
+	if (i >= _size)
+	{
+		throw out_of_range("PixelBuffer::at");
+	}
+
+	detach();
+	return _begin[i];
+}
+
+uint8_t PixelBuffer::at(size_t i) const
+{
+	if (i >= _size)
+	{
+		throw out_of_range("PixelBuffer::at");
+	}
+
+	return _begin[i];
+}
@@ -0,0 +1,89 @@
+#ifndef PIXELBUFFER_H
+#define PIXELBUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <string>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Memory holding pixel bytes: a block from the buffer pool or a file
+// mapping; held through a shared pointer so buffers can share it copy on write
+struct PixelStorage
+{
+	uint8_t * block;			// Pool block when not mapped
+	size_t capacity;			// Usable bytes in the block
+	void * mapBase;				// Base address of mapping, nullptr if pool backed
+	size_t mapLength;			// Length of mapping in bytes
+	bool shared;				// True if writes reach the mapped file
+	dev_t mapDevice;			// Identity of the mapped file
+	ino_t mapInode;
+
+	PixelStorage();
+	PixelStorage(const PixelStorage&) = delete;
+	PixelStorage & operator=(const PixelStorage&) = delete;
+	~PixelStorage();			// Returns the block to the pool or unmaps the file
+};
+
+// Backing store for bitmap pixel data
+// Pixels either live in a block from the buffer pool or directly inside a
+// memory mapping of a file. Input mappings are private (MAP_PRIVATE, so
+// writes are copied by the kernel a page at a time and never reach the
+// file); output mappings are shared so writes land in the destination.
+// Copies are deep, share() makes a copy on write view instead: the
+// storage is shared until either side asks for writable access, which
+// then copies the bytes to a block of its own.
+class PixelBuffer
+{
+	private:
+
+		shared_ptr<PixelStorage> _storage;	// Storage, possibly shared with other buffers
+		uint8_t * _begin;			// First pixel byte
+		size_t _size;				// Number of pixel bytes
+
+		void detach();				// Take a private copy if the storage is shared
+		void own(size_t, size_t);		// Switch to a private block, keeping a prefix
+
+	public:
+
+		PixelBuffer();				// Default constructor
+		PixelBuffer(const PixelBuffer&);	// Copy constructor (always copies to a pool block)
+		PixelBuffer(PixelBuffer&&);		// Move constructor
+		PixelBuffer & operator=(const PixelBuffer&);	// Copy assignment
+		PixelBuffer & operator=(PixelBuffer&&);		// Move assignment
+		~PixelBuffer();				// Destructor
+
+		PixelBuffer share() const;		// Copy on write view of the same bytes
+		bool unique() const;			// True if no other buffer shares the storage
+
+		void adopt_mapping(void *, size_t, size_t, size_t, bool, const struct stat&);	// Take ownership of a mapping
+		void resize(size_t);			// Resize as pool storage, zero filling new bytes
+		void allocate(size_t);			// Resize as pool storage, contents undefined
+
+		bool mapped() const;			// True if backed by a file mapping
+		bool shared() const;			// True if backed by a shared output mapping
+		bool mapped_from(const string&) const;	// True if the mapping is of the named file
+		uint8_t * map_base();			// First byte of the mapping
+		size_t map_length() const;		// Length of the mapping
+		void sync();				// Flush a shared mapping to its file
+		size_t size() const;			// Number of pixel bytes
+
+		uint8_t * data();			// Pointer to first pixel byte, writable
+		const uint8_t * data() const;
+
+		uint8_t & at(size_t);			// Bounds checked access
+		uint8_t at(size_t) const;
+
+		uint8_t & operator[](size_t i) { detach(); return _begin[i]; }	// Unchecked access
+		uint8_t operator[](size_t i) const { return _begin[i]; }
+
+		uint8_t * begin() { detach(); return _begin; }			// Iteration
+		uint8_t * end() { detach(); return _begin + _size; }
+		const uint8_t * begin() const { return _begin; }
+		const uint8_t * end() const { return _begin + _size; }
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <cstdint>
+
+// Pixel layouts a bitmap can have, named by byte order in memory
+enum PixelFormatId
+{
+	FORMAT_BGR24,				// 24 bit, the BI_RGB layout
+	FORMAT_BGRA32,				// 32 bit, masks 00ff0000 0000ff00 000000ff
+	FORMAT_RGBA32,				// 32 bit, masks 000000ff 0000ff00 00ff0000
+	FORMAT_ARGB32,				// 32 bit, masks 0000ff00 00ff0000 ff000000
+	FORMAT_ABGR32,				// 32 bit, masks ff000000 00ff0000 0000ff00
+	FORMAT_OTHER				// Any other channel arrangement
+};
+
+// Pixel layout fixed at compile time
+// Kernels templated on a format see constant strides and offsets, so
+// their inner loops can be unrolled and vectorized
+template <int Step, int Red, int Green, int Blue>
+struct PixelFormat
+{
+	static constexpr int step = Step;	// Bytes per pixel
+	static constexpr int red = Red;		// Byte offsets of the channels within a pixel
+	static constexpr int green = Green;
+	static constexpr int blue = Blue;
+};
+
+using BGR24 = PixelFormat<3, 2, 1, 0>;
+using BGRA32 = PixelFormat<4, 2, 1, 0>;
+using RGBA32 = PixelFormat<4, 0, 1, 2>;
+using ARGB32 = PixelFormat<4, 1, 2, 3>;
+using ABGR32 = PixelFormat<4, 3, 2, 1>;
+
+// Pixel layout only known at run time, used for FORMAT_OTHER
+// Has the same members as PixelFormat so kernels accept either
+struct RuntimeFormat
+{
+	int step;
+	int red;
+	int green;
+	int blue;
+};
+
+// Row of pixels seen through a format
+template <class Format>
+struct FormatRow
+{
+	uint8_t * pixels;			// First byte of the row
+	Format format;				// Layout, empty for compile time formats
+
+	uint8_t & r(int x) { return pixels[x * format.step + format.red]; }		// Channel access
+	uint8_t & g(int x) { return pixels[x * format.step + format.green]; }
+	uint8_t & b(int x) { return pixels[x * format.step + format.blue]; }
+};
+
+#endif
@@ -0,0 +1,343 @@
+#include "pointops.h"
+#include "threadpool.h"
+#include <cmath>
+
+// Returns the identity table
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a Lut
+static Lut identity()
+{
+	Lut table;
+
+	for (int i = 0; i < 256; i++)
+	{
+		table[i] = i;
+	}
+
+	return table;
+}
+
+// Clamp a value to a component
+// INPUT: Takes a value
+// OUTPUT: Returns the value constrained to 0 - 255
+static uint8_t clamp_component(double value)
+{
+	if (value < 0.0)
+	{
+		return 0;
+	}
+	else if (value > 255.0)
+	{
+		return 255;
+	}
+
+	return (uint8_t) lround(value);
+}
+
+// Build a table from a function applied to every component value
+// INPUT: Takes a callable mapping a component value to a new value
+// OUTPUT: Returns a Lut
+template <class Function>
+static Lut make_table(Function f)
+{
+	Lut table;
+
+	for (int i = 0; i < 256; i++)
+	{
+		table[i] = f(i);
+	}
+
+	return table;
+}
+
+// Fold a per channel map into the last pass
+// Applied after a gray step the map lands in that step's post tables
+// INPUT: Takes red, green and blue tables
+// OUTPUT: Does not return
+void PointOps::add_map(const Lut & red, const Lut & green, const Lut & blue)
+{
+	if (_stages.empty())
+	{
+		PointStage stage;
+		stage.pre[0] = stage.pre[1] = stage.pre[2] = identity();
+		stage.gray = false;
+		stage.post[0] = stage.post[1] = stage.post[2] = identity();
+		_stages.push_back(stage);
+	}
+
+	PointStage & last = _stages.back();
+	Lut * tables = last.gray ? last.post : last.pre;
+	const Lut * maps[3] = {&red, &green, &blue};
+
+	for (int c = 0; c < 3; c++)						// Compose: new(v) = map(old(v))
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			tables[c][i] = (*maps[c])[tables[c][i]];
+		}
+	}
+}
+
+// Fold a gray step into the chain
+// Once the channels are equal a further gray step is the identity for
+// every weighting (the weights sum to one), so it is dropped
+// INPUT: Takes the gray weights
+// OUTPUT: Does not return
+void PointOps::add_gray(const GrayWeights & weights)
+{
+	if (!_stages.empty() && !_stages.back().gray)
+	{
+		_stages.back().gray = true;
+		_stages.back().weights = weights;
+		return;
+	}
+
+	if (!_stages.empty())
+	{
+		const PointStage & last = _stages.back();
+
+		if (last.post[0] == last.post[1] && last.post[1] == last.post[2])	// Channels still equal
+		{
+			return;
+		}
+	}
+
+	PointStage stage;							// Needs a pass of its own
+	stage.pre[0] = stage.pre[1] = stage.pre[2] = identity();
+	stage.gray = true;
+	stage.weights = weights;
+	stage.post[0] = stage.post[1] = stage.post[2] = identity();
+	_stages.push_back(stage);
+}
+
+// Convert to gray
+// INPUT: Takes a GrayMode
+// OUTPUT: Returns this chain
+PointOps & PointOps::gray(GrayMode mode)
+{
+	add_gray(gray_weights(mode));
+	return *this;
+}
+
+// Snap components to the nearest of {0, 128, 255}
+// INPUT: Does not take input parameters
+// OUTPUT: Returns this chain
+PointOps & PointOps::cell_shade()
+{
+	Lut table = make_table([](int v) { return v <= 64 ? 0 : v <= 192 ? 128 : 255; });
+
+	add_map(table, table, table);
+	return *this;
+}
+
+// Reduce each channel to a number of evenly spaced levels
+// INPUT: Takes the number of levels, at least 2
+// OUTPUT: Returns this chain
+PointOps & PointOps::posterize(int levels)
+{
+	levels = levels < 2 ? 2 : levels > 256 ? 256 : levels;
+
+	Lut table = make_table([&](int v)
+	{
+		double step = 255.0 / (levels - 1);
+		return clamp_component(lround(v / step) * step);
+	});
+
+	add_map(table, table, table);
+	return *this;
+}
+
+// Add an offset to every component
+// INPUT: Takes the offset
+// OUTPUT: Returns this chain
+PointOps & PointOps::brightness(int offset)
+{
+	Lut table = make_table([&](int v) { return clamp_component(v + offset); });
+
+	add_map(table, table, table);
+	return *this;
+}
+
+// Scale components around mid gray
+// INPUT: Takes the scale factor
+// OUTPUT: Returns this chain
+PointOps & PointOps::contrast(double factor)
+{
+	Lut table = make_table([&](int v) { return clamp_component((v - 128) * factor + 128); });
+
+	add_map(table, table, table);
+	return *this;
+}
+
+// Gamma correct, values above one brighten
+// INPUT: Takes the gamma value
+// OUTPUT: Returns this chain
+PointOps & PointOps::gamma(double value)
+{
+	Lut table = make_table([&](int v) { return clamp_component(255.0 * pow(v / 255.0, 1.0 / value)); });
+
+	add_map(table, table, table);
+	return *this;
+}
+
+// Negate every component
+// INPUT: Does not take input parameters
+// OUTPUT: Returns this chain
+PointOps & PointOps::invert()
+{
+	Lut table = make_table([](int v) { return 255 - v; });
+
+	add_map(table, table, table);
+	return *this;
+}
+
+// Apply arbitrary red, green and blue tables
+// INPUT: Takes three tables
+// OUTPUT: Returns this chain
+PointOps & PointOps::map(const Lut & red, const Lut & green, const Lut & blue)
+{
+	add_map(red, green, blue);
+	return *this;
+}
+
+// Append the ops of another chain
+// INPUT: Takes a chain
+// OUTPUT: Returns this chain
+PointOps & PointOps::then(const PointOps & ops)
+{
+	for (const PointStage & stage : ops._stages)
+	{
+		add_map(stage.pre[0], stage.pre[1], stage.pre[2]);
+
+		if (stage.gray)
+		{
+			add_gray(stage.weights);
+			add_map(stage.post[0], stage.post[1], stage.post[2]);
+		}
+	}
+
+	return *this;
+}
+
+// Returns true if no ops were added
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool PointOps::empty() const
+{
+	return _stages.empty();
+}
+
+// Returns the number of passes over the image apply() makes
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int PointOps::passes() const
+{
+	return _stages.size();
+}
+
+// Per channel table kernel for one pixel format
+// INPUT: Takes the rows of a bitmap, its format and the pass
+// OUTPUT: Does not return
+template <class Format>
+static void map_rows(PixelRows rows, Format format, const PointStage & stage)
+{
+	const uint8_t * red = stage.pre[0].data();
+	const uint8_t * green = stage.pre[1].data();
+	const uint8_t * blue = stage.pre[2].data();
+
+	for (int y = 0; y < rows.height(); y++)
+	{
+		FormatRow<Format> row = {rows[y].pixels, format};
+
+		for (int x = 0; x < rows.width(); x++)
+		{
+			row.r(x) = red[row.r(x)];
+			row.g(x) = green[row.g(x)];
+			row.b(x) = blue[row.b(x)];
+		}
+	}
+}
+
+// Table, gray, table kernel for one pixel format
+// INPUT: Takes the rows of a bitmap, its format and the pass
+// OUTPUT: Does not return
+template <class Format>
+static void gray_map_rows(PixelRows rows, Format format, const PointStage & stage)
+{
+	const GrayWeights & w = stage.weights;
+
+	for (int y = 0; y < rows.height(); y++)
+	{
+		FormatRow<Format> row = {rows[y].pixels, format};
+
+		for (int x = 0; x < rows.width(); x++)
+		{
+			int value = (stage.pre[0][row.r(x)] * w.red + stage.pre[1][row.g(x)] * w.green
+			             + stage.pre[2][row.b(x)] * w.blue + w.bias) >> w.shift;
+
+			row.r(x) = stage.post[0][value];
+			row.g(x) = stage.post[1][value];
+			row.b(x) = stage.post[2][value];
+		}
+	}
+}
+
+// Single table over every color byte of 24 bit rows
+// With one table for all channels the row is a flat byte array
+// INPUT: Takes the rows of a bitmap and the table
+// OUTPUT: Does not return
+static void map_bytes(PixelRows rows, const Lut & table)
+{
+	const uint8_t * lut = table.data();
+	int bytes = rows.width() * 3;
+
+	for (int y = 0; y < rows.height(); y++)
+	{
+		uint8_t * p = rows[y].pixels;
+
+		for (int i = 0; i < bytes; i++)
+		{
+			p[i] = lut[p[i]];
+		}
+	}
+}
+
+// Run the chain over a bitmap, one pass per compiled stage
+// Row bands run in parallel and each band goes through every pass while
+// it is still in cache
+// INPUT: Takes a reference to a bitmap object
+// OUTPUT: Does not return
+void PointOps::apply(Bitmap & b) const
+{
+	PixelRows rows = b.rows();
+	RuntimeFormat layout = b.get_layout();
+	Lut same = identity();
+
+	parallel_rows(rows.height(), [&](const Band & band)
+	{
+		PixelRows part = rows.band(band.first, band.last);
+
+		for (const PointStage & stage : _stages)
+		{
+			bool uniform = stage.pre[0] == stage.pre[1] && stage.pre[1] == stage.pre[2];
+
+			if (!stage.gray && uniform && layout.step == 3)				// Flat byte lookup
+			{
+				map_bytes(part, stage.pre[0]);
+			}
+			else if (!stage.gray)
+			{
+				dispatch_format(b, [&](auto format) { map_rows(part, format, stage); });
+			}
+			else if (uniform && stage.pre[0] == same && stage.post[0] == same && stage.post[1] == same
+			         && stage.post[2] == same && gray_rows_simd(part, layout, stage.weights))
+			{
+				continue;							// Plain gray ran on the vector path
+			}
+			else
+			{
+				dispatch_format(b, [&](auto format) { gray_map_rows(part, format, stage); });
+			}
+		}
+	});
+}
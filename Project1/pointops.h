@@ -0,0 +1,51 @@
+#ifndef POINTOPS_H
+#define POINTOPS_H
+
+#include <array>
+#include <vector>
+#include "bitmap.h"
+#include "simd.h"
+
+using Lut = array<uint8_t, 256>;		// Lookup table for one channel
+
+// One pass over the pixels: per channel tables, then optionally a
+// cross channel gray step followed by a second set of per channel tables
+struct PointStage
+{
+	Lut pre[3];				// Red, green, blue tables applied first
+	bool gray;				// Convert to gray after the first tables
+	GrayWeights weights;			// Weights for the gray step
+	Lut post[3];				// Red, green, blue tables applied to the gray value
+};
+
+// Chain of point operations compiled into lookup tables
+// Ops are folded into the tables as they are added, so applying the
+// chain walks the image once no matter how many ops it holds (a gray
+// step after channels that differ starts a second pass)
+class PointOps
+{
+	private:
+
+		vector<PointStage> _stages;		// Compiled passes
+
+		void add_map(const Lut &, const Lut &, const Lut &);	// Fold a per channel map into the chain
+		void add_gray(const GrayWeights &);			// Fold a gray step into the chain
+
+	public:
+
+		PointOps & gray(GrayMode = GRAY_AVERAGE);	// Convert to gray
+		PointOps & cell_shade();			// Snap components to {0, 128, 255}
+		PointOps & posterize(int);			// Reduce to n levels per channel
+		PointOps & brightness(int);			// Add an offset
+		PointOps & contrast(double);			// Scale around mid gray
+		PointOps & gamma(double);			// Gamma correct
+		PointOps & invert();				// Negate
+		PointOps & map(const Lut &, const Lut &, const Lut &);	// Arbitrary red, green, blue tables
+		PointOps & then(const PointOps &);		// Append another chain
+
+		bool empty() const;				// True if no ops were added
+		int passes() const;				// Passes over the image apply() makes
+		void apply(Bitmap &) const;			// Run the chain over a bitmap
+};
+
+#endif
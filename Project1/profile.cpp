@@ -0,0 +1,170 @@
+#include "profile.h"
+#include <iomanip>
+
+using Clock = chrono::steady_clock;
+
+Profiler::Profiler() : _enabled(false)
+{
+}
+
+// Start collecting, timing the run from now
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+void Profiler::enable()
+{
+	lock_guard<mutex> lock(_lock);
+	_entries.clear();
+	_start = Clock::now();
+	_enabled = true;
+}
+
+// Returns true while steps are being recorded
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a boolean
+bool Profiler::enabled() const
+{
+	return _enabled;
+}
+
+// Add a step's time and bytes to the entry with its name
+// INPUT: Takes the step name, the seconds it took and the bytes it touched
+// OUTPUT: Does not return
+void Profiler::record(const string & name, double seconds, size_t bytes)
+{
+	lock_guard<mutex> lock(_lock);
+
+	for (ProfileEntry & entry : _entries)
+	{
+		if (entry.name == name)
+		{
+			entry.seconds += seconds;
+			entry.bytes += bytes;
+			entry.calls++;
+			return;
+		}
+	}
+
+	_entries.push_back({name, seconds, bytes, 1});
+}
+
+// Returns a copy of the entries in the order they were first recorded
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a vector of entries
+vector<ProfileEntry> Profiler::entries() const
+{
+	lock_guard<mutex> lock(_lock);
+
+	return _entries;
+}
+
+// Print a table of every step with its share of the run and throughput
+// Time not covered by any step (option parsing, thread start up, exit)
+// is shown as "other"
+// INPUT: Takes an output stream
+// OUTPUT: Does not return
+void Profiler::report(ostream & out) const
+{
+	vector<ProfileEntry> steps = entries();
+	double total = chrono::duration<double>(Clock::now() - _start).count();
+	double covered = 0.0;
+
+	out << left << setw(24) << "stage" << right << setw(7) << "calls" << setw(12) << "ms"
+	    << setw(8) << "%" << setw(12) << "MB" << setw(12) << "MB/s" << endl;
+
+	for (const ProfileEntry & step : steps)
+	{
+		covered += step.seconds;
+
+		out << left << setw(24) << step.name << right << fixed << setw(7) << step.calls
+		    << setw(12) << setprecision(3) << step.seconds * 1e3
+		    << setw(8) << setprecision(1) << (total > 0 ? step.seconds / total * 100.0 : 0.0)
+		    << setw(12) << setprecision(2) << step.bytes / 1e6
+		    << setw(12) << setprecision(1) << (step.seconds > 0 ? step.bytes / step.seconds / 1e6 : 0.0) << endl;
+	}
+
+	double other = total > covered ? total - covered : 0.0;				// Steps on other threads may overlap
+
+	out << left << setw(24) << "other" << right << setw(7) << "" << setw(12) << setprecision(3) << other * 1e3
+	    << setw(8) << setprecision(1) << (total > 0 ? other / total * 100.0 : 0.0) << endl;
+	out << left << setw(24) << "total" << right << setw(7) << "" << setw(12) << setprecision(3) << total * 1e3 << endl;
+}
+
+// Print the steps as a JSON object
+// INPUT: Takes an output stream
+// OUTPUT: Does not return
+void Profiler::report_json(ostream & out) const
+{
+	vector<ProfileEntry> steps = entries();
+	double total = chrono::duration<double>(Clock::now() - _start).count();
+
+	out << "{\"total_ms\": " << fixed << setprecision(3) << total * 1e3 << ", \"stages\": [";
+
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		out << (i > 0 ? ", " : "") << "{\"name\": \"";
+
+		for (char c : steps[i].name)						// Names are option text, escape just in case
+		{
+			if (c == '"' || c == '\\')
+			{
+				out << '\\';
+			}
+
+			out << c;
+		}
+
+		out << "\", \"calls\": " << steps[i].calls << ", \"ms\": " << setprecision(3) << steps[i].seconds * 1e3
+		    << ", \"bytes\": " << steps[i].bytes << ", \"mb_per_s\": " << setprecision(1)
+		    << (steps[i].seconds > 0 ? steps[i].bytes / steps[i].seconds / 1e6 : 0.0) << "}";
+	}
+
+	out << "]}" << endl;
+}
+
+// Returns the profiler shared by the whole program
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a reference to the profiler
+Profiler & profiler()
+{
+	static Profiler * shared = new Profiler;
+
+	return *shared;
+}
+
+// Start timing if the profiler is on
+// INPUT: Takes the step name and the bytes it touches, if known yet
+// OUTPUT: Constructs the scope
+ProfileScope::ProfileScope(const char * name, size_t bytes) : _name(name), _bytes(bytes), _active(profiler().enabled())
+{
+	if (_active)
+	{
+		_start = Clock::now();
+	}
+}
+
+// Record the time since construction
+ProfileScope::~ProfileScope()
+{
+	stop();
+}
+
+// Record the time since construction now, so work later in the same
+// scope can be timed as a step of its own
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+void ProfileScope::stop()
+{
+	if (_active)
+	{
+		profiler().record(_name, chrono::duration<double>(Clock::now() - _start).count(), _bytes);
+		_active = false;
+	}
+}
+
+// Set the bytes the step touched
+// INPUT: Takes a byte count
+// OUTPUT: Does not return
+void ProfileScope::set_bytes(size_t bytes)
+{
+	_bytes = bytes;
+}
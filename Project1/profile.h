@@ -0,0 +1,76 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Time spent and bytes touched by one named step of a run
+struct ProfileEntry
+{
+	string name;
+	double seconds;				// Total over every call
+	size_t bytes;				// Bytes read or written over every call
+	int calls;
+};
+
+// Collects per stage timings for --profile
+// Steps with the same name are added together, so a streamed or batched
+// run reports one line per stage rather than one per band or file.
+// Entries keep the order in which each name was first seen. While the
+// profiler is off, recording costs a single flag test.
+class Profiler
+{
+	private:
+
+		mutable mutex _lock;
+		vector<ProfileEntry> _entries;
+		atomic<bool> _enabled;			// Read by every thread without the lock
+		chrono::steady_clock::time_point _start;	// When profiling was switched on
+
+	public:
+
+		Profiler();
+		Profiler(const Profiler &) = delete;
+		Profiler & operator=(const Profiler &) = delete;
+
+		void enable();				// Start collecting, timing the run from now
+		bool enabled() const;
+		void record(const string &, double, size_t);	// Add a step's seconds and bytes
+
+		vector<ProfileEntry> entries() const;
+		void report(ostream &) const;		// Table of every step
+		void report_json(ostream &) const;	// The same as a JSON object
+};
+
+Profiler & profiler();				// Profiler shared by the whole program
+
+// Times the enclosing scope on the monotonic clock and records it under
+// a name when it ends; the byte count may be filled in once it is known
+class ProfileScope
+{
+	private:
+
+		const char * _name;
+		size_t _bytes;
+		bool _active;
+		chrono::steady_clock::time_point _start;
+
+	public:
+
+		ProfileScope(const char *, size_t = 0);
+		~ProfileScope();
+		ProfileScope(const ProfileScope &) = delete;
+		ProfileScope & operator=(const ProfileScope &) = delete;
+
+		void set_bytes(size_t);
+		void stop();				// Record now rather than at the end of the scope
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "rank.h"
+#include "threadpool.h"
+#include <cstring>
+
+const int MEDIAN_TILE = 256;			// Tile edge of the median filter
+const int FINE_BINS = 16;			// Values per coarse bin, and coarse bins per histogram
+
+// Histograms of one channel: 16 coarse bins and 256 fine ones
+struct MedianHistogram
+{
+	uint16_t coarse[FINE_BINS];
+	uint16_t fine[FINE_BINS][FINE_BINS];	// Coarse bin, value within it
+};
+
+// Clamp a coordinate to [0, limit)
+// INPUT: Takes the coordinate and the limit
+// OUTPUT: Returns the clamped coordinate
+static inline int clamp_to(int v, int limit)
+{
+	return v < 0 ? 0 : v >= limit ? limit - 1 : v;
+}
+
+// Clamp a coordinate to [low, high)
+// INPUT: Takes the coordinate and the bounds
+// OUTPUT: Returns the clamped coordinate
+static inline int clamp_between(int v, int low, int high)
+{
+	return v < low ? low : v >= high ? high - 1 : v;
+}
+
+// Add or remove a value in a column histogram
+// INPUT: Takes the histogram, the value and +1 or -1
+// OUTPUT: Does not return
+static inline void count_value(MedianHistogram & h, int value, int change)
+{
+	h.coarse[value >> 4] += change;
+	h.fine[value >> 4][value & 15] += change;
+}
+
+// Median filter one tile
+// The column histograms cover the tile's columns and r more on each
+// side; they start from the window of the tile's first row and then
+// slide down. For each row and channel the window's coarse counts slide
+// across, while each fine bin records the column it was last current
+// at and catches up, or is rebuilt from 2r + 1 columns, when needed.
+// Reads are clamped to the tile's halo of r, which at the image edges
+// is the same as clamping to the image.
+// INPUT: Takes the source pixels and stride, the output rows, the
+// channel offsets, the radius and the tile
+// OUTPUT: Does not return
+static void median_tile(const uint8_t * source, size_t stride, PixelRows rows, const int channel[3], int radius,
+                        const Tile & tile)
+{
+	int step = rows.step();
+	int span = 2 * radius + 1;
+	int columns = tile.width + 2 * radius;
+	int target = span * span / 2 + 1;						// Rank of the median
+
+	vector<MedianHistogram> histograms((size_t) columns * 3);			// Zeroed, column major by channel
+	vector<int> offsets(columns);							// Byte offset of each column's source pixel
+
+	for (int j = 0; j < columns; j++)
+	{
+		offsets[j] = clamp_between(tile.x - radius + j, tile.left, tile.right) * step;
+	}
+
+	for (int dy = -radius; dy <= radius; dy++)					// Window of the first row
+	{
+		const uint8_t * line = source + clamp_between(tile.y + dy, tile.top, tile.bottom) * stride;
+
+		for (int j = 0; j < columns; j++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				count_value(histograms[j * 3 + c], line[offsets[j] + channel[c]], 1);
+			}
+		}
+	}
+
+	for (int y = tile.y; y < tile.y + tile.height; y++)
+	{
+		if (y > tile.y)								// Slide the columns down a row
+		{
+			const uint8_t * out = source + clamp_between(y - radius - 1, tile.top, tile.bottom) * stride;
+			const uint8_t * in = source + clamp_between(y + radius, tile.top, tile.bottom) * stride;
+
+			for (int j = 0; j < columns; j++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					count_value(histograms[j * 3 + c], out[offsets[j] + channel[c]], -1);
+					count_value(histograms[j * 3 + c], in[offsets[j] + channel[c]], 1);
+				}
+			}
+		}
+
+		uint8_t * row = rows[y].pixels;
+
+		for (int c = 0; c < 3; c++)
+		{
+			MedianHistogram window = {};
+			int current[FINE_BINS];						// Column each fine bin was current at
+
+			for (int k = 0; k < FINE_BINS; k++)
+			{
+				current[k] = -span - 1;						// Never, so the first use rebuilds
+			}
+
+			for (int j = 0; j < span; j++)
+			{
+				for (int k = 0; k < FINE_BINS; k++)
+				{
+					window.coarse[k] += histograms[j * 3 + c].coarse[k];
+				}
+			}
+
+			for (int i = 0; i < tile.width; i++)
+			{
+				if (i > 0)							// Slide the coarse counts a column
+				{
+					const uint16_t * in = histograms[(i + 2 * radius) * 3 + c].coarse;
+					const uint16_t * out = histograms[(i - 1) * 3 + c].coarse;
+
+					for (int k = 0; k < FINE_BINS; k++)
+					{
+						window.coarse[k] += in[k] - out[k];
+					}
+				}
+
+				int below = 0;							// Count under the bin searched
+				int bin = 0;
+
+				while (below + window.coarse[bin] < target)
+				{
+					below += window.coarse[bin++];
+				}
+
+				uint16_t * fine = window.fine[bin];
+
+				if (i - current[bin] > span)					// Too far behind, rebuild
+				{
+					for (int v = 0; v < FINE_BINS; v++)
+					{
+						fine[v] = 0;
+					}
+
+					for (int j = i; j < i + span; j++)
+					{
+						const uint16_t * column = histograms[j * 3 + c].fine[bin];
+
+						for (int v = 0; v < FINE_BINS; v++)
+						{
+							fine[v] += column[v];
+						}
+					}
+				}
+				else								// Catch up column by column
+				{
+					for (int t = current[bin] + 1; t <= i; t++)
+					{
+						const uint16_t * in = histograms[(t + 2 * radius) * 3 + c].fine[bin];
+						const uint16_t * out = histograms[(t - 1) * 3 + c].fine[bin];
+
+						for (int v = 0; v < FINE_BINS; v++)
+						{
+							fine[v] += in[v] - out[v];
+						}
+					}
+				}
+
+				current[bin] = i;
+
+				int value = 0;
+
+				while (below + fine[value] < target)
+				{
+					below += fine[value++];
+				}
+
+				row[(tile.x + i) * step + channel[c]] = bin * FINE_BINS + value;
+			}
+		}
+	}
+}
+
+// Median filter
+// Tiles are at least a few windows tall, so filling the column
+// histograms at the top of each tile stays a small part of the work
+// INPUT: Takes a reference to a bitmap object and the radius
+// OUTPUT: Does not return
+void median_filter(Bitmap & b, int radius)
+{
+	radius = radius > MAX_MEDIAN_RADIUS ? MAX_MEDIAN_RADIUS : radius;
+	PixelRows rows = b.rows();
+
+	if (radius < 1 || rows.width() == 0 || rows.height() == 0)
+	{
+		return;
+	}
+
+	size_t stride = (size_t) rows.width() * rows.step();
+	vector<uint8_t> source(stride * rows.height());					// Tiles read around themselves
+
+	parallel_rows(rows.height(), [&](const Band & band)
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			memcpy(&source[y * stride], rows[y].pixels, stride);
+		}
+	});
+
+	RuntimeFormat layout = b.get_layout();
+	int channel[3] = {layout.red, layout.green, layout.blue};
+	int edge = 8 * radius > MEDIAN_TILE ? 8 * radius : MEDIAN_TILE;
+
+	parallel_tiles(rows.width(), rows.height(), edge, [&](const Tile & tile)
+	{
+		median_tile(source.data(), stride, rows, channel, radius, tile);
+	}, radius);
+}
+
+// Minimum or maximum of two bytes
+// INPUT: Takes two bytes
+// OUTPUT: Returns the larger if Dilate, otherwise the smaller
+template <bool Dilate>
+static inline uint8_t extreme(uint8_t a, uint8_t b)
+{
+	return Dilate ? (a > b ? a : b) : (a < b ? a : b);
+}
+
+// One van Herk/Gil-Werman line of interleaved pixels
+// The line is extended by r clamped pixels at each end and padded to
+// whole blocks; forward[p] is the extreme from p's block start to p and
+// backward[p] from p to its block end, so the window [p, p + 2r] is
+// the extreme of backward[p] and forward[p + 2r]
+// INPUT: Takes a function giving the source bytes of extended pixel p,
+// the output, the width, bytes per pixel, the radius and two scratch
+// buffers
+// OUTPUT: Does not return
+template <bool Dilate, class Source>
+static void extreme_line(Source at, uint8_t * out, int width, int step, int radius, vector<uint8_t> & forward,
+                         vector<uint8_t> & backward)
+{
+	int span = 2 * radius + 1;
+	int pixels = (width + 2 * radius + span - 1) / span * span;			// Whole blocks
+
+	for (int p = 0; p < pixels; p++)
+	{
+		const uint8_t * in = at(p);
+		uint8_t * f = &forward[(size_t) p * step];
+
+		if (p % span == 0)							// Block start
+		{
+			memcpy(f, in, step);
+			continue;
+		}
+
+		for (int c = 0; c < step; c++)
+		{
+			f[c] = extreme<Dilate>(f[c - step], in[c]);
+		}
+	}
+
+	for (int p = pixels - 1; p >= 0; p--)
+	{
+		const uint8_t * in = at(p);
+		uint8_t * h = &backward[(size_t) p * step];
+
+		if (p % span == span - 1)						// Block end
+		{
+			memcpy(h, in, step);
+			continue;
+		}
+
+		for (int c = 0; c < step; c++)
+		{
+			h[c] = extreme<Dilate>(h[c + step], in[c]);
+		}
+	}
+
+	const uint8_t * ahead = &forward[(size_t) 2 * radius * step];
+
+	for (size_t i = 0; i < (size_t) width * step; i++)
+	{
+		out[i] = extreme<Dilate>(backward[i], ahead[i]);
+	}
+}
+
+// Erode or dilate
+// The row pass writes into a scratch image; the column pass treats whole
+// rows as the pixels of one line, so its loops run across every byte of
+// a row at once. Only the color bytes are copied back.
+// INPUT: Takes a reference to a bitmap object and the radius
+// OUTPUT: Does not return
+template <bool Dilate>
+static void morphology(Bitmap & b, int radius)
+{
+	PixelRows rows = b.rows();
+	int width = rows.width();
+	int height = rows.height();
+	int step = rows.step();
+	int bytes = width * step;
+	int span = 2 * radius + 1;
+	RuntimeFormat layout = b.get_layout();
+	int channel[3] = {layout.red, layout.green, layout.blue};
+
+	if (radius < 1 || width == 0 || height == 0)
+	{
+		return;
+	}
+
+	vector<uint8_t> horizontal((size_t) bytes * height);
+
+	parallel_rows(height, [&](const Band & band)					// Row pass
+	{
+		int pixels = (width + 2 * radius + span - 1) / span * span;
+		vector<uint8_t> forward(pixels * step);
+		vector<uint8_t> backward(pixels * step);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			const uint8_t * line = rows[y].pixels;
+			auto at = [&](int p) { return line + clamp_to(p - radius, width) * step; };
+
+			extreme_line<Dilate>(at, &horizontal[(size_t) y * bytes], width, step, radius, forward, backward);
+		}
+	});
+
+	parallel_rows(height, [&](const Band & band)					// Column pass, rows as pixels
+	{
+		int count = band.last - band.first;
+		int lines = (count + 2 * radius + span - 1) / span * span;
+		vector<uint8_t> forward((size_t) lines * bytes);
+		vector<uint8_t> backward((size_t) lines * bytes);
+		vector<uint8_t> out((size_t) count * bytes);
+		auto at = [&](int p) { return &horizontal[(size_t) clamp_to(band.first - radius + p, height) * bytes]; };
+
+		extreme_line<Dilate>(at, out.data(), count, bytes, radius, forward, backward);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			const uint8_t * in = &out[(size_t) (y - band.first) * bytes];
+			uint8_t * p = rows[y].pixels;
+
+			if (step == 3)
+			{
+				memcpy(p, in, bytes);
+				continue;
+			}
+
+			for (int x = 0; x < bytes; x += step)				// Alpha is left as it is
+			{
+				p[x + channel[0]] = in[x + channel[0]];
+				p[x + channel[1]] = in[x + channel[1]];
+				p[x + channel[2]] = in[x + channel[2]];
+			}
+		}
+	});
+}
+
+// Erosion, the minimum over the window
+// INPUT: Takes a reference to a bitmap object and the radius
+// OUTPUT: Does not return
+void erode(Bitmap & b, int radius)
+{
+	morphology<false>(b, radius);
+}
+
+// Dilation, the maximum over the window
+// INPUT: Takes a reference to a bitmap object and the radius
+// OUTPUT: Does not return
+void dilate(Bitmap & b, int radius)
+{
+	morphology<true>(b, radius);
+}
@@ -0,0 +1,29 @@
+#ifndef RANK_H
+#define RANK_H
+
+#include "bitmap.h"
+
+const int MAX_MEDIAN_RADIUS = 127;		// Window counts must fit 16 bits
+
+// Median of the (2r + 1) x (2r + 1) window around every pixel
+// Perreault and Hébert's constant time method: every column of a tile
+// keeps a histogram of the window rows, updated by one pixel in and one
+// out per row, and the window histogram slides along the row by adding
+// one column histogram and subtracting another. Histograms have 16
+// coarse bins over 16 fine ones; only the coarse level slides with every
+// pixel and a fine bin is brought up to date when the median lands in
+// it. Red, green and blue are filtered separately; alpha is left as it
+// is. Edges are clamped. The radius is limited to MAX_MEDIAN_RADIUS.
+void median_filter(Bitmap & b, int radius);
+
+// Minimum (erode) or maximum (dilate) over the (2r + 1) x (2r + 1) window
+// van Herk and Gil-Werman's method, a row pass and then a column pass:
+// the line is cut into blocks of 2r + 1, running extremes are taken
+// forwards and backwards within each block, and every window is the
+// extreme of one backward and one forward value, three comparisons per
+// byte for any radius. Red, green and blue are filtered; alpha is left
+// as it is. Edges are clamped.
+void erode(Bitmap & b, int radius);
+void dilate(Bitmap & b, int radius);
+
+#endif
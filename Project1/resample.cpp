@@ -0,0 +1,317 @@
+#include "resample.h"
+#include "threadpool.h"
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define RESAMPLE_SSE2 1
+#endif
+
+const int TAP_SHIFT = 14;				// Resampling weights are fixed point with 14 fraction bits
+const int TAP_ONE = 1 << TAP_SHIFT;
+const double PI = 3.14159265358979323846;
+
+// Scale up by 2
+// Every pixel becomes a 2x2 block; 32 bit rows are widened 4 pixels at a
+// time with SSE2 unpacks and the second row of each pair is a copy;
+// source rows are split into bands across the thread pool
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void scaleUp(Bitmap & b)
+{
+	int width = b.get_width();
+	int height = abs(b.get_height());
+	int step = b.get_step();
+	int sourceStride = b.get_stride();
+	PixelBuffer source = b.reshape(width * 2, height * 2);
+	const uint8_t * pixels = source.data();
+	PixelRows rows = b.rows();
+
+	parallel_rows(height, [&](const Band & band)
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			const uint8_t * in = pixels + (size_t) y * sourceStride;
+			uint8_t * out = rows[2 * y].pixels;
+			int x = 0;
+
+#ifdef RESAMPLE_SSE2
+			if (step == 4)
+			{
+				for (; x + 4 <= width; x += 4)
+				{
+					__m128i pixels = _mm_loadu_si128((const __m128i *) (in + x * 4));
+					_mm_storeu_si128((__m128i *) (out + x * 8), _mm_unpacklo_epi32(pixels, pixels));
+					_mm_storeu_si128((__m128i *) (out + x * 8 + 16), _mm_unpackhi_epi32(pixels, pixels));
+				}
+			}
+#endif
+
+			for (; x < width; x++)
+			{
+				memcpy(out + 2 * x * step, in + x * step, step);
+				memcpy(out + (2 * x + 1) * step, in + x * step, step);
+			}
+
+			memcpy(rows[2 * y + 1].pixels, out, rows.width() * step);		// Second row of the pair
+		}
+	});
+}
+
+#ifdef RESAMPLE_SSE2
+
+// Average 2x2 blocks of 32 bit pixels, four output pixels at a time
+// Sums are taken in 16 bit lanes so the result is exactly rounded
+// INPUT: Takes the two source rows and the output row, all at the block start
+// OUTPUT: Does not return
+static inline void average4(const uint8_t * top, const uint8_t * bottom, uint8_t * out)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i two = _mm_set1_epi16(2);
+	__m128i result[2];
+
+	for (int half = 0; half < 2; half++)					// Four source pixels per half
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *) (top + half * 16));
+		__m128i c = _mm_loadu_si128((const __m128i *) (bottom + half * 16));
+		__m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(c, zero));	// Pixels 0, 1
+		__m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(c, zero));	// Pixels 2, 3
+		__m128i sums = _mm_add_epi16(_mm_unpacklo_epi64(low, high), _mm_unpackhi_epi64(low, high));
+
+		result[half] = _mm_srli_epi16(_mm_add_epi16(sums, two), 2);
+	}
+
+	_mm_storeu_si128((__m128i *) out, _mm_packus_epi16(result[0], result[1]));
+}
+
+#endif
+
+// Scale down by 2
+// Every 2x2 block becomes one pixel holding its rounded average; an odd
+// last column or row is dropped
+// INPUT: Takes a reference to a bitmap object as input
+// OUTPUT: Does not return
+void scaleDown(Bitmap & b)
+{
+	int width = b.get_width();
+	int height = abs(b.get_height());
+
+	if (width < 2 || height < 2)
+	{
+		resample(b, width > 1 ? width / 2 : 1, height > 1 ? height / 2 : 1, RESAMPLE_BILINEAR);
+		return;
+	}
+
+	int step = b.get_step();
+	int sourceStride = b.get_stride();
+	PixelBuffer source = b.reshape(width / 2, height / 2);
+	const uint8_t * pixels = source.data();
+	PixelRows rows = b.rows();
+
+	parallel_rows(rows.height(), [&](const Band & band)
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			const uint8_t * top = pixels + (size_t) 2 * y * sourceStride;
+			const uint8_t * bottom = top + sourceStride;
+			uint8_t * out = rows[y].pixels;
+			int x = 0;
+
+#ifdef RESAMPLE_SSE2
+			if (step == 4)
+			{
+				for (; x + 4 <= rows.width(); x += 4)
+				{
+					average4(top + x * 8, bottom + x * 8, out + x * 4);
+				}
+			}
+#endif
+
+			for (; x < rows.width(); x++)
+			{
+				for (int c = 0; c < step; c++)
+				{
+					int i = 2 * x * step + c;
+					out[x * step + c] = (top[i] + top[i + step] + bottom[i] + bottom[i + step] + 2) >> 2;
+				}
+			}
+		}
+	});
+}
+
+// Filter value at a distance in source pixels
+// INPUT: Takes the mode and the distance
+// OUTPUT: Returns the weight
+static double filter(ResampleMode mode, double d)
+{
+	d = fabs(d);
+
+	if (mode == RESAMPLE_BILINEAR)
+	{
+		return d < 1.0 ? 1.0 - d : 0.0;
+	}
+
+	if (d < 1e-9)
+	{
+		return 1.0;
+	}
+
+	if (d >= 3.0)
+	{
+		return 0.0;
+	}
+
+	return 3.0 * sin(PI * d) * sin(PI * d / 3.0) / (PI * PI * d * d);
+}
+
+// Precomputed taps for one axis: output i reads source pixels
+// first[i] .. first[i] + taps - 1 (clamped) with the given weights
+struct WeightTable
+{
+	int taps;				// Taps per output pixel
+	vector<int> first;			// First source pixel per output pixel
+	vector<int> weights;			// taps fixed point weights per output pixel
+};
+
+// Build the weight table for resizing one axis
+// When shrinking the filter is stretched over the source so every source
+// pixel contributes; weights are normalized to sum to one
+// INPUT: Takes the mode and the source and output lengths
+// OUTPUT: Returns a WeightTable
+static WeightTable weight_table(ResampleMode mode, int sourceLength, int outLength)
+{
+	double scale = (double) sourceLength / outLength;
+	double stretch = scale > 1.0 ? scale : 1.0;
+	double support = (mode == RESAMPLE_BILINEAR ? 1.0 : 3.0) * stretch;
+
+	WeightTable table;
+	table.taps = (int) ceil(support) * 2 + 1;
+	table.first.resize(outLength);
+	table.weights.resize((size_t) outLength * table.taps);
+
+	vector<double> exact(table.taps);
+
+	for (int i = 0; i < outLength; i++)
+	{
+		double center = (i + 0.5) * scale - 0.5;				// Output pixel center in source pixels
+		int first = (int) floor(center - support) + 1;
+		double total = 0.0;
+
+		for (int k = 0; k < table.taps; k++)
+		{
+			exact[k] = filter(mode, (first + k - center) / stretch);
+			total += exact[k];
+		}
+
+		int sum = 0;
+		int * w = &table.weights[(size_t) i * table.taps];
+
+		for (int k = 0; k < table.taps; k++)
+		{
+			w[k] = (int) lround(exact[k] / total * TAP_ONE);
+			sum += w[k];
+		}
+
+		w[table.taps / 2] += TAP_ONE - sum;					// Keep the sum exact
+		table.first[i] = first;
+	}
+
+	return table;
+}
+
+// Resize to any size
+// A horizontal pass over the source rows fills a 16 bit scratch image,
+// then a vertical pass combines scratch rows a whole output row at a
+// time; both passes use per column and per row weight tables built once
+// and run on row bands in parallel
+// INPUT: Takes a reference to a bitmap object, the new size and the mode
+// OUTPUT: Does not return
+void resample(Bitmap & b, int width, int height, ResampleMode mode)
+{
+	int sourceWidth = b.get_width();
+	int sourceHeight = abs(b.get_height());
+
+	if (width < 1 || height < 1 || sourceWidth < 1 || sourceHeight < 1)
+	{
+		return;
+	}
+
+	int step = b.get_step();
+	int sourceStride = b.get_stride();
+	WeightTable columns = weight_table(mode, sourceWidth, width);
+	WeightTable lines = weight_table(mode, sourceHeight, height);
+	PixelBuffer source = b.reshape(width, height);
+	const uint8_t * pixels = source.data();
+	PixelRows rows = b.rows();
+	int bytes = width * step;
+
+	vector<int16_t> horizontal((size_t) sourceHeight * bytes);			// Unclamped, keeps Lanczos overshoot
+
+	parallel_rows(sourceHeight, [&](const Band & band)				// Horizontal pass
+	{
+		for (int y = band.first; y < band.last; y++)
+		{
+			const uint8_t * in = pixels + (size_t) y * sourceStride;
+			int16_t * out = &horizontal[(size_t) y * bytes];
+
+			for (int x = 0; x < width; x++)
+			{
+				const int * w = &columns.weights[(size_t) x * columns.taps];
+				int acc[4] = {TAP_ONE / 2, TAP_ONE / 2, TAP_ONE / 2, TAP_ONE / 2};
+
+				for (int k = 0; k < columns.taps; k++)
+				{
+					int sx = columns.first[x] + k;
+					sx = sx < 0 ? 0 : sx >= sourceWidth ? sourceWidth - 1 : sx;
+
+					for (int c = 0; c < step; c++)
+					{
+						acc[c] += w[k] * in[sx * step + c];
+					}
+				}
+
+				for (int c = 0; c < step; c++)
+				{
+					out[x * step + c] = acc[c] >> TAP_SHIFT;
+				}
+			}
+		}
+	});
+
+	parallel_rows(height, [&](const Band & band)					// Vertical pass, row at a time
+	{
+		vector<int> acc(bytes);
+
+		for (int y = band.first; y < band.last; y++)
+		{
+			const int * w = &lines.weights[(size_t) y * lines.taps];
+
+			for (int i = 0; i < bytes; i++)
+			{
+				acc[i] = TAP_ONE / 2;
+			}
+
+			for (int k = 0; k < lines.taps; k++)
+			{
+				int sy = lines.first[y] + k;
+				sy = sy < 0 ? 0 : sy >= sourceHeight ? sourceHeight - 1 : sy;
+				const int16_t * in = &horizontal[(size_t) sy * bytes];
+				int weight = w[k];
+
+				for (int i = 0; i < bytes; i++)
+				{
+					acc[i] += weight * in[i];
+				}
+			}
+
+			uint8_t * out = rows[y].pixels;
+
+			for (int i = 0; i < bytes; i++)
+			{
+				int value = acc[i] >> TAP_SHIFT;
+				out[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+			}
+		}
+	});
+}
@@ -0,0 +1,15 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "bitmap.h"
+
+// Filters for arbitrary ratio resampling
+enum ResampleMode
+{
+	RESAMPLE_BILINEAR,			// Tent filter, radius 1
+	RESAMPLE_LANCZOS			// Lanczos windowed sinc, radius 3
+};
+
+void resample(Bitmap & b, int width, int height, ResampleMode mode);	// Resize to any size
+
+#endif
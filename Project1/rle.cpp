@@ -0,0 +1,214 @@
+#include "rle.h"
+#include <cstring>
+
+const int MAX_RUN = 255;			// Longest run one count byte can hold
+const int MIN_ABSOLUTE = 3;			// Shorter absolute runs would read as escapes
+const int TABLE_BITS = 10;			// Color table slots, four per palette entry
+const uint32_t EMPTY = 0xffffffff;		// Never a 24 bit color
+
+// Store a palette color at (x, y) if it lies inside the image
+// INPUT: Takes the rows, the position and the color
+// OUTPUT: Does not return
+static inline void put(PixelRows & rows, int x, int y, uint32_t color)
+{
+	if (x < rows.width() && y < rows.height())
+	{
+		PixelRow row = rows[y];
+
+		row.b(x) = color;
+		row.g(x) = color >> 8;
+		row.r(x) = color >> 16;
+	}
+}
+
+// Decode RLE8 or RLE4 pixel data into rows
+// INPUT: Takes the data, its length, the bits per index, the palette and the rows to fill
+// OUTPUT: Returns false if the data is malformed
+bool rle_decode(const uint8_t * data, size_t length, int bits, const uint32_t * palette, PixelRows rows)
+{
+	int x = 0;
+	int y = 0;
+	size_t i = 0;
+
+	while (i + 1 < length && y < rows.height())
+	{
+		int count = data[i];
+		int value = data[i + 1];
+		i += 2;
+
+		if (count > 0)								// Encoded run of one index or two alternating nibbles
+		{
+			uint32_t first = palette[bits == 8 ? value : value >> 4];
+			uint32_t second = palette[bits == 8 ? value : value & 15];
+
+			for (int k = 0; k < count; k++, x++)
+			{
+				put(rows, x, y, k & 1 ? second : first);
+			}
+		}
+		else if (value == 0)							// End of line
+		{
+			x = 0;
+			y++;
+		}
+		else if (value == 1)							// End of bitmap
+		{
+			return true;
+		}
+		else if (value == 2)							// Delta
+		{
+			if (i + 1 >= length)
+			{
+				return false;
+			}
+
+			x += data[i];
+			y += data[i + 1];
+			i += 2;
+		}
+		else									// Absolute run of value indices
+		{
+			size_t bytes = bits == 8 ? value : (value + 1) / 2;
+
+			if (i + bytes > length)
+			{
+				return false;
+			}
+
+			for (int k = 0; k < value; k++, x++)
+			{
+				int index = bits == 8 ? data[i + k] : k & 1 ? data[i + k / 2] & 15 : data[i + k / 2] >> 4;
+				put(rows, x, y, palette[index]);
+			}
+
+			i += (bytes + 1) & ~(size_t) 1;					// Runs are padded to 16 bits
+		}
+	}
+
+	return true;
+}
+
+// Collect the palette of the rows and each pixel's index
+// The table is open addressed and never more than a quarter full, so
+// nearly every pixel is found by its first probe and the loop hardly
+// branches; the table stays in L1.
+// INPUT: Takes the rows, a vector to receive the palette and one to receive the indices
+// OUTPUT: Returns false if there are more than 256 colors
+bool build_palette(PixelRows rows, vector<uint32_t> & palette, vector<uint8_t> & indices)
+{
+	vector<uint32_t> keys(1 << TABLE_BITS, EMPTY);
+	vector<uint8_t> values(1 << TABLE_BITS);
+
+	palette.clear();
+	indices.resize((size_t) rows.width() * rows.height());
+
+	for (int y = 0; y < rows.height(); y++)
+	{
+		PixelRow row = rows[y];
+		uint8_t * out = &indices[(size_t) y * rows.width()];
+
+		for (int x = 0; x < rows.width(); x++)
+		{
+			uint32_t color = row.b(x) | row.g(x) << 8 | row.r(x) << 16;
+
+			uint32_t slot = (color * 2654435761u) >> (32 - TABLE_BITS);	// Fibonacci hash
+
+			while (keys[slot] != color)
+			{
+				if (keys[slot] == EMPTY)					// New color
+				{
+					if (palette.size() == 256)
+					{
+						return false;
+					}
+
+					keys[slot] = color;
+					values[slot] = palette.size();
+					palette.push_back(color);
+					break;
+				}
+
+				slot = (slot + 1) & ((1 << TABLE_BITS) - 1);
+			}
+
+			out[x] = values[slot];
+		}
+	}
+
+	return true;
+}
+
+// Encode rows of palette indices as RLE8
+// The output is sized for the worst case (every pixel a run of one) up
+// front and trimmed at the end, so codes are stored without checks
+// INPUT: Takes the indices, the width, the height and a vector to append to
+// OUTPUT: Does not return
+void rle8_encode(const uint8_t * indices, int width, int height, vector<uint8_t> & out)
+{
+	size_t used = out.size();
+	out.resize(used + ((size_t) width * 2 + 2) * height + 2);
+	uint8_t * q = out.data() + used;
+
+	for (int y = 0; y < height; y++)
+	{
+		const uint8_t * p = indices + (size_t) y * width;
+		int x = 0;
+
+		while (x < width)
+		{
+			int run = 1;
+
+			while (x + run < width && run < MAX_RUN && p[x + run] == p[x])
+			{
+				run++;
+			}
+
+			if (run > 1)							// Encoded run
+			{
+				*q++ = run;
+				*q++ = p[x];
+				x += run;
+				continue;
+			}
+
+			int start = x;							// Literals up to the next repeat of three
+
+			while (x < width && x - start < MAX_RUN
+			       && !(x + 2 < width && p[x] == p[x + 1] && p[x] == p[x + 2]))
+			{
+				x++;
+			}
+
+			int count = x - start;
+
+			if (count < MIN_ABSOLUTE)					// Too short for absolute mode
+			{
+				for (int k = start; k < x; k++)
+				{
+					*q++ = 1;
+					*q++ = p[k];
+				}
+			}
+			else
+			{
+				*q++ = 0;
+				*q++ = count;
+				memcpy(q, p + start, count);
+				q += count;
+
+				if (count & 1)						// Pad to 16 bits
+				{
+					*q++ = 0;
+				}
+			}
+		}
+
+		*q++ = 0;								// End of line
+		*q++ = 0;
+	}
+
+	*q++ = 0;									// End of bitmap
+	*q++ = 1;
+
+	out.resize(q - out.data());
+}
@@ -0,0 +1,27 @@
+#ifndef RLE_H
+#define RLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "bitmap.h"
+
+// Decode BI_RLE8 (bits = 8) or BI_RLE4 (bits = 4) pixel data into rows
+// The stream is walked once from the front and rows are filled as they
+// are reached, so no index image is kept. The palette holds 2^bits
+// colors as 0x00RRGGBB. Pixels skipped by delta escapes or end of line
+// codes are left as they are; a stream that stops early is accepted.
+// Returns false if an escape runs past the end of the data.
+bool rle_decode(const uint8_t * data, size_t length, int bits, const uint32_t * palette, PixelRows rows);
+
+// Collect the distinct colors of the rows as 0x00RRGGBB, with the
+// palette index of every pixel row by row (alpha is ignored)
+// Returns false as soon as there are more than 256 colors
+bool build_palette(PixelRows rows, vector<uint32_t> & palette, vector<uint8_t> & indices);
+
+// Encode rows of palette indices as BI_RLE8
+// Repeats become encoded runs and everything else absolute runs; each
+// row ends with an end of line code and the data with end of bitmap
+void rle8_encode(const uint8_t * indices, int width, int height, vector<uint8_t> & out);
+
+#endif
@@ -0,0 +1,668 @@
+#include "simd.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+// Pick the widest instruction set the processor supports
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a SimdLevel
+static SimdLevel detect_simd_level()
+{
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return SIMD_AVX2;
+	}
+
+	if (__builtin_cpu_supports("sse4.1"))
+	{
+		return SIMD_SSE41;
+	}
+#endif
+
+	return SIMD_SCALAR;
+}
+
+static const SimdLevel detectedLevel = detect_simd_level();			// Resolved once at startup
+
+// Returns the instruction set level chosen at startup
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a SimdLevel
+SimdLevel simd_level()
+{
+	return detectedLevel;
+}
+
+// Returns a printable name for an instruction set level
+// INPUT: Takes a SimdLevel
+// OUTPUT: Returns a C string
+const char * simd_name(SimdLevel level)
+{
+	switch (level)
+	{
+		case SIMD_AVX2:		return "avx2";
+		case SIMD_SSE41:	return "sse4.1";
+		default:		return "scalar";
+	}
+}
+
+// Returns the fixed point weights for a gray mode
+// Average uses 21846 / 65536, which gives exactly (r + g + b) / 3 for all
+// component values; the luma weights are 8 bit and sum to 256
+// INPUT: Takes a GrayMode
+// OUTPUT: Returns a GrayWeights
+GrayWeights gray_weights(GrayMode mode)
+{
+	switch (mode)
+	{
+		case GRAY_BT601:	return {77, 150, 29, 128, 8};
+		case GRAY_BT709:	return {54, 183, 19, 128, 8};
+		default:		return {21846, 21846, 21846, 0, 16};
+	}
+}
+
+// Scalar gray conversion of the pixels [first, last) of a row
+// INPUT: Takes a row, the pixel range, the layout and the weights
+// OUTPUT: Does not return
+static void gray_pixels(uint8_t * row, int first, int last, const RuntimeFormat & layout, const GrayWeights & w)
+{
+	for (int x = first; x < last; x++)
+	{
+		uint8_t * p = row + x * layout.step;
+		uint8_t value = (p[layout.red] * w.red + p[layout.green] * w.green + p[layout.blue] * w.blue + w.bias) >> w.shift;
+
+		p[layout.red] = value;
+		p[layout.green] = value;
+		p[layout.blue] = value;
+	}
+}
+
+#ifdef SIMD_X86
+
+// Constants shared by the vector kernels, one pixel per 32 bit lane
+struct GrayVectors
+{
+	__m128i red;				// Channel weights
+	__m128i green;
+	__m128i blue;
+	__m128i bias;
+	__m128i shift;				// Shift count for _mm_srl_epi32
+	__m128i byteMask;			// 0xff in every lane
+	__m128i keep;				// Bytes of a pixel that are not color channels
+	__m128i spread;				// Multiplier copying gray into the channel bytes
+	__m128i unpack;				// BGR24: 4 pixels from 12 bytes into 4 lanes
+	__m128i pack;				// BGR24: 4 lanes back into 12 bytes
+	__m128i tail;				// BGR24: last 4 bytes of a 16 byte load
+};
+
+// Build the vector constants for a layout and weights
+// INPUT: Takes the layout and the weights
+// OUTPUT: Returns a GrayVectors
+static GrayVectors gray_vectors(const RuntimeFormat & layout, const GrayWeights & w)
+{
+	GrayVectors v;
+	uint32_t channels = (0xffu << (8 * layout.red)) | (0xffu << (8 * layout.green)) | (0xffu << (8 * layout.blue));
+	uint32_t spread = (1u << (8 * layout.red)) | (1u << (8 * layout.green)) | (1u << (8 * layout.blue));
+
+	v.red = _mm_set1_epi32(w.red);
+	v.green = _mm_set1_epi32(w.green);
+	v.blue = _mm_set1_epi32(w.blue);
+	v.bias = _mm_set1_epi32(w.bias);
+	v.shift = _mm_cvtsi32_si128(w.shift);
+	v.byteMask = _mm_set1_epi32(0xff);
+	v.keep = _mm_set1_epi32(layout.step == 4 ? (int) ~channels : 0);
+	v.spread = _mm_set1_epi32(spread);
+	v.unpack = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	v.pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	v.tail = _mm_setr_epi32(0, 0, 0, -1);
+
+	return v;
+}
+
+// Gray four pixels held one per 32 bit lane
+// INPUT: Takes the pixels, the vector constants and the layout
+// OUTPUT: Returns the pixels with gray channel bytes
+__attribute__((target("sse4.1")))
+static inline __m128i gray4(__m128i pixels, const GrayVectors & v, const RuntimeFormat & layout)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(pixels, 8 * layout.red), v.byteMask);		// Split channels
+	__m128i g = _mm_and_si128(_mm_srli_epi32(pixels, 8 * layout.green), v.byteMask);
+	__m128i b = _mm_and_si128(_mm_srli_epi32(pixels, 8 * layout.blue), v.byteMask);
+
+	__m128i sum = _mm_add_epi32(_mm_mullo_epi32(r, v.red), _mm_mullo_epi32(g, v.green));	// Weighted sum
+	sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_mullo_epi32(b, v.blue), v.bias));
+
+	__m128i gray = _mm_srl_epi32(sum, v.shift);
+
+	return _mm_or_si128(_mm_and_si128(pixels, v.keep), _mm_mullo_epi32(gray, v.spread));
+}
+
+// Gray eight pixels held one per 32 bit lane
+// INPUT: Takes the pixels, the vector constants and the layout
+// OUTPUT: Returns the pixels with gray channel bytes
+__attribute__((target("avx2")))
+static inline __m256i gray8(__m256i pixels, const GrayVectors & v, const RuntimeFormat & layout)
+{
+	__m256i mask = _mm256_broadcastsi128_si256(v.byteMask);
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(pixels, 8 * layout.red), mask);		// Split channels
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(pixels, 8 * layout.green), mask);
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(pixels, 8 * layout.blue), mask);
+
+	__m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_broadcastsi128_si256(v.red)),	// Weighted sum
+	                               _mm256_mullo_epi32(g, _mm256_broadcastsi128_si256(v.green)));
+	sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_broadcastsi128_si256(v.blue)),
+	                                             _mm256_broadcastsi128_si256(v.bias)));
+
+	__m256i gray = _mm256_srl_epi32(sum, v.shift);
+	__m256i kept = _mm256_and_si256(pixels, _mm256_broadcastsi128_si256(v.keep));
+
+	return _mm256_or_si256(kept, _mm256_mullo_epi32(gray, _mm256_broadcastsi128_si256(v.spread)));
+}
+
+// SSE4.1 gray conversion of one row
+// 24 bit rows are processed 4 pixels at a time from 16 byte loads that
+// never reach past the row's last pixel byte
+// INPUT: Takes a row, its width, the layout and the vector constants
+// OUTPUT: Returns the number of pixels converted
+__attribute__((target("sse4.1")))
+static int gray_row_sse41(uint8_t * row, int width, const RuntimeFormat & layout, const GrayVectors & v)
+{
+	int x = 0;
+
+	if (layout.step == 4)
+	{
+		for (; x + 4 <= width; x += 4)
+		{
+			__m128i * p = (__m128i *) (row + x * 4);
+			_mm_storeu_si128(p, gray4(_mm_loadu_si128(p), v, layout));
+		}
+	}
+	else
+	{
+		for (; x + 6 <= width; x += 4)
+		{
+			__m128i * p = (__m128i *) (row + x * 3);
+			__m128i bytes = _mm_loadu_si128(p);
+			__m128i gray = _mm_shuffle_epi8(gray4(_mm_shuffle_epi8(bytes, v.unpack), v, layout), v.pack);
+			_mm_storeu_si128(p, _mm_or_si128(gray, _mm_and_si128(bytes, v.tail)));
+		}
+	}
+
+	return x;
+}
+
+// AVX2 gray conversion of one row, finished by the SSE4.1 path
+// INPUT: Takes a row, its width, the layout and the vector constants
+// OUTPUT: Returns the number of pixels converted
+__attribute__((target("avx2")))
+static int gray_row_avx2(uint8_t * row, int width, const RuntimeFormat & layout, const GrayVectors & v)
+{
+	int x = 0;
+
+	if (layout.step == 4)
+	{
+		for (; x + 8 <= width; x += 8)
+		{
+			__m256i * p = (__m256i *) (row + x * 4);
+			_mm256_storeu_si256(p, gray8(_mm256_loadu_si256(p), v, layout));
+		}
+	}
+	else
+	{
+		__m256i unpack = _mm256_broadcastsi128_si256(v.unpack);
+		__m256i pack = _mm256_broadcastsi128_si256(v.pack);
+
+		for (; x + 10 <= width; x += 8)
+		{
+			__m128i * low = (__m128i *) (row + x * 3);			// Pixels x .. x + 3
+			__m128i * high = (__m128i *) (row + x * 3 + 12);		// Pixels x + 4 .. x + 7
+			__m128i lowBytes = _mm_loadu_si128(low);
+			__m128i highBytes = _mm_loadu_si128(high);
+
+			__m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(lowBytes), highBytes, 1);
+			__m256i gray = _mm256_shuffle_epi8(gray8(_mm256_shuffle_epi8(bytes, unpack), v, layout), pack);
+
+			_mm_storeu_si128(low, _mm256_castsi256_si128(gray));		// Low first, high rewrites its tail
+			_mm_storeu_si128(high, _mm_or_si128(_mm256_extracti128_si256(gray, 1), _mm_and_si128(highBytes, v.tail)));
+		}
+	}
+
+	return x + gray_row_sse41(row + x * layout.step, width - x, layout, v);
+}
+
+
+// Shuffle masks between four pixels of a file layout and four BGRA32
+// pixels, plus the bytes to set after expanding
+struct ConvertVectors
+{
+	__m128i expand;				// File bytes into BGRA lanes
+	__m128i pack;				// BGRA lanes back into file bytes
+	__m128i fill;				// Opaque alpha for 24 bit layouts
+};
+
+// Build the shuffle masks for a layout
+// INPUT: Takes the file layout
+// OUTPUT: Returns a ConvertVectors
+static ConvertVectors convert_vectors(const RuntimeFormat & layout)
+{
+	int8_t expand[16];
+	int8_t pack[16];
+	int alpha = 6 - layout.red - layout.green - layout.blue;			// The byte left over in a 32 bit pixel
+	int s = layout.step;
+
+	memset(pack, -1, sizeof(pack));
+
+	for (int i = 0; i < 4; i++)
+	{
+		expand[4 * i] = s * i + layout.blue;
+		expand[4 * i + 1] = s * i + layout.green;
+		expand[4 * i + 2] = s * i + layout.red;
+		expand[4 * i + 3] = s == 4 ? 4 * i + alpha : -1;
+
+		pack[s * i + layout.blue] = 4 * i;
+		pack[s * i + layout.green] = 4 * i + 1;
+		pack[s * i + layout.red] = 4 * i + 2;
+
+		if (s == 4)
+		{
+			pack[4 * i + alpha] = 4 * i + 3;
+		}
+	}
+
+	ConvertVectors v;
+	v.expand = _mm_loadu_si128((const __m128i *) expand);
+	v.pack = _mm_loadu_si128((const __m128i *) pack);
+	v.fill = _mm_set1_epi32(s == 3 ? (int) 0xff000000 : 0);
+
+	return v;
+}
+
+// SSE4.1 expansion of one row, 4 pixels per shuffle
+// 24 bit loads stop short of reading past the row's last pixel byte
+// INPUT: Takes the source and destination rows, the width, the layout and the masks
+// OUTPUT: Returns the number of pixels converted
+__attribute__((target("sse4.1")))
+static int expand_row_sse41(const uint8_t * source, uint8_t * destination, int width, int step, const ConvertVectors & v)
+{
+	int x = 0;
+
+	for (; x + (step == 4 ? 4 : 6) <= width; x += 4)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (source + x * step));
+		_mm_storeu_si128((__m128i *) (destination + x * 4), _mm_or_si128(_mm_shuffle_epi8(bytes, v.expand), v.fill));
+	}
+
+	return x;
+}
+
+// SSE4.1 packing of one row, 4 pixels per shuffle
+// 24 bit stores write 4 zero bytes past the pixels, which the next store
+// overwrites, so they also stop short of the row's end
+// INPUT: Takes the source and destination rows, the width, the layout and the masks
+// OUTPUT: Returns the number of pixels converted
+__attribute__((target("sse4.1")))
+static int pack_row_sse41(const uint8_t * source, uint8_t * destination, int width, int step, const ConvertVectors & v)
+{
+	int x = 0;
+
+	for (; x + (step == 4 ? 4 : 6) <= width; x += 4)
+	{
+		__m128i pixels = _mm_loadu_si128((const __m128i *) (source + x * 4));
+		_mm_storeu_si128((__m128i *) (destination + x * step), _mm_shuffle_epi8(pixels, v.pack));
+	}
+
+	return x;
+}
+
+// AVX2 expansion of one row, finished by the SSE4.1 path
+// 24 bit rows take the two lanes from loads 12 bytes apart
+// INPUT: Takes the source and destination rows, the width, the layout and the masks
+// OUTPUT: Returns the number of pixels converted
+__attribute__((target("avx2")))
+static int expand_row_avx2(const uint8_t * source, uint8_t * destination, int width, int step, const ConvertVectors & v)
+{
+	__m256i expand = _mm256_broadcastsi128_si256(v.expand);
+	__m256i fill = _mm256_broadcastsi128_si256(v.fill);
+	int x = 0;
+
+	for (; x + (step == 4 ? 8 : 10) <= width; x += 8)
+	{
+		const uint8_t * p = source + x * step;
+		__m128i low = _mm_loadu_si128((const __m128i *) p);			// Pixels x .. x + 3
+		__m128i high = _mm_loadu_si128((const __m128i *) (p + 4 * step));	// Pixels x + 4 .. x + 7
+		__m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+
+		_mm256_storeu_si256((__m256i *) (destination + x * 4), _mm256_or_si256(_mm256_shuffle_epi8(bytes, expand), fill));
+	}
+
+	return x + expand_row_sse41(source + x * step, destination + x * 4, width - x, step, v);
+}
+
+// AVX2 packing of one row, finished by the SSE4.1 path
+// INPUT: Takes the source and destination rows, the width, the layout and the masks
+// OUTPUT: Returns the number of pixels converted
+__attribute__((target("avx2")))
+static int pack_row_avx2(const uint8_t * source, uint8_t * destination, int width, int step, const ConvertVectors & v)
+{
+	__m256i pack = _mm256_broadcastsi128_si256(v.pack);
+	int x = 0;
+
+	for (; x + (step == 4 ? 8 : 10) <= width; x += 8)
+	{
+		__m256i bytes = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (source + x * 4)), pack);
+		uint8_t * p = destination + x * step;
+
+		_mm_storeu_si128((__m128i *) p, _mm256_castsi256_si128(bytes));		// Low first, high rewrites its tail
+		_mm_storeu_si128((__m128i *) (p + 4 * step), _mm256_extracti128_si256(bytes, 1));
+	}
+
+	return x + pack_row_sse41(source + x * 4, destination + x * step, width - x, step, v);
+}
+
+// SSE4.1 multiply-accumulate of bytes, 16 per iteration
+// INPUT: Takes the sums, the source, the weight and the count
+// OUTPUT: Returns the number of elements done
+__attribute__((target("sse4.1")))
+static int mac_bytes_sse41(int32_t * sums, const uint8_t * source, int weight, int count)
+{
+	__m128i w = _mm_set1_epi32(weight);
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (source + i));
+		__m128i wide[4] = {_mm_cvtepu8_epi32(bytes), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)),
+		                   _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8)), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12))};
+
+		for (int k = 0; k < 4; k++)
+		{
+			__m128i * p = (__m128i *) (sums + i + 4 * k);
+			_mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), _mm_mullo_epi32(wide[k], w)));
+		}
+	}
+
+	return i;
+}
+
+// AVX2 multiply-accumulate of bytes, 16 per iteration
+// INPUT: Takes the sums, the source, the weight and the count
+// OUTPUT: Returns the number of elements done
+__attribute__((target("avx2")))
+static int mac_bytes_avx2(int32_t * sums, const uint8_t * source, int weight, int count)
+{
+	__m256i w = _mm256_set1_epi32(weight);
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (source + i));
+		__m256i * low = (__m256i *) (sums + i);
+		__m256i * high = (__m256i *) (sums + i + 8);
+
+		_mm256_storeu_si256(low, _mm256_add_epi32(_mm256_loadu_si256(low), _mm256_mullo_epi32(_mm256_cvtepu8_epi32(bytes), w)));
+		_mm256_storeu_si256(high, _mm256_add_epi32(_mm256_loadu_si256(high),
+		                                           _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)), w)));
+	}
+
+	return i;
+}
+
+// SSE4.1 multiply-accumulate of 32 bit values, 4 per iteration
+// INPUT: Takes the sums, the source, the weight and the count
+// OUTPUT: Returns the number of elements done
+__attribute__((target("sse4.1")))
+static int mac_ints_sse41(int32_t * sums, const int32_t * source, int weight, int count)
+{
+	__m128i w = _mm_set1_epi32(weight);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i * p = (__m128i *) (sums + i);
+		__m128i values = _mm_loadu_si128((const __m128i *) (source + i));
+		_mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), _mm_mullo_epi32(values, w)));
+	}
+
+	return i;
+}
+
+// AVX2 multiply-accumulate of 32 bit values, 8 per iteration
+// INPUT: Takes the sums, the source, the weight and the count
+// OUTPUT: Returns the number of elements done
+__attribute__((target("avx2")))
+static int mac_ints_avx2(int32_t * sums, const int32_t * source, int weight, int count)
+{
+	__m256i w = _mm256_set1_epi32(weight);
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i * p = (__m256i *) (sums + i);
+		__m256i values = _mm256_loadu_si256((const __m256i *) (source + i));
+		_mm256_storeu_si256(p, _mm256_add_epi32(_mm256_loadu_si256(p), _mm256_mullo_epi32(values, w)));
+	}
+
+	return i;
+}
+
+// SSE4.1 rounding and saturating store, 16 bytes per iteration
+// The shift is arithmetic, so negative sums round the same way as in C++
+// INPUT: Takes the sums, the destination, the count, the shift and the offset
+// OUTPUT: Returns the number of elements done
+__attribute__((target("sse4.1")))
+static int saturate_row_sse41(const int32_t * sums, uint8_t * destination, int count, int shift, int offset)
+{
+	__m128i half = _mm_set1_epi32(shift > 0 ? 1 << (shift - 1) : 0);
+	__m128i add = _mm_set1_epi32(offset);
+	__m128i bits = _mm_cvtsi32_si128(shift);
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i v[4];
+
+		for (int k = 0; k < 4; k++)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *) (sums + i + 4 * k));
+			v[k] = _mm_add_epi32(_mm_sra_epi32(_mm_add_epi32(s, half), bits), add);
+		}
+
+		__m128i words = _mm_packs_epi32(v[0], v[1]);				// Saturate to 16 bits, then 8
+		_mm_storeu_si128((__m128i *) (destination + i), _mm_packus_epi16(words, _mm_packs_epi32(v[2], v[3])));
+	}
+
+	return i;
+}
+
+// AVX2 rounding and saturating store, 32 bytes per iteration
+// The packs work within 128 bit lanes, so a final permute puts the
+// eight groups of four back in order
+// INPUT: Takes the sums, the destination, the count, the shift and the offset
+// OUTPUT: Returns the number of elements done
+__attribute__((target("avx2")))
+static int saturate_row_avx2(const int32_t * sums, uint8_t * destination, int count, int shift, int offset)
+{
+	__m256i half = _mm256_set1_epi32(shift > 0 ? 1 << (shift - 1) : 0);
+	__m256i add = _mm256_set1_epi32(offset);
+	__m128i bits = _mm_cvtsi32_si128(shift);
+	__m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	int i = 0;
+
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i v[4];
+
+		for (int k = 0; k < 4; k++)
+		{
+			__m256i s = _mm256_loadu_si256((const __m256i *) (sums + i + 8 * k));
+			v[k] = _mm256_add_epi32(_mm256_sra_epi32(_mm256_add_epi32(s, half), bits), add);
+		}
+
+		__m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(v[0], v[1]), _mm256_packs_epi32(v[2], v[3]));
+		_mm256_storeu_si256((__m256i *) (destination + i), _mm256_permutevar8x32_epi32(bytes, order));
+	}
+
+	return i + saturate_row_sse41(sums + i, destination + i, count - i, shift, offset);
+}
+
+#endif
+
+// Convert whole rows to gray with the best available instruction set
+// INPUT: Takes the rows of a bitmap, its layout and the gray weights
+// OUTPUT: Returns false if no vector path applies
+bool gray_rows_simd(PixelRows rows, RuntimeFormat layout, const GrayWeights & weights)
+{
+#ifdef SIMD_X86
+	if (detectedLevel == SIMD_SCALAR)
+	{
+		return false;
+	}
+
+	GrayVectors v = gray_vectors(layout, weights);
+
+	for (int y = 0; y < rows.height(); y++)
+	{
+		uint8_t * row = rows[y].pixels;
+		int done = detectedLevel == SIMD_AVX2 ? gray_row_avx2(row, rows.width(), layout, v)
+		                                      : gray_row_sse41(row, rows.width(), layout, v);
+
+		gray_pixels(row, done, rows.width(), layout, weights);			// Scalar tail
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Expand one row of a file layout into BGRA32
+// INPUT: Takes the source and destination rows, the width and the file layout
+// OUTPUT: Does not return
+void expand_row(const uint8_t * source, uint8_t * destination, int width, const RuntimeFormat & layout)
+{
+	int x = 0;
+	int alpha = 6 - layout.red - layout.green - layout.blue;
+
+#ifdef SIMD_X86
+	if (detectedLevel != SIMD_SCALAR)
+	{
+		ConvertVectors v = convert_vectors(layout);
+		x = detectedLevel == SIMD_AVX2 ? expand_row_avx2(source, destination, width, layout.step, v)
+		                               : expand_row_sse41(source, destination, width, layout.step, v);
+	}
+#endif
+
+	for (; x < width; x++)								// Scalar tail
+	{
+		const uint8_t * p = source + x * layout.step;
+		uint8_t * q = destination + x * 4;
+
+		q[0] = p[layout.blue];
+		q[1] = p[layout.green];
+		q[2] = p[layout.red];
+		q[3] = layout.step == 4 ? p[alpha] : 255;
+	}
+}
+
+// Pack one row of BGRA32 back into a file layout
+// INPUT: Takes the source and destination rows, the width and the file layout
+// OUTPUT: Does not return
+void pack_row(const uint8_t * source, uint8_t * destination, int width, const RuntimeFormat & layout)
+{
+	int x = 0;
+	int alpha = 6 - layout.red - layout.green - layout.blue;
+
+#ifdef SIMD_X86
+	if (detectedLevel != SIMD_SCALAR)
+	{
+		ConvertVectors v = convert_vectors(layout);
+		x = detectedLevel == SIMD_AVX2 ? pack_row_avx2(source, destination, width, layout.step, v)
+		                               : pack_row_sse41(source, destination, width, layout.step, v);
+	}
+#endif
+
+	for (; x < width; x++)								// Scalar tail
+	{
+		const uint8_t * p = source + x * 4;
+		uint8_t * q = destination + x * layout.step;
+
+		q[layout.blue] = p[0];
+		q[layout.green] = p[1];
+		q[layout.red] = p[2];
+
+		if (layout.step == 4)
+		{
+			q[alpha] = p[3];
+		}
+	}
+}
+
+// Multiply-accumulate one row of bytes into 32 bit sums
+// INPUT: Takes the sums, the source bytes, the weight and the count
+// OUTPUT: Does not return
+void mac_row(int32_t * sums, const uint8_t * source, int weight, int count)
+{
+	int i = 0;
+
+#ifdef SIMD_X86
+	if (detectedLevel != SIMD_SCALAR)
+	{
+		i = detectedLevel == SIMD_AVX2 ? mac_bytes_avx2(sums, source, weight, count)
+		                               : mac_bytes_sse41(sums, source, weight, count);
+	}
+#endif
+
+	for (; i < count; i++)								// Scalar tail
+	{
+		sums[i] += weight * source[i];
+	}
+}
+
+// Multiply-accumulate one row of 32 bit values into 32 bit sums
+// INPUT: Takes the sums, the source values, the weight and the count
+// OUTPUT: Does not return
+void mac_row(int32_t * sums, const int32_t * source, int weight, int count)
+{
+	int i = 0;
+
+#ifdef SIMD_X86
+	if (detectedLevel != SIMD_SCALAR)
+	{
+		i = detectedLevel == SIMD_AVX2 ? mac_ints_avx2(sums, source, weight, count)
+		                               : mac_ints_sse41(sums, source, weight, count);
+	}
+#endif
+
+	for (; i < count; i++)								// Scalar tail
+	{
+		sums[i] += weight * source[i];
+	}
+}
+
+// Round, offset and saturate one row of sums into bytes
+// INPUT: Takes the sums, the destination, the count, the shift and the offset
+// OUTPUT: Does not return
+void saturate_row(const int32_t * sums, uint8_t * destination, int count, int shift, int offset)
+{
+	int half = shift > 0 ? 1 << (shift - 1) : 0;
+	int i = 0;
+
+#ifdef SIMD_X86
+	if (detectedLevel != SIMD_SCALAR)
+	{
+		i = detectedLevel == SIMD_AVX2 ? saturate_row_avx2(sums, destination, count, shift, offset)
+		                               : saturate_row_sse41(sums, destination, count, shift, offset);
+	}
+#endif
+
+	for (; i < count; i++)								// Scalar tail
+	{
+		int value = ((sums[i] + half) >> shift) + offset;
+		destination[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include "bitmap.h"
+
+// Instruction set levels the vector kernels are built for
+enum SimdLevel
+{
+	SIMD_SCALAR,				// Plain C++ only
+	SIMD_SSE41,				// SSE4.1
+	SIMD_AVX2				// AVX2
+};
+
+SimdLevel simd_level();				// Level chosen by CPUID at startup
+const char * simd_name(SimdLevel);		// Printable name of a level
+
+// Fixed point channel weights for gray conversion
+// gray = (red * r + green * g + blue * b + bias) >> shift
+struct GrayWeights
+{
+	int red;
+	int green;
+	int blue;
+	int bias;
+	int shift;
+};
+
+GrayWeights gray_weights(GrayMode);		// Weights for a gray mode
+
+// Convert whole rows to gray with the best available instruction set
+// Returns false if no vector path applies, the caller then runs the scalar kernel
+bool gray_rows_simd(PixelRows rows, RuntimeFormat layout, const GrayWeights & weights);
+
+// Convert one row between a file layout and the normalized BGRA32 layout
+// Expanding a 24 bit row fills alpha with 255; packing drops it again.
+// 32 bit layouts have their channels and alpha reordered. Source and
+// destination must not overlap; row padding is left to the caller.
+void expand_row(const uint8_t * source, uint8_t * destination, int width, const RuntimeFormat & layout);
+void pack_row(const uint8_t * source, uint8_t * destination, int width, const RuntimeFormat & layout);
+
+// Integer multiply-accumulate across a row: sums[i] += weight * source[i]
+void mac_row(int32_t * sums, const uint8_t * source, int weight, int count);
+void mac_row(int32_t * sums, const int32_t * source, int weight, int count);
+
+// Store sums[i] / 2^shift, rounded to nearest, plus offset as bytes
+// Results outside 0 .. 255 saturate, as the vector packs do
+void saturate_row(const int32_t * sums, uint8_t * destination, int count, int shift, int offset);
+
+#endif
@@ -0,0 +1,107 @@
+#include "stream.h"
+#include <cstdlib>
+#include <fstream>
+#include "profile.h"
+
+const int WORKING_COPIES = 5;			// Band pixels plus the widest filter scratch (box blur keeps 4 bytes per byte)
+
+// Run a pipeline over a bitmap file band by band
+// Bands start on the chain's alignment so block filters see whole blocks,
+// and the rows read around them are the band plus the chain's halo on
+// both sides; rows spoiled by the band's cut edges never reach the output
+// INPUT: Takes the input and output file names, the pipeline and the
+// memory budget in bytes
+// OUTPUT: Returns false if the file could not be streamed
+bool stream_file(const string & infile, const string & outfile, const Pipeline & pipeline, size_t budget)
+{
+	if (!pipeline.streamable())
+	{
+		cout << "Error: rotations, vertical flips, resizes and whole image filters cannot run in streaming mode" << endl;
+		return false;
+	}
+
+	ifstream in(infile, ios::binary);
+	Bitmap header;
+
+	if (!in || !header.read_header(in))
+	{
+		cout << "Error: could not read " << infile << endl;
+		return false;
+	}
+
+	if (header.compressed())
+	{
+		cout << "Error: RLE bitmaps cannot be read in streaming mode" << endl;
+		return false;
+	}
+
+	int width = header.get_width();
+	int height = abs(header.get_height());						// Top down files stream in file order too
+	size_t stride = header.get_stride();
+	int halo = pipeline.halo();
+	int alignment = pipeline.alignment();
+
+	long long windowRows = budget / (stride * WORKING_COPIES);			// Rows that fit in the budget
+	long long bandRows = (windowRows - 2 * halo - alignment) / alignment * alignment;	// Aligning the top costs up to alignment rows
+
+	if (bandRows < 1)
+	{
+		size_t needed = (size_t) (2 * halo + 2 * alignment) * stride * WORKING_COPIES;
+		cout << "Error: streaming budget too small, this chain needs at least " << (needed >> 20) + 1 << " MB" << endl;
+		return false;
+	}
+
+	ofstream out(outfile, ios::binary | ios::trunc);
+
+	if (!out)
+	{
+		cout << "Error: could not write " << outfile << endl;
+		return false;
+	}
+
+	header.write_header(out);
+
+	Bitmap band(header);
+	size_t offset = header.pixel_offset();
+	int rows = -1;									// Rows the band bitmap holds
+
+	for (int first = 0; first < height; first += bandRows)
+	{
+		int last = first + bandRows < height ? first + bandRows : height;
+		int top = first - halo < 0 ? 0 : (first - halo) / alignment * alignment;	// Keep blocks aligned
+		int bottom = last + halo > height ? height : last + halo;
+
+		if (rows != bottom - top)
+		{
+			rows = bottom - top;
+			band.reshape(width, rows);
+		}
+
+		{
+			ProfileScope scope("read pixels", (size_t) (bottom - top) * stride);
+
+			in.seekg(offset + top * stride);
+			in.read((char *) band.row(0), (bottom - top) * stride);		// Band and halo in one read
+		}
+
+		if (!in)
+		{
+			cout << "Error: " << infile << " is truncated" << endl;
+			return false;
+		}
+
+		if (normalize_on_load())
+		{
+			band.normalize();
+		}
+
+		pipeline.run(band);
+		band.denormalize();							// Back to file rows for writing and the next read
+
+		ProfileScope scope("write", (size_t) (last - first) * stride);
+
+		out.write((const char *) band.row(first - top), (last - first) * stride);	// Inner rows only
+	}
+
+	return (bool) out.flush();
+}
@@ -0,0 +1,16 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <string>
+#include "pipeline.h"
+
+// Run a pipeline over a bitmap file band by band without loading it whole
+// Each band of rows is read together with the halo rows its neighborhood
+// filters need, filtered as an image of its own and its inner rows are
+// appended to the output, so memory is bounded by the budget rather than
+// the image size
+// Returns false if the chain cannot be streamed, the budget is too small
+// for one band or a file could not be read or written
+bool stream_file(const string & infile, const string & outfile, const Pipeline & pipeline, size_t budget);
+
+#endif
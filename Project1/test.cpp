@@ -0,0 +1,709 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "batch.h"
+#include "bitmap.h"
+#include "bufferpool.h"
+#include "convolve.h"
+#include "dither.h"
+#include "pipeline.h"
+#include "stream.h"
+#include "threadpool.h"
+
+static int failures = 0;			// Checks that did not hold
+
+// Report one check
+// INPUT: Takes the result and the name of the check
+// OUTPUT: Does not return
+static void check(bool passed, const string & name)
+{
+	cout << (passed ? "ok   " : "FAIL ") << name << endl;
+	failures += passed ? 0 : 1;
+}
+
+// Append a little endian value to a byte string
+// INPUT: Takes the string, the value and its size in bytes
+// OUTPUT: Does not return
+static void put(string & bytes, uint32_t value, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		bytes.push_back((char) (value >> (8 * i)));
+	}
+}
+
+// Build a BMP file in memory
+// Pixels are a gradient with pseudo random noise and alpha; a negative
+// height stores the same rows top down
+// INPUT: Takes the width, height and color depth (24 or 32)
+// OUTPUT: Returns the file bytes
+static string synthesize(int width, int height, int depth)
+{
+	int step = depth / 8;
+	int rows = height < 0 ? -height : height;
+	int stride = ((width * depth + 31) / 32) * 4;
+	uint32_t pixels = (uint32_t) stride * rows;
+	string bytes;
+
+	bytes += "BM";									// Header one
+	put(bytes, 14 + 40 + pixels, 4);
+	put(bytes, 0, 4);
+	put(bytes, 14 + 40, 4);
+
+	put(bytes, 40, 4);								// Header two
+	put(bytes, width, 4);
+	put(bytes, height, 4);
+	put(bytes, 1, 2);
+	put(bytes, depth, 2);
+	put(bytes, 0, 4);
+	put(bytes, pixels, 4);
+	put(bytes, 2835, 4);
+	put(bytes, 2835, 4);
+	put(bytes, 0, 4);
+	put(bytes, 0, 4);
+
+	uint32_t seed = 2463534242u;
+
+	for (int y = 0; y < rows; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			seed ^= seed << 13;						// xorshift32
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+
+			bytes.push_back((char) (x * 255 / width + (seed & 31)));	// Blue
+			bytes.push_back((char) (y * 255 / rows + (seed >> 8 & 31)));	// Green
+			bytes.push_back((char) ((x + y) * 127 / (width + rows) + (seed >> 16 & 63)));	// Red
+
+			if (step == 4)
+			{
+				bytes.push_back((char) (seed >> 24));			// Alpha
+			}
+		}
+
+		bytes.append(stride - width * step, '\0');				// Row padding
+	}
+
+	return bytes;
+}
+
+// Decode a BMP held in memory
+// INPUT: Takes the file bytes
+// OUTPUT: Returns a Bitmap
+static Bitmap decode(const string & bytes)
+{
+	istringstream in(bytes);
+	Bitmap b;
+	in >> b;
+
+	return b;
+}
+
+// Encode a bitmap as a BMP file in memory
+// INPUT: Takes a bitmap
+// OUTPUT: Returns the file bytes
+static string encode(const Bitmap & b)
+{
+	ostringstream out;
+	out << b;
+
+	return out.str();
+}
+
+// Pixel array of a BMP held in memory
+// INPUT: Takes the file bytes
+// OUTPUT: Returns the bytes after the pixel offset
+static string pixels_of(const string & bytes)
+{
+	size_t offset = (uint8_t) bytes[10] | (uint8_t) bytes[11] << 8;
+
+	return bytes.substr(offset);
+}
+
+// Height field of a BMP held in memory
+// INPUT: Takes the file bytes
+// OUTPUT: Returns the signed height
+static int height_of(const string & bytes)
+{
+	int32_t height;
+	memcpy(&height, &bytes[22], 4);
+
+	return height;
+}
+
+// Run command line options on a BMP held in memory
+// INPUT: Takes the file bytes and the options
+// OUTPUT: Returns the resulting file bytes
+static string run_options(const string & bytes, const vector<string> & options)
+{
+	Pipeline pipeline;
+
+	for (const string & option : options)
+	{
+		if (!pipeline.add(option))
+		{
+			return "";
+		}
+	}
+
+	pipeline.fuse();
+
+	Bitmap image = decode(bytes);
+	pipeline.run(image);
+
+	return encode(image);
+}
+
+// Build an 8 bit RLE file in memory with a two color palette
+// INPUT: Takes the width, height and the run length encoded data
+// OUTPUT: Returns the file bytes
+static string rle_file(int width, int height, const string & data)
+{
+	string bytes;
+
+	bytes += "BM";									// Header one
+	put(bytes, 14 + 40 + 8 + data.size(), 4);
+	put(bytes, 0, 4);
+	put(bytes, 14 + 40 + 8, 4);
+
+	put(bytes, 40, 4);								// Header two
+	put(bytes, width, 4);
+	put(bytes, height, 4);
+	put(bytes, 1, 2);
+	put(bytes, 8, 2);
+	put(bytes, BI_RLE8, 4);
+	put(bytes, data.size(), 4);
+	put(bytes, 2835, 4);
+	put(bytes, 2835, 4);
+	put(bytes, 2, 4);
+	put(bytes, 0, 4);
+
+	put(bytes, 0x000000, 4);							// Palette
+	put(bytes, 0xff8000, 4);
+
+	return bytes + data;
+}
+
+// Write bytes to a file
+// INPUT: Takes the file name and the bytes
+// OUTPUT: Does not return
+static void write_bytes(const string & name, const string & bytes)
+{
+	ofstream out(name, ios::binary | ios::trunc);
+	out << bytes;
+}
+
+// Read a whole file
+// INPUT: Takes the file name
+// OUTPUT: Returns the bytes, empty if the file could not be read
+static string read_bytes(const string & name)
+{
+	ifstream in(name, ios::binary);
+	ostringstream bytes;
+	bytes << in.rdbuf();
+
+	return bytes.str();
+}
+
+// Stream a BMP held in memory through a chain of options in row bands
+// INPUT: Takes the file bytes, the options and the memory budget in bytes
+// OUTPUT: Returns the resulting file bytes, empty if streaming failed
+static string stream_options(const string & bytes, const vector<string> & options, size_t budget)
+{
+	Pipeline pipeline;
+
+	for (const string & option : options)
+	{
+		if (!pipeline.add(option))
+		{
+			return "";
+		}
+	}
+
+	pipeline.fuse();
+	write_bytes("test_in.bmp", bytes);
+
+	string result = stream_file("test_in.bmp", "test_out.bmp", pipeline, budget) ? read_bytes("test_out.bmp") : "";
+
+	remove("test_in.bmp");
+	remove("test_out.bmp");
+
+	return result;
+}
+
+// Filters must see every row of a top down file, in file order
+// A filter that treats up and down alike gives the same pixel array for
+// the same rows stored either way, and the result stays top down
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_top_down()
+{
+	for (int depth : {24, 32})
+	{
+		string bottomUp = synthesize(37, 23, depth);
+		string topDown = synthesize(37, -23, depth);
+
+		for (string option : {"-i", "-g", "-c", "-h", "-v", "-p", "-b", "-box=3", "-median=2"})
+		{
+			string expected = run_options(bottomUp, {option});
+			string result = run_options(topDown, {option});
+			string name = "top down " + to_string(depth) + " bit " + option;
+
+			check(!result.empty() && height_of(result) == -23 && pixels_of(result) == pixels_of(expected), name);
+		}
+	}
+}
+
+// Rotations and resizes of a top down file
+// Rows run the other way in the file, so a turn of a top down image
+// moves its file rows as the opposite turn moves those of a bottom up one
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_top_down_geometry()
+{
+	vector<pair<string, string>> cases =
+	{
+		{"-r90", "-r270"}, {"-r270", "-r90"}, {"-d1", "-d2"}, {"-d2", "-d1"}, {"-r180", "-r180"},
+		{"-grow", "-grow"}, {"-shrink", "-shrink"}, {"-resize=20x9", "-resize=20x9"}
+	};
+
+	for (int depth : {24, 32})
+	{
+		string bottomUp = synthesize(37, 23, depth);
+		string topDown = synthesize(37, -23, depth);
+
+		for (auto & c : cases)
+		{
+			string expected = run_options(bottomUp, {c.second});
+			string result = run_options(topDown, {c.first});
+			string name = "top down " + to_string(depth) + " bit " + c.first;
+
+			check(!result.empty() && height_of(result) == -height_of(expected) && result.substr(18, 4) == expected.substr(18, 4)
+			      && pixels_of(result) == pixels_of(expected), name);
+		}
+	}
+}
+
+// Compile time kernels give the bytes of the run time kernel with the
+// same weights, for both factored and direct kernels
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+template <class K>
+static void test_fixed_kernel(const string & name)
+{
+	for (int depth : {24, 32})
+	{
+		for (int height : {23, -23})
+		{
+			Bitmap fixed = decode(synthesize(37, height, depth));
+			Bitmap runtime = decode(synthesize(37, height, depth));
+
+			convolve<K>(fixed);
+			convolve(runtime, kernel_of<K>());
+
+			check(encode(fixed) == encode(runtime), name + " " + to_string(depth) + " bit" + (height < 0 ? " top down" : ""));
+		}
+	}
+}
+
+// Pixelate blocks too big for 32 bit sums average correctly
+// A flat image over 4096 x 4096 pixels, as one block, must keep its color
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_pixelate_large()
+{
+	Bitmap image = decode(synthesize(4200, 4100, 24));
+	PixelRows rows = image.rows();
+
+	for (PixelRow row : rows)
+	{
+		for (int x = 0; x < row.width; x++)
+		{
+			row.b(x) = 255;
+			row.g(x) = 254;
+			row.r(x) = 7;
+		}
+	}
+
+	pixelate(image, 5000);
+	bool same = true;
+
+	for (PixelRow row : rows)
+	{
+		for (int x = 0; x < row.width; x++)
+		{
+			same = same && row.b(x) == 255 && row.g(x) == 254 && row.r(x) == 7;
+		}
+	}
+
+	check(same, "pixelate=5000 over 4200 x 4100");
+}
+
+// Tiles carry the halo around them, clipped to the area
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_tile_halo()
+{
+	for (int halo : {0, 5, 40, 1000})
+	{
+		mutex lock;
+		vector<int> covered(100 * 70, 0);
+		bool bounds = true;
+
+		parallel_tiles(100, 70, 32, [&](const Tile & tile)
+		{
+			lock_guard<mutex> hold(lock);
+
+			bounds = bounds && tile.left == max(tile.x - halo, 0) && tile.right == min(tile.x + tile.width + halo, 100)
+			         && tile.top == max(tile.y - halo, 0) && tile.bottom == min(tile.y + tile.height + halo, 70);
+
+			for (int y = tile.y; y < tile.y + tile.height; y++)
+			{
+				for (int x = tile.x; x < tile.x + tile.width; x++)
+				{
+					covered[y * 100 + x]++;
+				}
+			}
+		}, halo);
+
+		check(bounds && count(covered.begin(), covered.end(), 1) == (int) covered.size(), "tile halo " + to_string(halo));
+	}
+}
+
+// Sizes no block could hold are refused rather than rounded
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_pool_limits()
+{
+	size_t capacity = 1;
+
+	check(BufferPool::class_size(SIZE_MAX) == 0 && buffer_pool().acquire(SIZE_MAX - 100, capacity) == nullptr,
+	      "pool refuses impossible sizes");
+
+	BufferPool pool;
+	void * block = pool.acquire((size_t) 1 << 47, capacity);			// More than mmap will give
+
+	check(block == nullptr && pool.mapped() == 0, "pool counts only blocks it mapped");
+}
+
+// Streaming in row bands gives the whole image result, stored either way
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_stream()
+{
+	vector<vector<string>> chains = {{"-g"}, {"-b"}, {"-box=3", "-c"}, {"-median=2"}, {"-p", "-h"}, {"-sharpen"}};
+
+	for (int height : {150, -150})
+	{
+		string bytes = synthesize(200, height, 24);
+
+		for (auto & chain : chains)
+		{
+			string expected = run_options(bytes, chain);
+			string result = stream_options(bytes, chain, 256 << 10);
+			string name = string("stream ") + (height < 0 ? "top down " : "") + chain[0];
+
+			check(!result.empty() && result == expected, name);
+		}
+
+		for (string option : {"-rgauss=3", "-rgauss=8", "-equalize", "-c=floyd"})	// Refused, never different
+		{
+			string expected = run_options(bytes, {option});
+			string result = stream_options(bytes, {option}, 256 << 10);
+			string name = string("stream ") + (height < 0 ? "top down " : "") + option;
+
+			check(result.empty() || result == expected, name);
+		}
+	}
+}
+
+// A batch keeps going past files that cannot be read or filtered
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_batch()
+{
+	mkdir("test_batch", 0755);
+	write_bytes("test_batch/a.bmp", synthesize(40, 30, 24));
+	write_bytes("test_batch/b.bmp", synthesize(40, -30, 32));
+	write_bytes("test_batch/c.bmp", "BM not a bitmap");
+	write_bytes("test_batch/d.bmp", synthesize(13, 30, 24));
+
+	Pipeline pipeline;
+	pipeline.add("-g");
+	pipeline.add({STAGE_GLOBAL, "fail", PointOps(), IDENTITY, [](Bitmap & b)
+	{
+		if (b.get_width() == 13)
+		{
+			throw runtime_error("filter failed");
+		}
+	}, 0, 1, true, true, false});
+
+	bool listed = run_batch("test_batch", "test_batch_out", pipeline);
+	string b = read_bytes("test_batch_out/b.bmp");
+
+	check(listed && !read_bytes("test_batch_out/a.bmp").empty() && b == run_options(synthesize(40, -30, 32), {"-g"})
+	      && read_bytes("test_batch_out/c.bmp").empty() && read_bytes("test_batch_out/d.bmp").empty(), "batch isolates failures");
+
+	for (string name : {"a", "b", "c", "d"})
+	{
+		remove(("test_batch/" + name + ".bmp").c_str());
+		remove(("test_batch_out/" + name + ".bmp").c_str());
+	}
+
+	rmdir("test_batch");
+	rmdir("test_batch_out");
+}
+
+// Manifest entries with the same file name do not overwrite each other
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_batch_names()
+{
+	string first = synthesize(40, 30, 24);
+	string second = synthesize(41, 30, 24);
+
+	mkdir("test_batch_a", 0755);
+	mkdir("test_batch_b", 0755);
+	write_bytes("test_batch_a/x.bmp", first);
+	write_bytes("test_batch_b/x.bmp", second);
+	write_bytes("test_batch.txt", "test_batch_a/x.bmp\ntest_batch_b/x.bmp\n");
+
+	Pipeline pipeline;
+	pipeline.add("-i");
+
+	run_batch("test_batch.txt", "test_batch_out", pipeline);
+	check(read_bytes("test_batch_out/x.bmp") == run_options(first, {"-i"}), "batch keeps the first of two outputs named alike");
+
+	remove("test_batch_a/x.bmp");
+	remove("test_batch_b/x.bmp");
+	remove("test_batch_out/x.bmp");
+	remove("test_batch.txt");
+	rmdir("test_batch_a");
+	rmdir("test_batch_b");
+	rmdir("test_batch_out");
+}
+
+// Headers with sizes no pixel array can have are refused, mapped or
+// streamed, before anything is allocated
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_header_sizes()
+{
+	vector<pair<int32_t, int32_t>> sizes =
+	{
+		{-5, 4}, {0, 4}, {4, 0}, {4, INT32_MIN}, {1 << 30, 1}, {1 << 28, 1 << 20}, {1 << 20, -(1 << 20)}, {5, 4}, {4, -5}
+	};
+
+	for (auto & size : sizes)
+	{
+		string bytes = synthesize(4, 4, 24);
+		memcpy(&bytes[18], &size.first, 4);
+		memcpy(&bytes[22], &size.second, 4);
+
+		string name = to_string(size.first) + " x " + to_string(size.second);
+		Bitmap mapped;
+		Bitmap streamed;
+		istringstream in(bytes);
+
+		write_bytes("test_in.bmp", bytes);
+		check(!mapped.load("test_in.bmp"), "mapped load refuses " + name);
+		check(!(in >> streamed), "streamed load refuses " + name);
+		remove("test_in.bmp");
+	}
+}
+
+// Malformed RLE data fails the load, mapped or streamed
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_rle_load()
+{
+	string valid = rle_file(4, 2, string("\x04\x01\x00\x00\x02\x00\x02\x01\x00\x01", 10));
+	string malformed = rle_file(4, 2, string("\x00\x10\x01\x01", 4));		// Absolute run past the end
+
+	for (auto & c : {make_pair(valid, true), make_pair(malformed, false)})
+	{
+		string name = c.second ? "valid" : "malformed";
+		Bitmap mapped;
+		Bitmap streamed;
+		istringstream in(c.first);
+
+		write_bytes("test_in.bmp", c.first);
+		check(mapped.load("test_in.bmp") == c.second, "mapped load of " + name + " RLE8");
+		check((bool) (in >> streamed) == c.second, "streamed load of " + name + " RLE8");
+		remove("test_in.bmp");
+	}
+}
+
+// Check that a filter changes the colors of 32 bit pixels as it does 24
+// bit ones and leaves alpha alone
+// INPUT: Takes the option
+// OUTPUT: Does not return
+static void check_alpha_kept(const string & option)
+{
+	string input = pixels_of(synthesize(37, 23, 32));
+	string colors = pixels_of(run_options(synthesize(37, 23, 24), {option}));
+	string result = pixels_of(run_options(synthesize(37, 23, 32), {option}));
+	int stride = ((37 * 24 + 31) / 32) * 4;
+	bool same = result.size() == input.size();
+
+	for (int y = 0; same && y < 23; y++)
+	{
+		for (int x = 0; x < 37; x++)
+		{
+			size_t p = ((size_t) y * 37 + x) * 4;
+
+			same = same && result.compare(p, 3, colors, (size_t) y * stride + x * 3, 3) == 0 && result[p + 3] == input[p + 3];
+		}
+	}
+
+	check(same, "alpha kept by " + option);
+}
+
+// Rank filters leave alpha alone
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_rank_alpha()
+{
+	for (string option : {"-median=2", "-erode=2", "-dilate=3", "-open=1", "-close=1"})
+	{
+		check_alpha_kept(option);
+	}
+}
+
+// Blurs leave alpha alone
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_blur_alpha()
+{
+	for (string option : {"-b", "-gauss=0.4", "-gauss=1.5", "-box=1", "-box=4", "-rgauss=0.3", "-rgauss=2", "-rgauss=6"})
+	{
+		check_alpha_kept(option);
+	}
+}
+
+// Quantizing to the cell levels without dithering splits values where
+// cellShade() does
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_cell_levels()
+{
+	string bytes = synthesize(256, 1, 24);
+	int stride = ((256 * 24 + 31) / 32) * 4;
+
+	for (int x = 0; x < 256; x++)						// Every value in every channel
+	{
+		memset(&bytes[bytes.size() - stride + x * 3], x, 3);
+	}
+
+	Bitmap plain = decode(bytes);
+	Bitmap quantized = decode(bytes);
+
+	cellShade(plain);
+	dither(quantized, {0, 128, 255}, DITHER_NONE);
+
+	check(encode(plain) == encode(quantized), "cell levels split as cellShade");
+}
+
+// Floyd-Steinberg cell shading of a 24 bit file, one pixel at a time
+// Errors are kept in 1/16ths and rounded as the filter does
+// INPUT: Takes the file bytes
+// OUTPUT: Returns the dithered pixel array
+static string serial_floyd(const string & bytes)
+{
+	int width = (uint8_t) bytes[18] | (uint8_t) bytes[19] << 8;
+	int height = abs(height_of(bytes));
+	int stride = ((width * 24 + 31) / 32) * 4;
+	string pixels = pixels_of(bytes);
+	vector<int> errors((size_t) (height + 1) * (width + 2) * 3, 0);	// A spare row and column on each side
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				auto error = [&](int dx, int dy) -> int & { return errors[((size_t) (y + dy) * (width + 2) + x + 1 + dx) * 3 + c]; };
+				uint8_t & component = (uint8_t &) pixels[(size_t) y * stride + x * 3 + c];
+				int value = (component * 16 + error(0, 0) + 8) >> 4;
+				value = value < 0 ? 0 : value > 255 ? 255 : value;
+				int level = value <= 64 ? 0 : value <= 192 ? 128 : 255;
+				int e = value - level;
+
+				component = level;
+
+				if (x + 1 < width)
+				{
+					error(1, 0) += 7 * e;
+				}
+
+				error(-1, 1) += 3 * e;
+				error(0, 1) += 5 * e;
+				error(1, 1) += e;
+			}
+		}
+	}
+
+	return pixels;
+}
+
+// Error diffusion on many threads matches a serial scan
+// The image spans several tiles each way so neighbouring tiles run at once
+// INPUT: Does not take input parameters
+// OUTPUT: Does not return
+static void test_floyd_threads()
+{
+	string bytes = synthesize(700, 400, 24);
+	string expected = serial_floyd(bytes);
+
+	for (int threads : {1, 2, 3, 4, 8, 16})
+	{
+		set_thread_count(threads);
+
+		for (int run = 0; run < 3; run++)
+		{
+			Bitmap image = decode(bytes);
+			cellShade(image, DITHER_FLOYD_STEINBERG);
+
+			check(pixels_of(encode(image)) == expected, "floyd -j " + to_string(threads) + " run " + to_string(run + 1));
+		}
+	}
+
+	set_thread_count(0);
+}
+
+int main()
+{
+	test_top_down();
+	test_top_down_geometry();
+	test_fixed_kernel<Gaussian5>("fixed Gaussian5");
+	test_fixed_kernel<Sharpen3>("fixed Sharpen3");
+	test_fixed_kernel<Emboss3>("fixed Emboss3");
+	test_fixed_kernel<SobelX3>("fixed SobelX3");
+	test_fixed_kernel<SobelY3>("fixed SobelY3");
+	test_pixelate_large();
+	test_tile_halo();
+	test_pool_limits();
+	test_stream();
+	test_batch();
+	test_batch_names();
+	test_header_sizes();
+	test_rle_load();
+	test_rank_alpha();
+	test_blur_alpha();
+	test_cell_levels();
+	test_floyd_threads();
+
+	cout << (failures == 0 ? "all tests passed" : to_string(failures) + " failed") << endl;
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,314 @@
+#include "threadpool.h"
+
+const int BANDS_PER_THREAD = 4;			// Spare bands per thread for stealing to balance
+const int MIN_BAND_ROWS = 8;			// Smaller bands cost more to schedule than to run
+
+static thread_local int workerIndex = 0;	// Queue of the current thread, 0 outside the pool
+
+// Start a pool running on a number of threads
+// The calling thread counts as one, so n - 1 workers are started
+// INPUT: Takes the thread count
+// OUTPUT: Constructs the pool
+ThreadPool::ThreadPool(int threads) : _queued(0), _stopping(false)
+{
+	threads = threads < 1 ? 1 : threads;
+
+	for (int i = 0; i < threads; i++)
+	{
+		_queues.emplace_back(new Queue);
+	}
+
+	for (int i = 1; i < threads; i++)
+	{
+		_workers.emplace_back(&ThreadPool::work, this, i);
+	}
+}
+
+// Stop and join the workers
+// INPUT: Does not take input parameters
+// OUTPUT: Destroys the pool
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(_sleepLock);
+		_stopping = true;
+	}
+
+	_wake.notify_all();
+
+	for (thread & worker : _workers)
+	{
+		worker.join();
+	}
+}
+
+// Returns the number of threads working on a batch, the caller included
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int ThreadPool::size() const
+{
+	return _queues.size();
+}
+
+// Take a task, first from the front of the thread's own queue and then
+// from the back of the others
+// INPUT: Takes the thread's queue index and the task to fill
+// OUTPUT: Returns false if every queue is empty
+bool ThreadPool::take(int self, Task & task)
+{
+	int count = _queues.size();
+
+	for (int i = 0; i < count; i++)
+	{
+		Queue & queue = *_queues[(self + i) % count];
+		lock_guard<mutex> lock(queue.lock);
+
+		if (!queue.tasks.empty())
+		{
+			if (i == 0)
+			{
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+			}
+			else
+			{
+				task = queue.tasks.back();				// Steal
+				queue.tasks.pop_back();
+			}
+
+			_queued--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Run a task and count it done
+// The count drops under the batch lock so the waiting caller cannot
+// destroy the batch while it is still being signalled
+// INPUT: Takes the task
+// OUTPUT: Does not return
+void ThreadPool::execute(const Task & task)
+{
+	Batch & batch = *task.batch;
+	exception_ptr error;
+
+	try
+	{
+		(*batch.body)(task.index);
+	}
+	catch (...)
+	{
+		error = current_exception();
+	}
+
+	lock_guard<mutex> lock(batch.lock);
+
+	if (error && !batch.error)
+	{
+		batch.error = error;
+	}
+
+	if (--batch.remaining == 0)
+	{
+		batch.done.notify_all();
+	}
+}
+
+// Worker thread body: run tasks until the pool stops
+// INPUT: Takes the worker's queue index
+// OUTPUT: Does not return
+void ThreadPool::work(int self)
+{
+	workerIndex = self;
+
+	while (true)
+	{
+		Task task;
+
+		if (take(self, task))
+		{
+			execute(task);
+			continue;
+		}
+
+		unique_lock<mutex> lock(_sleepLock);
+		_wake.wait(lock, [&] { return _stopping || _queued > 0; });
+
+		if (_stopping && _queued == 0)
+		{
+			return;
+		}
+	}
+}
+
+// Run tasks 0 .. n - 1 and wait for all of them
+// The first exception thrown by a task is rethrown here
+// INPUT: Takes the task count and the task body
+// OUTPUT: Does not return
+void ThreadPool::run(int tasks, const function<void(int)> & body)
+{
+	if (tasks <= 0)
+	{
+		return;
+	}
+
+	if (tasks == 1 || _queues.size() == 1)
+	{
+		for (int i = 0; i < tasks; i++)
+		{
+			body(i);
+		}
+
+		return;
+	}
+
+	Batch batch;
+	batch.body = &body;
+	batch.remaining = tasks;
+
+	int self = workerIndex;
+	int count = _queues.size();
+
+	for (int q = 0; q < count; q++)						// Contiguous runs, starting with our own queue
+	{
+		Queue & queue = *_queues[(self + q) % count];
+		int first = (long long) tasks * q / count;
+		int last = (long long) tasks * (q + 1) / count;
+		lock_guard<mutex> lock(queue.lock);
+
+		for (int i = first; i < last; i++)
+		{
+			queue.tasks.push_back({&batch, i});
+		}
+	}
+
+	{
+		lock_guard<mutex> lock(_sleepLock);
+		_queued += tasks;
+	}
+
+	_wake.notify_all();
+
+	Task task;
+
+	while (batch.remaining > 0 && take(self, task))				// Help until the queues run dry
+	{
+		execute(task);
+	}
+
+	unique_lock<mutex> lock(batch.lock);
+	batch.done.wait(lock, [&] { return batch.remaining == 0; });
+
+	if (batch.error)
+	{
+		rethrow_exception(batch.error);
+	}
+}
+
+static mutex poolLock;				// Guards the shared pool
+static unique_ptr<ThreadPool> sharedPool;
+static int requestedThreads = 0;		// 0 picks every core
+
+// Returns the pool shared by all filters, started on first use
+// INPUT: Does not take input parameters
+// OUTPUT: Returns a reference to the pool
+ThreadPool & thread_pool()
+{
+	lock_guard<mutex> lock(poolLock);
+
+	if (!sharedPool)
+	{
+		int threads = requestedThreads > 0 ? requestedThreads : (int) thread::hardware_concurrency();
+		sharedPool.reset(new ThreadPool(threads > 0 ? threads : 1));
+	}
+
+	return *sharedPool;
+}
+
+// Resize the shared pool
+// Must not be called while filters are running
+// INPUT: Takes the thread count, 0 uses every core
+// OUTPUT: Does not return
+void set_thread_count(int threads)
+{
+	lock_guard<mutex> lock(poolLock);
+
+	requestedThreads = threads < 0 ? 0 : threads;
+	sharedPool.reset();
+}
+
+// Returns the number of threads the shared pool runs on
+// INPUT: Does not take input parameters
+// OUTPUT: Returns an integer
+int thread_count()
+{
+	return thread_pool().size();
+}
+
+// Split rows into bands and run them on the shared pool
+// INPUT: Takes the row count, the band body, the halo in rows and the
+// alignment of band starts
+// OUTPUT: Does not return
+void parallel_rows(int height, const function<void(const Band &)> & body, int halo, int alignment)
+{
+	if (height <= 0)
+	{
+		return;
+	}
+
+	ThreadPool & pool = thread_pool();
+	alignment = alignment < 1 ? 1 : alignment > height ? height : alignment;	// One band holds any larger block
+	halo = halo > height ? height : halo;
+
+	int rows = (height + pool.size() * BANDS_PER_THREAD - 1) / (pool.size() * BANDS_PER_THREAD);
+	rows = rows < MIN_BAND_ROWS ? MIN_BAND_ROWS : rows;
+	rows = (rows + alignment - 1) / alignment * alignment;			// Whole blocks per band
+
+	int bands = (height + rows - 1) / rows;
+
+	pool.run(bands, [&](int i)
+	{
+		Band band;
+		band.first = i * rows;
+		band.last = band.first + rows < height ? band.first + rows : height;
+		band.top = band.first - halo < 0 ? 0 : band.first - halo;
+		band.bottom = band.last + halo > height ? height : band.last + halo;
+
+		body(band);
+	});
+}
+
+// Split an area into square tiles and run them on the shared pool
+// INPUT: Takes the area size, the tile edge, the tile body and the halo
+// in pixels
+// OUTPUT: Does not return
+void parallel_tiles(int width, int height, int edge, const function<void(const Tile &)> & body, int halo)
+{
+	if (width <= 0 || height <= 0)
+	{
+		return;
+	}
+
+	int limit = width > height ? width : height;
+	halo = halo > limit ? limit : halo;
+
+	int across = (width + edge - 1) / edge;
+	int down = (height + edge - 1) / edge;
+
+	thread_pool().run(across * down, [&](int i)
+	{
+		Tile tile;
+		tile.x = i % across * edge;
+		tile.y = i / across * edge;
+		tile.width = tile.x + edge < width ? edge : width - tile.x;
+		tile.height = tile.y + edge < height ? edge : height - tile.y;
+		tile.left = tile.x - halo < 0 ? 0 : tile.x - halo;
+		tile.right = tile.x + tile.width + halo > width ? width : tile.x + tile.width + halo;
+		tile.top = tile.y - halo < 0 ? 0 : tile.y - halo;
+		tile.bottom = tile.y + tile.height + halo > height ? height : tile.y + tile.height + halo;
+
+		body(tile);
+	});
+}
@@ -0,0 +1,104 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Fixed set of worker threads running batches of numbered tasks
+// Every worker owns a queue; a batch is dealt out in contiguous runs so
+// neighbouring tasks start on the same thread, each thread takes from the
+// front of its own queue and, once that is empty, steals from the back of
+// another. The thread calling run() works on the batch too, so nested
+// calls from inside a task cannot deadlock.
+class ThreadPool
+{
+	private:
+
+		struct Batch				// Tasks handed to one run() call
+		{
+			const function<void(int)> * body;
+			atomic<int> remaining;			// Tasks not yet finished
+			exception_ptr error;			// First exception thrown by a task
+			mutex lock;
+			condition_variable done;
+		};
+
+		struct Task				// One task of a batch
+		{
+			Batch * batch;
+			int index;
+		};
+
+		struct Queue				// Tasks waiting for one thread
+		{
+			mutex lock;
+			deque<Task> tasks;
+		};
+
+		vector<unique_ptr<Queue>> _queues;	// Queue 0 is shared by threads outside the pool
+		vector<thread> _workers;
+		mutex _sleepLock;			// Guards sleeping workers
+		condition_variable _wake;
+		atomic<int> _queued;			// Tasks sitting in queues
+		bool _stopping;
+
+		bool take(int, Task &);			// Own queue first, then steal
+		void execute(const Task &);		// Run a task and count it done
+		void work(int);				// Worker thread body
+
+	public:
+
+		ThreadPool(int);			// Start a pool running on this many threads
+		~ThreadPool();				// Stop and join the workers
+		ThreadPool(const ThreadPool &) = delete;
+		ThreadPool & operator=(const ThreadPool &) = delete;
+
+		int size() const;			// Threads working on a batch, the caller included
+		void run(int, const function<void(int)> &);	// Run tasks 0 .. n - 1 and wait for them
+};
+
+ThreadPool & thread_pool();			// Pool shared by all filters
+void set_thread_count(int);			// Resize the shared pool, 0 uses every core
+int thread_count();				// Threads the shared pool runs on
+
+// Rows [first, last) of a band plus the rows [top, bottom) around it
+// that are inside the image and within the halo
+struct Band
+{
+	int first;
+	int last;
+	int top;
+	int bottom;
+};
+
+// Output region of a 2-D tile plus the columns [left, right) and rows
+// [top, bottom) around it that are inside the area and within the halo
+struct Tile
+{
+	int x;
+	int y;
+	int width;
+	int height;
+	int left;
+	int right;
+	int top;
+	int bottom;
+};
+
+// Split rows into bands and run them on the shared pool
+// Bands start on multiples of the alignment (block filters need whole blocks)
+void parallel_rows(int height, const function<void(const Band &)> & body, int halo = 0, int alignment = 1);
+
+// Split an area into square tiles and run them on the shared pool
+void parallel_tiles(int width, int height, int edge, const function<void(const Tile &)> & body, int halo = 0);
+
+#endif